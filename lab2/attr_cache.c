@@ -0,0 +1,321 @@
+/*
+ * In memory cache for remote attributes and directory listings.
+ *
+ * Every getattr used to be a sftp_lstat round trip, so ls -l on a
+ * directory with N files cost N+1 round trips. readdir already gets
+ * the attributes of every entry from the server, we keep them here
+ * for ttl seconds. Lookups of missing files (shells and editors do a
+ * lot of these) are remembered as negative entries.
+ *
+ * Entries live in a chained hash table keyed by the path as seen by
+ * fuse. One lock for the whole table, the critical sections are tiny
+ * compared to a network round trip.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "path_hash.h"
+#include "attr_cache.h"
+
+#define ATTR_CACHE_BUCKETS 4096
+#define ATTR_CACHE_MAX_ENTRIES 65536
+
+struct attr_entry {
+  char *path;
+  int has_stat;
+  int negative;
+  struct stat st;
+  double expires;      // expiry of st / negative
+  char **names;        // directory listing, NULL if not cached
+  int count;
+  double dir_expires;  // expiry of the listing
+  struct attr_entry *next;
+};
+
+static struct attr_entry *buckets[ATTR_CACHE_BUCKETS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static double cache_ttl = 0;
+static double cache_negative_ttl = 0;
+static int nentries = 0;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void free_names(struct attr_entry *e)
+{
+  int i;
+  for (i = 0; i < e->count; ++i)
+    free(e->names[i]);
+  free(e->names);
+  e->names = NULL;
+  e->count = 0;
+}
+
+static void free_entry(struct attr_entry *e)
+{
+  free_names(e);
+  free(e->path);
+  free(e);
+  nentries--;
+}
+
+static struct attr_entry *lookup(const char *path)
+{
+  struct attr_entry *e;
+  for (e = buckets[path_hash(path, ATTR_CACHE_BUCKETS)]; e != NULL; e = e->next)
+    if (strcmp(e->path, path) == 0)
+      return e;
+  return NULL;
+}
+
+/*
+ * Drop everything that has expired. Only called when the table is
+ * getting big so we don't grow without bound on huge trees.
+ *
+ * */
+static void sweep(double t)
+{
+  int i;
+  struct attr_entry **pe, *e;
+
+  for (i = 0; i < ATTR_CACHE_BUCKETS; ++i) {
+    pe = &buckets[i];
+    while ((e = *pe) != NULL) {
+      if (e->expires <= t && e->dir_expires <= t) {
+        *pe = e->next;
+        free_entry(e);
+      } else {
+        pe = &e->next;
+      }
+    }
+  }
+}
+
+static struct attr_entry *lookup_or_create(const char *path)
+{
+  struct attr_entry *e = lookup(path);
+  unsigned int h;
+
+  if (e != NULL)
+    return e;
+
+  if (nentries >= ATTR_CACHE_MAX_ENTRIES)
+    sweep(now());
+
+  e = calloc(1, sizeof(struct attr_entry));
+  if (e == NULL)
+    return NULL;
+  e->path = strdup(path);
+  if (e->path == NULL) {
+    free(e);
+    return NULL;
+  }
+  h = path_hash(path, ATTR_CACHE_BUCKETS);
+  e->next = buckets[h];
+  buckets[h] = e;
+  nentries++;
+  return e;
+}
+
+static void remove_entry(const char *path)
+{
+  struct attr_entry **pe, *e;
+
+  for (pe = &buckets[path_hash(path, ATTR_CACHE_BUCKETS)]; (e = *pe) != NULL; pe = &e->next) {
+    if (strcmp(e->path, path) == 0) {
+      *pe = e->next;
+      free_entry(e);
+      return;
+    }
+  }
+}
+
+void attr_cache_init(double ttl, double negative_ttl)
+{
+  cache_ttl = ttl;
+  cache_negative_ttl = negative_ttl;
+}
+
+int attr_cache_get(const char *path, struct stat *stbuf)
+{
+  struct attr_entry *e;
+  int ret = 0;
+
+  if (cache_ttl <= 0 && cache_negative_ttl <= 0)
+    return 0;
+
+  pthread_mutex_lock(&cache_lock);
+  e = lookup(path);
+  if (e != NULL && e->expires > now()) {
+    if (e->negative) {
+      ret = -ENOENT;
+    } else if (e->has_stat) {
+      memcpy(stbuf, &e->st, sizeof(struct stat));
+      ret = 1;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+void attr_cache_put(const char *path, const struct stat *stbuf)
+{
+  struct attr_entry *e;
+
+  if (cache_ttl <= 0)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+  if ((e = lookup_or_create(path)) != NULL) {
+    memcpy(&e->st, stbuf, sizeof(struct stat));
+    e->has_stat = 1;
+    e->negative = 0;
+    e->expires = now() + cache_ttl;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void attr_cache_put_negative(const char *path)
+{
+  struct attr_entry *e;
+
+  if (cache_negative_ttl <= 0)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+  if ((e = lookup_or_create(path)) != NULL) {
+    e->has_stat = 0;
+    e->negative = 1;
+    e->expires = now() + cache_negative_ttl;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Takes ownership of names and the strings in it.
+ *
+ * */
+void attr_cache_put_dir(const char *path, char **names, int count)
+{
+  struct attr_entry *e;
+  int i;
+
+  pthread_mutex_lock(&cache_lock);
+  if (cache_ttl <= 0 || (e = lookup_or_create(path)) == NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    for (i = 0; i < count; ++i)
+      free(names[i]);
+    free(names);
+    return;
+  }
+  free_names(e);
+  e->names = names;
+  e->count = count;
+  e->dir_expires = now() + cache_ttl;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int attr_cache_fill_dir(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+  struct attr_entry *e, *child;
+  char cpath[PATH_MAX];
+  struct stat st;
+  int i, hit = 0;
+  double t;
+
+  if (cache_ttl <= 0)
+    return 0;
+
+  pthread_mutex_lock(&cache_lock);
+  t = now();
+  e = lookup(path);
+  if (e != NULL && e->names != NULL && e->dir_expires > t) {
+    hit = 1;
+    for (i = 0; i < e->count; ++i) {
+      // hand the cached attributes along, saves the kernel a getattr
+      snprintf(cpath, PATH_MAX, "%s/%s", strcmp(path, "/") ? path : "", e->names[i]);
+      child = lookup(cpath);
+      if (child != NULL && child->has_stat && child->expires > t) {
+        memcpy(&st, &child->st, sizeof(struct stat));
+        filler(buf, e->names[i], &st, 0);
+      } else {
+        filler(buf, e->names[i], NULL, 0);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return hit;
+}
+
+void attr_cache_invalidate(const char *path)
+{
+  char parent[PATH_MAX];
+  struct attr_entry *e;
+  char *slash;
+
+  pthread_mutex_lock(&cache_lock);
+  remove_entry(path);
+
+  strncpy(parent, path, PATH_MAX - 1);
+  parent[PATH_MAX - 1] = '\0';
+  slash = strrchr(parent, '/');
+  if (slash != NULL) {
+    if (slash == parent)
+      slash[1] = '\0'; // parent is the root
+    else
+      *slash = '\0';
+    if ((e = lookup(parent)) != NULL)
+      free_names(e);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Walks the whole table, only for renames of directories.
+ *
+ * */
+void attr_cache_invalidate_tree(const char *path)
+{
+  struct attr_entry **pe, *e;
+  size_t len = strlen(path);
+  int i;
+
+  pthread_mutex_lock(&cache_lock);
+  for (i = 0; i < ATTR_CACHE_BUCKETS; ++i) {
+    pe = &buckets[i];
+    while ((e = *pe) != NULL) {
+      if (strncmp(e->path, path, len) == 0 && e->path[len] == '/') {
+        *pe = e->next;
+        free_entry(e);
+      } else {
+        pe = &e->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void attr_cache_destroy()
+{
+  int i;
+  struct attr_entry *e, *next;
+
+  pthread_mutex_lock(&cache_lock);
+  for (i = 0; i < ATTR_CACHE_BUCKETS; ++i) {
+    for (e = buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      free_entry(e);
+    }
+    buckets[i] = NULL;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
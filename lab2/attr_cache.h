@@ -0,0 +1,35 @@
+#ifndef _ATTR_CACHE_H_
+#define _ATTR_CACHE_H_
+
+#include <sys/stat.h>
+#include "state.h"
+
+// set the time to live (in seconds) for positive and negative entries.
+// a ttl of 0 disables that kind of caching.
+void attr_cache_init(double ttl, double negative_ttl);
+
+// returns 1 on hit (stbuf filled), -ENOENT on a negative hit, 0 on miss
+int attr_cache_get(const char *path, struct stat *stbuf);
+
+// remember the attributes of path
+void attr_cache_put(const char *path, const struct stat *stbuf);
+
+// remember that path does not exist on the remote side
+void attr_cache_put_negative(const char *path);
+
+// remember the names listed under a directory
+void attr_cache_put_dir(const char *path, char **names, int count);
+
+// fill the directory listing from cache. returns 1 on hit, 0 on miss
+int attr_cache_fill_dir(const char *path, void *buf, fuse_fill_dir_t filler);
+
+// drop the attributes of path and the listing of its parent directory
+void attr_cache_invalidate(const char *path);
+
+// drop everything cached under the directory path (it was renamed)
+void attr_cache_invalidate_tree(const char *path);
+
+// free all the entries
+void attr_cache_destroy();
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "city_hash.h"
+
+/*
+ * Where the files really live. netfs only talks to the remote side
+ * through these calls, paths are relative to the backend root and
+ * start with '/'. All of them return 0 (or a byte count) on success
+ * and -errno on failure, and must be safe to call from several
+ * threads at once.
+ *
+ * */
+
+// called by list for every entry of a directory
+typedef int (*backend_fill_t)(void *ctx, const char *name, const struct stat *st);
+
+struct netfs_backend {
+  const char *name;
+
+  // attributes of path, -ENOENT if it doesn't exist
+  int (*stat)(struct netfs_backend *be, const char *path, struct stat *st);
+
+  // call fill for each entry of the directory, with its attributes
+  int (*list)(struct netfs_backend *be, const char *path, backend_fill_t fill, void *ctx);
+
+  // copy [offset, offset + len) of path into fd at the same offset.
+  // len < 0 means up to the end of the file. returns bytes copied
+  ssize_t (*read_range)(struct netfs_backend *be, const char *path, int fd,
+      off_t offset, off_t len);
+
+  // copy [offset, offset + len) of fd into path at the same offset,
+  // creating path with mode if it doesn't exist. returns bytes copied
+  ssize_t (*write_range)(struct netfs_backend *be, const char *path, int fd,
+      off_t offset, off_t len, mode_t mode);
+
+  // set the size of path
+  int (*truncate)(struct netfs_backend *be, const char *path, off_t size);
+
+  // make an empty file with mode, emptying path if it exists
+  int (*create)(struct netfs_backend *be, const char *path, mode_t mode);
+
+  int (*mkdir)(struct netfs_backend *be, const char *path, mode_t mode);
+  int (*unlink)(struct netfs_backend *be, const char *path);
+  int (*rmdir)(struct netfs_backend *be, const char *path);
+
+  // move from to to, replacing to if it is a file
+  int (*rename)(struct netfs_backend *be, const char *from, const char *to);
+
+  int (*chmod)(struct netfs_backend *be, const char *path, mode_t mode);
+
+  // set access and modification time, both given
+  int (*utimens)(struct netfs_backend *be, const char *path,
+      const struct timespec ts[2]);
+
+  // CityHash128 of each block_size block of path (the last one may be
+  // shorter), computed on the remote side. returns the number of
+  // blocks, -ENOSYS if the remote side can't do it, -ERANGE if there
+  // are more than max
+  int (*block_hashes)(struct netfs_backend *be, const char *path,
+      size_t block_size, struct city128 *hashes, int max);
+
+  void (*destroy)(struct netfs_backend *be);
+};
+
+// the remote directory rootdir on hostname, over a pool of connections.
+// compression is the zlib level of the ssh transport, 0 = off
+struct netfs_backend *backend_sftp_new(char *username, char *hostname,
+    const char *rootdir, int connections, int compression);
+
+// a local directory pretending to be remote. every call costs
+// latency_ms, and data moves at bandwidth_kbs KB/s (0 = unlimited),
+// a single call at no more than stream_kbs KB/s (0 = unlimited).
+// with compression > 0 data crosses the link deflated at that level
+// whenever it pays off, with sparse holes and zeros don't cross it
+struct netfs_backend *backend_local_new(const char *rootdir,
+    double latency_ms, double bandwidth_kbs, double stream_kbs,
+    int compression, int sparse);
+
+// inner with every call timed into the stats
+struct netfs_backend *backend_stats_new(struct netfs_backend *inner);
+
+#endif
@@ -0,0 +1,418 @@
+/*
+ * A local directory standing in for the remote server.
+ *
+ * Meant for benchmarking the caches on one machine without an ssh
+ * server. Every call sleeps latency_ms, as if it were a round trip,
+ * and data is paced through a single link of bandwidth_kbs shared by
+ * all threads, so concurrent transfers compete the way they would on
+ * a real network. Data chunks can be compressed before they are put
+ * on the link, see link_comp.c. A per call stream_kbs stands for what
+ * one ssh channel manages (window, one core doing the cipher), so
+ * several calls at once can go faster than one. With sparse set, holes
+ * and zero chunks stay off the link, like a protocol that knows about
+ * holes would do.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "backend.h"
+#include "link_comp.h"
+#include "sparse.h"
+
+#define LOCAL_CHUNK 65536
+
+struct local_backend {
+  struct netfs_backend be;
+  char rootdir[PATH_MAX];
+  double latency;       // seconds per call
+  double bandwidth;     // bytes per second, 0 = unlimited
+  double stream_bw;     // bytes per second of a single call, 0 = unlimited
+  double link_free;     // when the link is done with what's queued on it
+  pthread_mutex_t link_lock;
+  struct link_comp comp;
+  int sparse;           // holes and zeros don't cross the link
+};
+
+#define LOCAL(be) ((struct local_backend *)(be))
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+  struct timespec ts;
+  double d = t - now();
+
+  if (d <= 0)
+    return;
+  ts.tv_sec = (time_t)d;
+  ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+  nanosleep(&ts, NULL);
+}
+
+static void round_trip(struct netfs_backend *be)
+{
+  if (LOCAL(be)->latency > 0)
+    sleep_until(now() + LOCAL(be)->latency);
+}
+
+/*
+ * Book nbytes worth of time on the link and wait for our turn to be
+ * over.
+ *
+ * */
+static void transfer(struct netfs_backend *be, size_t nbytes)
+{
+  struct local_backend *lb = LOCAL(be);
+  double start, done;
+
+  if (lb->bandwidth <= 0)
+    return;
+
+  pthread_mutex_lock(&lb->link_lock);
+  start = now();
+  if (lb->link_free > start)
+    start = lb->link_free;
+  done = start + nbytes / lb->bandwidth;
+  lb->link_free = done;
+  pthread_mutex_unlock(&lb->link_lock);
+
+  sleep_until(done);
+}
+
+/*
+ * Hold a call that started at start and moved nbytes back to the pace
+ * of one stream.
+ *
+ * */
+static void stream_pace(struct netfs_backend *be, double start, size_t nbytes)
+{
+  if (LOCAL(be)->stream_bw > 0)
+    sleep_until(start + nbytes / LOCAL(be)->stream_bw);
+}
+
+static void local_fullpath(struct netfs_backend *be, char fpath[PATH_MAX], const char *path)
+{
+  snprintf(fpath, PATH_MAX, "%s%s", LOCAL(be)->rootdir, path);
+}
+
+static int local_stat(struct netfs_backend *be, const char *path, struct stat *st)
+{
+  char fpath[PATH_MAX];
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if (lstat(fpath, st) == -1)
+    return -errno;
+  return 0;
+}
+
+static int local_list(struct netfs_backend *be, const char *path,
+    backend_fill_t fill, void *ctx)
+{
+  char fpath[PATH_MAX];
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir;
+  int rc = 0;
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if ((dir = opendir(fpath)) == NULL)
+    return -errno;
+
+  // sftp sends the attributes along with the names, so do we
+  while (rc == 0 && (entry = readdir(dir)) != NULL) {
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+      continue; // gone in the meantime
+    transfer(be, sizeof(struct stat) + strlen(entry->d_name));
+    rc = fill(ctx, entry->d_name, &st);
+  }
+  closedir(dir);
+  return rc;
+}
+
+/*
+ * Copy [offset, offset + len) of sfd to dfd at the same offsets over
+ * the link, stopping early where sfd ends (len < 0: at its end). With sparse on, holes of sfd and
+ * chunks of zeros don't travel, dfd gets a hole there instead.
+ * Returns the bytes copied, holes included.
+ *
+ * */
+static ssize_t local_copy(struct netfs_backend *be, int sfd, int dfd,
+    off_t offset, off_t len, double start)
+{
+  struct local_backend *lb = LOCAL(be);
+  off_t pos = offset, end, data, data_end;
+  ssize_t nbytes, sent = 0;
+  struct stat st;
+  size_t want;
+  char *buf;
+
+  if (fstat(sfd, &st) == -1)
+    return -errno;
+  end = len < 0 || st.st_size < offset + len ? st.st_size : offset + len;
+  if ((buf = malloc(LOCAL_CHUNK)) == NULL)
+    return -ENOMEM;
+
+  while (pos < end) {
+    data = pos;
+    data_end = lb->sparse ? sparse_next_data(sfd, &data, end) : end;
+    if (data > pos && sparse_zero_range(dfd, pos, data - pos) < 0)
+      goto fail;
+
+    for (pos = data; pos < data_end; pos += nbytes) {
+      want = LOCAL_CHUNK;
+      if (data_end - pos < (off_t)want)
+        want = data_end - pos;
+
+      nbytes = pread(sfd, buf, want, pos);
+      if (nbytes == 0)
+        goto done; // got shorter since we looked
+      if (nbytes < 0)
+        goto fail;
+      if (lb->sparse && sparse_is_zero(buf, nbytes)) {
+        if (sparse_zero_range(dfd, pos, nbytes) < 0)
+          goto fail;
+        continue;
+      }
+      transfer(be, link_comp_send(&lb->comp, buf, nbytes, lb->bandwidth));
+      if (pwrite(dfd, buf, nbytes, pos) != nbytes)
+        goto fail;
+      sent += nbytes;
+      stream_pace(be, start, sent);
+    }
+  }
+done:
+  free(buf);
+  return pos - offset;
+fail:
+  free(buf);
+  return -EIO;
+}
+
+static ssize_t local_read_range(struct netfs_backend *be, const char *path,
+    int fd, off_t offset, off_t len)
+{
+  char fpath[PATH_MAX];
+  ssize_t total;
+  double start;
+  int rfd;
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  start = now();
+  if ((rfd = open(fpath, O_RDONLY)) == -1)
+    return -errno;
+  total = local_copy(be, rfd, fd, offset, len, start);
+  close(rfd);
+  return total;
+}
+
+static ssize_t local_write_range(struct netfs_backend *be, const char *path,
+    int fd, off_t offset, off_t len, mode_t mode)
+{
+  char fpath[PATH_MAX];
+  ssize_t total;
+  double start;
+  int wfd;
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  start = now();
+  if ((wfd = open(fpath, O_WRONLY | O_CREAT, mode & 0777)) == -1)
+    return -errno;
+  // a cache file shorter than the range has nothing more to send
+  total = local_copy(be, fd, wfd, offset, len, start);
+  close(wfd);
+  return total;
+}
+
+static int local_truncate(struct netfs_backend *be, const char *path, off_t size)
+{
+  char fpath[PATH_MAX];
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if (truncate(fpath, size) == -1)
+    return -errno;
+  return 0;
+}
+
+static int local_create(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  char fpath[PATH_MAX];
+  int fd;
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if ((fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC, mode & 07777)) == -1)
+    return -errno;
+  close(fd);
+  return 0;
+}
+
+static int local_mkdir(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  char fpath[PATH_MAX];
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if (mkdir(fpath, mode & 07777) == -1)
+    return -errno;
+  return 0;
+}
+
+static int local_unlink(struct netfs_backend *be, const char *path)
+{
+  char fpath[PATH_MAX];
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if (unlink(fpath) == -1)
+    return -errno;
+  return 0;
+}
+
+static int local_rmdir(struct netfs_backend *be, const char *path)
+{
+  char fpath[PATH_MAX];
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if (rmdir(fpath) == -1)
+    return -errno;
+  return 0;
+}
+
+static int local_rename(struct netfs_backend *be, const char *from, const char *to)
+{
+  char ffrom[PATH_MAX], fto[PATH_MAX];
+
+  local_fullpath(be, ffrom, from);
+  local_fullpath(be, fto, to);
+  round_trip(be);
+  if (rename(ffrom, fto) == -1)
+    return -errno;
+  return 0;
+}
+
+static int local_chmod(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  char fpath[PATH_MAX];
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if (chmod(fpath, mode & 07777) == -1)
+    return -errno;
+  return 0;
+}
+
+static int local_utimens(struct netfs_backend *be, const char *path,
+    const struct timespec ts[2])
+{
+  char fpath[PATH_MAX];
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if (utimensat(AT_FDCWD, fpath, ts, AT_SYMLINK_NOFOLLOW) == -1)
+    return -errno;
+  return 0;
+}
+
+/*
+ * The "server" hashes its own copy, only the hashes cross the link,
+ * like an rsync style checksum request would.
+ *
+ * */
+static int local_block_hashes(struct netfs_backend *be, const char *path,
+    size_t block_size, struct city128 *hashes, int max)
+{
+  char fpath[PATH_MAX];
+  char *buf;
+  ssize_t nbytes;
+  int rfd, count = 0;
+
+  local_fullpath(be, fpath, path);
+  round_trip(be);
+  if ((rfd = open(fpath, O_RDONLY)) == -1)
+    return -errno;
+  if ((buf = malloc(block_size)) == NULL) {
+    close(rfd);
+    return -ENOMEM;
+  }
+
+  while ((nbytes = pread(rfd, buf, block_size, (off_t)count * block_size)) > 0) {
+    if (count == max) {
+      count = -ERANGE;
+      break;
+    }
+    city_hash128(buf, nbytes, &hashes[count++]);
+  }
+  if (nbytes < 0)
+    count = -errno;
+  if (count > 0)
+    transfer(be, count * sizeof(struct city128));
+  free(buf);
+  close(rfd);
+  return count;
+}
+
+static void local_destroy(struct netfs_backend *be)
+{
+  link_comp_destroy(&LOCAL(be)->comp);
+  pthread_mutex_destroy(&LOCAL(be)->link_lock);
+  free(be);
+}
+
+struct netfs_backend *backend_local_new(const char *rootdir,
+    double latency_ms, double bandwidth_kbs, double stream_kbs, int compression,
+    int sparse)
+{
+  struct local_backend *lb = calloc(1, sizeof(struct local_backend));
+
+  if (lb == NULL)
+    return NULL;
+
+  if (realpath(rootdir, lb->rootdir) == NULL) {
+    perror(rootdir);
+    free(lb);
+    return NULL;
+  }
+  lb->latency = latency_ms / 1000;
+  lb->bandwidth = bandwidth_kbs * 1024;
+  lb->stream_bw = stream_kbs * 1024;
+  pthread_mutex_init(&lb->link_lock, NULL);
+  link_comp_init(&lb->comp, compression);
+  lb->sparse = sparse;
+
+  lb->be.name = "local";
+  lb->be.stat = local_stat;
+  lb->be.list = local_list;
+  lb->be.read_range = local_read_range;
+  lb->be.write_range = local_write_range;
+  lb->be.truncate = local_truncate;
+  lb->be.create = local_create;
+  lb->be.mkdir = local_mkdir;
+  lb->be.unlink = local_unlink;
+  lb->be.rmdir = local_rmdir;
+  lb->be.rename = local_rename;
+  lb->be.chmod = local_chmod;
+  lb->be.utimens = local_utimens;
+  lb->be.block_hashes = local_block_hashes;
+  lb->be.destroy = local_destroy;
+  return &lb->be;
+}
@@ -0,0 +1,449 @@
+/*
+ * The sftp backend. Everything netfs used to do with libssh directly,
+ * on connections checked out of the pool for the length of a call.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "backend.h"
+#include "sftp_pool.h"
+
+#define SFTP_CHUNK 16384
+
+struct sftp_backend {
+  struct netfs_backend be;
+  char rootdir[PATH_MAX];
+};
+
+/*
+ * Get the full path of given resource
+ *
+ * */
+static void sftp_fullpath(struct netfs_backend *be, char fpath[PATH_MAX], const char *path)
+{
+  snprintf(fpath, PATH_MAX, "%s%s", ((struct sftp_backend *)be)->rootdir, path);
+}
+
+static int sftp_errno(struct sftp_conn *conn)
+{
+  switch (sftp_get_error(conn->sftp)) {
+    case SSH_FX_NO_SUCH_FILE:
+      return -ENOENT;
+    case SSH_FX_PERMISSION_DENIED:
+      return -EACCES;
+    case SSH_FX_FILE_ALREADY_EXISTS:
+      return -EEXIST;
+    default:
+      return -EIO;
+  }
+}
+
+/*
+ * Convert the attributes sent by the sftp server to stat structure.
+ *
+ * */
+static void sftp_attributes_to_stat(struct stat *stbuf, sftp_attributes attributes)
+{
+  memset(stbuf, 0, sizeof(struct stat));
+
+  // name and group name are only set if openssh is used.
+  // fprintf(stderr, "owner name %s: group name %s", attributes->owner, attributes->group);
+  stbuf->st_mode = attributes->permissions;
+  stbuf->st_uid = attributes->uid;
+  stbuf->st_gid = attributes->gid;
+  stbuf->st_size = attributes->size;
+  stbuf->st_atime = attributes->atime;
+  stbuf->st_ctime = attributes->createtime;
+  stbuf->st_mtime = attributes->mtime;
+  stbuf->st_nlink = 1; // figure out a way to get hard link count
+}
+
+static int sftp_be_stat(struct netfs_backend *be, const char *path, struct stat *st)
+{
+  char fpath[PATH_MAX];
+  sftp_attributes attributes;
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  if ((attributes = sftp_lstat(conn->sftp, fpath)) == NULL) {
+    rc = sftp_errno(conn);
+    if (rc != -ENOENT)
+      fprintf(stderr, "Unable to stat file/directory: %s\n", ssh_get_error(conn->session));
+  } else {
+    sftp_attributes_to_stat(st, attributes);
+    sftp_attributes_free(attributes);
+  }
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static int sftp_be_list(struct netfs_backend *be, const char *path,
+    backend_fill_t fill, void *ctx)
+{
+  char fpath[PATH_MAX];
+  sftp_dir dir;
+  sftp_attributes attributes;
+  struct sftp_conn *conn;
+  struct stat st;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  dir = sftp_opendir(conn->sftp, fpath);
+  if (!dir) {
+    fprintf(stderr, "Directory not opened: %s\n",
+        ssh_get_error(conn->session));
+    rc = sftp_errno(conn);
+    sftp_pool_put(conn);
+    return rc;
+  }
+
+  while ((attributes = sftp_readdir(conn->sftp, dir)) != NULL) {
+    sftp_attributes_to_stat(&st, attributes);
+    if (rc == 0)
+      rc = fill(ctx, attributes->name, &st);
+    sftp_attributes_free(attributes);
+  }
+
+  if (!sftp_dir_eof(dir)) {
+    fprintf(stderr, "Can't list directory: %s\n", ssh_get_error(conn->session));
+    rc = -EIO;
+  }
+
+  if (sftp_closedir(dir) != SSH_OK) {
+    fprintf(stderr, "Can't close directory: %s\n",
+        ssh_get_error(conn->session));
+    rc = -EIO;
+  }
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static ssize_t sftp_be_read_range(struct netfs_backend *be, const char *path,
+    int fd, off_t offset, off_t len)
+{
+  char fpath[PATH_MAX];
+  char buffer[SFTP_CHUNK];
+  struct sftp_conn *conn;
+  ssize_t nbytes, total = 0;
+  size_t want;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  /* open the remote file */
+  sftp_file file = sftp_open(conn->sftp, fpath, O_RDONLY, 0);
+  if (file == NULL) {
+    fprintf(stderr, "no podia abrir la ficha. %s\n", ssh_get_error(conn->session));
+    total = sftp_errno(conn);
+    sftp_pool_put(conn);
+    return total;
+  }
+  if (offset > 0 && sftp_seek64(file, offset) < 0) {
+    total = -EIO;
+    goto out;
+  }
+
+  /* read from remote and write to local */
+  while (len < 0 || total < len) {
+    want = sizeof(buffer);
+    if (len >= 0 && len - total < (off_t)want)
+      want = len - total;
+
+    nbytes = sftp_read(file, buffer, want);
+    if (nbytes == 0) {
+      break; // EOF
+    } else if (nbytes < 0) {
+      fprintf(stderr, "Error while reading file: %s\n",
+          ssh_get_error(conn->session));
+      total = -EIO;
+      break;
+    }
+    if (pwrite(fd, buffer, nbytes, offset + total) != nbytes) {
+      fprintf(stderr, "Error writing: %s\n",
+          strerror(errno));
+      total = -EIO;
+      break;
+    }
+    total += nbytes;
+  }
+
+out:
+  sftp_close(file);
+  sftp_pool_put(conn);
+  return total;
+}
+
+static ssize_t sftp_be_write_range(struct netfs_backend *be, const char *path,
+    int fd, off_t offset, off_t len, mode_t mode)
+{
+  char fpath[PATH_MAX];
+  char buf[SFTP_CHUNK];
+  struct sftp_conn *conn;
+  ssize_t nbytes, total = 0;
+  size_t want;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  sftp_file remotefile = sftp_open(conn->sftp, fpath, O_WRONLY | O_CREAT, mode & 0777);
+  if (remotefile == NULL) {
+    fprintf(stderr, "I couldn't open remote %s for writing.\n", fpath);
+    total = sftp_errno(conn);
+    sftp_pool_put(conn);
+    return total;
+  }
+  if (sftp_seek64(remotefile, offset) < 0) {
+    total = -EIO;
+    goto out;
+  }
+
+  while (total < len) {
+    want = sizeof(buf);
+    if (len - total < (off_t)want)
+      want = len - total;
+
+    nbytes = pread(fd, buf, want, offset + total);
+    if (nbytes <= 0)
+      break; // file got shorter since the write, nothing more to send
+
+    if ((sftp_write(remotefile, buf, nbytes)) != nbytes) {
+      fprintf(stderr, "I couldn't write to remote file  %s; %s .\n", fpath, ssh_get_error(conn->session));
+      total = -EIO;
+      break;
+    }
+    total += nbytes;
+  }
+
+out:
+  sftp_close(remotefile);
+  sftp_pool_put(conn);
+  return total;
+}
+
+static int sftp_be_truncate(struct netfs_backend *be, const char *path, off_t size)
+{
+  char fpath[PATH_MAX];
+  struct sftp_attributes_struct attr;
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.flags = SSH_FILEXFER_ATTR_SIZE;
+  attr.size = size;
+
+  conn = sftp_pool_get();
+  if (sftp_setstat(conn->sftp, fpath, &attr) < 0) {
+    fprintf(stderr, "I couldn't truncate remote file %s; %s .\n", fpath, ssh_get_error(conn->session));
+    rc = sftp_errno(conn);
+  }
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static int sftp_be_create(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  char fpath[PATH_MAX];
+  struct sftp_conn *conn;
+  sftp_file file;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  file = sftp_open(conn->sftp, fpath, O_WRONLY | O_CREAT | O_TRUNC, mode & 07777);
+  if (file == NULL) {
+    fprintf(stderr, "I couldn't create remote file %s; %s .\n", fpath, ssh_get_error(conn->session));
+    rc = sftp_errno(conn);
+  } else {
+    sftp_close(file);
+  }
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static int sftp_be_mkdir(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  char fpath[PATH_MAX];
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  if (sftp_mkdir(conn->sftp, fpath, mode & 07777) < 0)
+    rc = sftp_errno(conn);
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static int sftp_be_unlink(struct netfs_backend *be, const char *path)
+{
+  char fpath[PATH_MAX];
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  if (sftp_unlink(conn->sftp, fpath) < 0)
+    rc = sftp_errno(conn);
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static int sftp_be_rmdir(struct netfs_backend *be, const char *path)
+{
+  char fpath[PATH_MAX];
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  if (sftp_rmdir(conn->sftp, fpath) < 0) {
+    // the protocol has no error for a directory with files in it
+    rc = sftp_get_error(conn->sftp) == SSH_FX_FAILURE ? -ENOTEMPTY : sftp_errno(conn);
+  }
+  sftp_pool_put(conn);
+  return rc;
+}
+
+/*
+ * sftp version 3 refuses to rename onto an existing file, unlike
+ * rename(2). Remove the target and try again, not atomic but what
+ * editors saving through a temp file need.
+ *
+ * */
+static int sftp_be_rename(struct netfs_backend *be, const char *from, const char *to)
+{
+  char ffrom[PATH_MAX], fto[PATH_MAX];
+  sftp_attributes attributes;
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, ffrom, from);
+  sftp_fullpath(be, fto, to);
+
+  conn = sftp_pool_get();
+  if (sftp_rename(conn->sftp, ffrom, fto) < 0) {
+    rc = sftp_errno(conn);
+    // generic failure with the source still there: the target is in the way
+    if (rc == -EIO && (attributes = sftp_lstat(conn->sftp, ffrom)) != NULL) {
+      sftp_attributes_free(attributes);
+      if (sftp_unlink(conn->sftp, fto) == 0)
+        rc = sftp_rename(conn->sftp, ffrom, fto) < 0 ? sftp_errno(conn) : 0;
+    }
+  }
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static int sftp_be_chmod(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  char fpath[PATH_MAX];
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  conn = sftp_pool_get();
+  if (sftp_chmod(conn->sftp, fpath, mode & 07777) < 0)
+    rc = sftp_errno(conn);
+  sftp_pool_put(conn);
+  return rc;
+}
+
+static int sftp_be_utimens(struct netfs_backend *be, const char *path,
+    const struct timespec ts[2])
+{
+  char fpath[PATH_MAX];
+  struct timeval tv[2];
+  struct sftp_conn *conn;
+  int rc = 0;
+
+  sftp_fullpath(be, fpath, path);
+
+  // the protocol only carries seconds
+  tv[0].tv_sec = ts[0].tv_sec;
+  tv[0].tv_usec = ts[0].tv_nsec / 1000;
+  tv[1].tv_sec = ts[1].tv_sec;
+  tv[1].tv_usec = ts[1].tv_nsec / 1000;
+
+  conn = sftp_pool_get();
+  if (sftp_utimes(conn->sftp, fpath, tv) < 0)
+    rc = sftp_errno(conn);
+  sftp_pool_put(conn);
+  return rc;
+}
+
+/*
+ * Plain sftp has no way to hash a file on the server. The check-file
+ * extension some servers offer isn't exposed by libssh, so files are
+ * fetched whole and only deduplicated once they are here.
+ *
+ * */
+static int sftp_be_block_hashes(struct netfs_backend *be, const char *path,
+    size_t block_size, struct city128 *hashes, int max)
+{
+  (void) be;
+  (void) path;
+  (void) block_size;
+  (void) hashes;
+  (void) max;
+  return -ENOSYS;
+}
+
+static void sftp_be_destroy(struct netfs_backend *be)
+{
+  sftp_pool_destroy();
+  free(be);
+}
+
+struct netfs_backend *backend_sftp_new(char *username, char *hostname,
+    const char *rootdir, int connections, int compression)
+{
+  struct sftp_backend *sb = calloc(1, sizeof(struct sftp_backend));
+
+  if (sb == NULL)
+    return NULL;
+
+  // every fuse worker thread checks out its own connection
+  if (sftp_pool_init(username, hostname, connections, compression) == -1) {
+    free(sb);
+    return NULL;
+  }
+
+  strncpy(sb->rootdir, rootdir, PATH_MAX - 1);
+  sb->be.name = "sftp";
+  sb->be.stat = sftp_be_stat;
+  sb->be.list = sftp_be_list;
+  sb->be.read_range = sftp_be_read_range;
+  sb->be.write_range = sftp_be_write_range;
+  sb->be.truncate = sftp_be_truncate;
+  sb->be.create = sftp_be_create;
+  sb->be.mkdir = sftp_be_mkdir;
+  sb->be.unlink = sftp_be_unlink;
+  sb->be.rmdir = sftp_be_rmdir;
+  sb->be.rename = sftp_be_rename;
+  sb->be.chmod = sftp_be_chmod;
+  sb->be.utimens = sftp_be_utimens;
+  sb->be.block_hashes = sftp_be_block_hashes;
+  sb->be.destroy = sftp_be_destroy;
+  return &sb->be;
+}
@@ -0,0 +1,121 @@
+/*
+ * A backend that times the calls it passes on to another backend, so
+ * the stats show how much of each fuse callback is spent talking to
+ * the remote side.
+ *
+ * */
+#include <stdlib.h>
+
+#include "backend.h"
+#include "stats.h"
+
+struct stats_backend {
+  struct netfs_backend be;
+  struct netfs_backend *inner;
+};
+
+#define INNER(be) (((struct stats_backend *)(be))->inner)
+
+static int stats_be_stat(struct netfs_backend *be, const char *path, struct stat *st)
+{
+  return STATS_TIME(STATS_BE_STAT, INNER(be)->stat(INNER(be), path, st));
+}
+
+static int stats_be_list(struct netfs_backend *be, const char *path,
+    backend_fill_t fill, void *ctx)
+{
+  return STATS_TIME(STATS_BE_LIST, INNER(be)->list(INNER(be), path, fill, ctx));
+}
+
+static ssize_t stats_be_read_range(struct netfs_backend *be, const char *path,
+    int fd, off_t offset, off_t len)
+{
+  return STATS_TIME(STATS_BE_READ,
+      INNER(be)->read_range(INNER(be), path, fd, offset, len));
+}
+
+static ssize_t stats_be_write_range(struct netfs_backend *be, const char *path,
+    int fd, off_t offset, off_t len, mode_t mode)
+{
+  return STATS_TIME(STATS_BE_WRITE,
+      INNER(be)->write_range(INNER(be), path, fd, offset, len, mode));
+}
+
+static int stats_be_truncate(struct netfs_backend *be, const char *path, off_t size)
+{
+  return STATS_TIME(STATS_BE_TRUNCATE, INNER(be)->truncate(INNER(be), path, size));
+}
+
+static int stats_be_create(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  return STATS_TIME(STATS_BE_CREATE, INNER(be)->create(INNER(be), path, mode));
+}
+
+static int stats_be_mkdir(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  return STATS_TIME(STATS_BE_MKDIR, INNER(be)->mkdir(INNER(be), path, mode));
+}
+
+static int stats_be_unlink(struct netfs_backend *be, const char *path)
+{
+  return STATS_TIME(STATS_BE_UNLINK, INNER(be)->unlink(INNER(be), path));
+}
+
+static int stats_be_rmdir(struct netfs_backend *be, const char *path)
+{
+  return STATS_TIME(STATS_BE_RMDIR, INNER(be)->rmdir(INNER(be), path));
+}
+
+static int stats_be_rename(struct netfs_backend *be, const char *from, const char *to)
+{
+  return STATS_TIME(STATS_BE_RENAME, INNER(be)->rename(INNER(be), from, to));
+}
+
+static int stats_be_chmod(struct netfs_backend *be, const char *path, mode_t mode)
+{
+  return STATS_TIME(STATS_BE_CHMOD, INNER(be)->chmod(INNER(be), path, mode));
+}
+
+static int stats_be_utimens(struct netfs_backend *be, const char *path,
+    const struct timespec ts[2])
+{
+  return STATS_TIME(STATS_BE_UTIMENS, INNER(be)->utimens(INNER(be), path, ts));
+}
+
+static int stats_be_block_hashes(struct netfs_backend *be, const char *path,
+    size_t block_size, struct city128 *hashes, int max)
+{
+  return STATS_TIME(STATS_BE_HASHES,
+      INNER(be)->block_hashes(INNER(be), path, block_size, hashes, max));
+}
+
+static void stats_be_destroy(struct netfs_backend *be)
+{
+  INNER(be)->destroy(INNER(be));
+  free(be);
+}
+
+struct netfs_backend *backend_stats_new(struct netfs_backend *inner)
+{
+  struct stats_backend *sb = calloc(1, sizeof(struct stats_backend));
+
+  if (sb == NULL)
+    return NULL;
+  sb->inner = inner;
+  sb->be.name = inner->name;
+  sb->be.stat = stats_be_stat;
+  sb->be.list = stats_be_list;
+  sb->be.read_range = stats_be_read_range;
+  sb->be.write_range = stats_be_write_range;
+  sb->be.truncate = stats_be_truncate;
+  sb->be.create = stats_be_create;
+  sb->be.mkdir = stats_be_mkdir;
+  sb->be.unlink = stats_be_unlink;
+  sb->be.rmdir = stats_be_rmdir;
+  sb->be.rename = stats_be_rename;
+  sb->be.chmod = stats_be_chmod;
+  sb->be.utimens = stats_be_utimens;
+  sb->be.block_hashes = stats_be_block_hashes;
+  sb->be.destroy = stats_be_destroy;
+  return &sb->be;
+}
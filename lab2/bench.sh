@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Runs every netfs_bench workload against netfs mounted over the local
+# backend, once with the attribute cache on and once with it off, then
+# with the cache on over the low-level fuse frontend.
+# After each round the mount's own per operation stats are printed.
+#
+# Usage: ./bench.sh <backing dir> <mount dir> [netfs -o options]
+#
+# Tunables (environment):
+#   LATENCY_MS=2 BANDWIDTH_KBS=10240   link simulated by the local backend
+#   FILES=8 SIZE_KB=4096 THREADS=4     big file workloads
+#   SMALL_FILES=256 SMALL_KB=4         small file workload
+#   OPS=200                            random reads / meta ops per thread
+#
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 <backing dir> <mount dir> [netfs -o options]"
+  exit 1
+fi
+
+BACKING=$1
+MNT=$2
+EXTRA=${3:+,$3}
+LATENCY_MS=${LATENCY_MS:-2}
+BANDWIDTH_KBS=${BANDWIDTH_KBS:-10240}
+FILES=${FILES:-8}
+SIZE_KB=${SIZE_KB:-4096}
+THREADS=${THREADS:-4}
+SMALL_FILES=${SMALL_FILES:-256}
+SMALL_KB=${SMALL_KB:-4}
+OPS=${OPS:-200}
+
+mkdir -p "$BACKING/big" "$BACKING/small" "$BACKING/meta" "$MNT"
+./nbench -P -d "$BACKING/big" -n $FILES -s $SIZE_KB
+./nbench -P -d "$BACKING/small" -n $SMALL_FILES -s $SMALL_KB -b 4
+
+run() {
+  echo "=== $1 ==="
+  ./netfs "$MNT" -o backend=local,rootdir="$BACKING",latency_ms=$LATENCY_MS,bandwidth_kbs=$BANDWIDTH_KBS,$2$EXTRA
+  sleep 1
+
+  ./nbench -d "$MNT/big" -w seqread -n $FILES -s $SIZE_KB -t $THREADS
+  ./nbench -d "$MNT/big" -w seqwrite -n $FILES -s $SIZE_KB -t $THREADS
+  ./nbench -d "$MNT/big" -w randread -n $FILES -s $SIZE_KB -t $THREADS -o $OPS
+  ./nbench -d "$MNT/meta" -w meta -t $THREADS -o $OPS
+  ./nbench -d "$MNT/small" -w smallfile -n $SMALL_FILES -s $SMALL_KB -b 4 -t $THREADS
+  ./nbench -d "$MNT/big" -w reread -n $FILES -s $SIZE_KB -t $THREADS -M
+
+  echo "--- netfs side ---"
+  cat "$MNT/.netfs-stats" || true
+  fusermount -u "$MNT"
+}
+
+run "cache on" "cache_ttl=5,negative_ttl=1"
+run "cache off" "cache_ttl=0,negative_ttl=0"
+run "cache on, low-level api" "cache_ttl=5,negative_ttl=1,lowlevel"
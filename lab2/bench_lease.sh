@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Two netfs mounts of one tree, read mostly: every round both mounts
+# read all the files, then the second one rewrites a few of them. Run
+# once with each mount on its own, once with the two sharing a lease
+# server. A marker file written on one mount and read right away on
+# the other shows whether the readers see the writes.
+# After each run the stats of both mounts are printed (lease_hits are
+# opens served from the cache without asking the remote side).
+#
+# Usage: ./bench_lease.sh <backing dir> <mount dir> [netfs -o options]
+#
+# Tunables (environment):
+#   LATENCY_MS=2 BANDWIDTH_KBS=10240   link simulated by the local backend
+#   FILES=64 SIZE_KB=64 WRITES=4 ROUNDS=5 THREADS=4
+#   LEASE_PORT=7070 LEASE_TERM=10
+#
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 <backing dir> <mount dir> [netfs -o options]"
+  exit 1
+fi
+
+BACKING=$1
+MNT=$2
+EXTRA=${3:+,$3}
+LATENCY_MS=${LATENCY_MS:-2}
+BANDWIDTH_KBS=${BANDWIDTH_KBS:-10240}
+FILES=${FILES:-64}
+SIZE_KB=${SIZE_KB:-64}
+WRITES=${WRITES:-4}
+ROUNDS=${ROUNDS:-5}
+THREADS=${THREADS:-4}
+LEASE_PORT=${LEASE_PORT:-7070}
+LEASE_TERM=${LEASE_TERM:-10}
+
+mkdir -p "$BACKING/shared" "$MNT/a" "$MNT/b"
+./nbench -P -d "$BACKING/shared" -n $FILES -s $SIZE_KB -b 4
+
+run() {
+  echo "=== $1 ==="
+  for m in a b; do
+    mkdir -p "/tmp/netfs-lease-$m"
+    ./netfs "$MNT/$m" -o backend=local,rootdir="$BACKING",latency_ms=$LATENCY_MS,bandwidth_kbs=$BANDWIDTH_KBS,cache_dir=/tmp/netfs-lease-$m$2$EXTRA
+  done
+  sleep 1
+
+  stale=0
+  r=1
+  while [ $r -le $ROUNDS ]; do
+    echo "--- round $r ---"
+    ./nbench -d "$MNT/a/shared" -w smallfile -n $FILES -s $SIZE_KB -b 4 -t $THREADS | grep -E "^(workload|file) "
+    ./nbench -d "$MNT/b/shared" -w smallfile -n $FILES -s $SIZE_KB -b 4 -t $THREADS | grep -E "^file "
+    ./nbench -d "$MNT/b/shared" -w seqwrite -n $WRITES -s $SIZE_KB -b 4 -t 1 | grep -E "^write "
+    echo "round $r" > "$MNT/b/shared/marker"
+    [ "$(cat "$MNT/a/shared/marker")" = "round $r" ] || stale=$((stale + 1))
+    r=$((r + 1))
+  done
+  echo "stale marker reads on a: $stale of $ROUNDS"
+
+  for m in a b; do
+    echo "--- mount $m ---"
+    grep -E "^(open|getattr|be_stat|be_read|lease_)" "$MNT/$m/.netfs-stats" || true
+    fusermount -u "$MNT/$m"
+  done
+}
+
+run "private caches" ""
+
+./leased -p $LEASE_PORT -t $LEASE_TERM &
+LEASED=$!
+sleep 1
+run "lease server" ",lease_server=127.0.0.1:$LEASE_PORT"
+kill $LEASED
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Download time of one large file against its size and the number of
+# parallel streams. Each run mounts netfs over the local backend with a
+# per stream speed cap (one ssh channel) under a faster shared link,
+# and reads the file once, so the time is the download.
+#
+# Usage: ./bench_streams.sh <backing dir> <mount dir> [netfs -o options]
+#
+# Tunables (environment):
+#   LATENCY_MS=2 BANDWIDTH_KBS=102400 STREAM_KBS=10240
+#   SIZES_MB="16 64 256" STREAMS="1 2 4 8" PIECE_KB=4096
+#
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 <backing dir> <mount dir> [netfs -o options]"
+  exit 1
+fi
+
+BACKING=$1
+MNT=$2
+EXTRA=${3:+,$3}
+LATENCY_MS=${LATENCY_MS:-2}
+BANDWIDTH_KBS=${BANDWIDTH_KBS:-102400}
+STREAM_KBS=${STREAM_KBS:-10240}
+SIZES_MB=${SIZES_MB:-"16 64 256"}
+STREAMS=${STREAMS:-"1 2 4 8"}
+PIECE_KB=${PIECE_KB:-4096}
+
+mkdir -p "$MNT"
+for size in $SIZES_MB; do
+  mkdir -p "$BACKING/streams$size"
+  ./nbench -P -d "$BACKING/streams$size" -n 1 -s $((size * 1024)) -b 1024
+done
+
+for size in $SIZES_MB; do
+  for n in $STREAMS; do
+    echo "=== $size MB, $n streams ==="
+    # over sftp every stream needs a session of its own, connections >= streams
+    ./netfs "$MNT" -o backend=local,rootdir="$BACKING",latency_ms=$LATENCY_MS,bandwidth_kbs=$BANDWIDTH_KBS,stream_kbs=$STREAM_KBS,streams=$n,stream_piece=$PIECE_KB,connections=$n,cache_ttl=0$EXTRA
+    sleep 1
+    ./nbench -d "$MNT/streams$size" -w seqread -n 1 -s $((size * 1024)) -b 1024 | grep -E "^(workload|open) "
+    fusermount -u "$MNT"
+  done
+done
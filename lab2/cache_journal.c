@@ -0,0 +1,216 @@
+/*
+ * Sidecar journal of a cache file being downloaded.
+ *
+ * A download used to be one open with O_TRUNC and one copy, and a
+ * daemon killed half way left a short cache file that looked like any
+ * other. With -o resume every cache file gets a journal next to it: a
+ * header naming the remote version (size, mtime) and the block size,
+ * then one record per block appended once the block is in the cache
+ * file, with a CityHash checksum of its bytes.
+ *
+ * The next open of the same version keeps every block whose bytes
+ * still match their record and fetches only the others, so a restart
+ * resumes where the download stopped and a file downloaded completely
+ * before is not fetched at all. Nothing is fsynced: a record that made
+ * it to disk ahead of its data fails the checksum and the block is
+ * fetched again. A torn record at the end is ignored the same way.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "cache_journal.h"
+#include "city_hash.h"
+#include "stats.h"
+
+#define JOURNAL_MAGIC "NETFSJ1"
+
+struct journal_header {
+  char magic[8];
+  uint64_t block_size;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct journal_record {
+  uint32_t block;
+  uint32_t check;       // ~block, a torn or stray record won't match
+  uint64_t sum;         // low half of the CityHash128 of the block
+};
+
+static void journal_path(char jpath[PATH_MAX], const char *tpath)
+{
+  snprintf(jpath, PATH_MAX, "%s%s", tpath, CACHE_JOURNAL_SUFFIX);
+}
+
+static off_t block_len(struct cache_journal *j, int block)
+{
+  off_t off = (off_t)block * j->block_size;
+
+  return j->size - off < (off_t)j->block_size ? j->size - off : (off_t)j->block_size;
+}
+
+// checksum of block as it is in cache_fd now, -1 if it isn't all there
+static int block_sum(struct cache_journal *j, int cache_fd, int block,
+    char *buf, uint64_t *sum)
+{
+  off_t len = block_len(j, block);
+  struct city128 h;
+
+  if (pread(cache_fd, buf, len, (off_t)block * j->block_size) != len)
+    return -1;
+  city_hash128(buf, len, &h);
+  *sum = h.lo;
+  return 0;
+}
+
+// take the blocks the journal on disk has for this version. returns 0
+// if the header matched, -1 if the journal has to start over
+static int journal_load(struct cache_journal *j, int cache_fd,
+    const struct journal_header *want)
+{
+  struct journal_header hdr;
+  struct journal_record rec;
+  uint64_t sum;
+  off_t end = sizeof(hdr);
+  char *buf;
+  int kept = 0, bad = 0;
+
+  if (pread(j->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      memcmp(&hdr, want, sizeof(hdr)) != 0)
+    return -1;
+  if ((buf = malloc(j->block_size)) == NULL)
+    return -1;
+
+  while (pread(j->fd, &rec, sizeof(rec), end) == sizeof(rec)) {
+    if (rec.check != ~rec.block || rec.block >= (uint32_t)j->nblocks)
+      break; // torn, the rest can't be trusted
+    end += sizeof(rec);
+    if (j->have[rec.block])
+      continue;
+    if (block_sum(j, cache_fd, rec.block, buf, &sum) == 0 && sum == rec.sum) {
+      j->have[rec.block] = 1;
+      kept++;
+    } else {
+      bad++;
+    }
+  }
+  free(buf);
+
+  stats_count(STATS_RESUME_KEPT, kept);
+  stats_count(STATS_RESUME_BAD, bad);
+  // cut a torn tail off, new records go after the last good one
+  if (ftruncate(j->fd, end) == -1 || lseek(j->fd, end, SEEK_SET) == -1)
+    return -1;
+  return 0;
+}
+
+struct cache_journal *cache_journal_open(const char *tpath, int cache_fd,
+    const struct stat *st, size_t block_size)
+{
+  struct cache_journal *j;
+  struct journal_header hdr;
+  char jpath[PATH_MAX];
+
+  if (block_size == 0 || (j = calloc(1, sizeof(struct cache_journal))) == NULL)
+    return NULL;
+  j->block_size = block_size;
+  j->size = st->st_size;
+  j->nblocks = (st->st_size + block_size - 1) / block_size;
+  if ((j->have = calloc(j->nblocks + 1, 1)) == NULL) {
+    free(j);
+    return NULL;
+  }
+
+  journal_path(jpath, tpath);
+  if ((j->fd = open(jpath, O_RDWR | O_CREAT, 0600)) == -1) {
+    free(j->have);
+    free(j);
+    return NULL;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+  hdr.block_size = block_size;
+  hdr.size = st->st_size;
+  hdr.mtime_sec = st->st_mtim.tv_sec;
+  hdr.mtime_nsec = st->st_mtim.tv_nsec;
+
+  if (journal_load(j, cache_fd, &hdr) == -1) {
+    // another version, or no journal at all: nothing in the cache file
+    // can be trusted
+    if (ftruncate(j->fd, 0) == -1 || ftruncate(cache_fd, 0) == -1 ||
+        pwrite(j->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        lseek(j->fd, sizeof(hdr), SEEK_SET) == -1) {
+      cache_journal_close(j);
+      unlink(jpath);
+      return NULL;
+    }
+  }
+  return j;
+}
+
+int cache_journal_missing(struct cache_journal *j, int *first)
+{
+  int i = *first, n = 0;
+
+  while (i < j->nblocks && j->have[i])
+    i++;
+  *first = i;
+  while (i + n < j->nblocks && !j->have[i + n])
+    n++;
+  return n;
+}
+
+int cache_journal_record(struct cache_journal *j, int cache_fd, int block)
+{
+  struct journal_record rec;
+  char *buf;
+  int rc;
+
+  if ((buf = malloc(j->block_size)) == NULL)
+    return -ENOMEM;
+  rc = block_sum(j, cache_fd, block, buf, &rec.sum);
+  free(buf);
+  if (rc == -1)
+    return -EIO;
+
+  rec.block = block;
+  rec.check = ~rec.block;
+  if (write(j->fd, &rec, sizeof(rec)) != sizeof(rec))
+    return -EIO;
+  j->have[block] = 1;
+  return 0;
+}
+
+void cache_journal_close(struct cache_journal *j)
+{
+  close(j->fd);
+  free(j->have);
+  free(j);
+}
+
+void cache_journal_remove(const char *tpath)
+{
+  char jpath[PATH_MAX];
+
+  journal_path(jpath, tpath);
+  unlink(jpath); // most files never had one
+}
+
+void cache_journal_rename(const char *tfrom, const char *tto)
+{
+  char jfrom[PATH_MAX], jto[PATH_MAX];
+
+  journal_path(jfrom, tfrom);
+  journal_path(jto, tto);
+  if (rename(jfrom, jto) == -1)
+    unlink(jto); // whatever was there described the replaced file
+}
@@ -0,0 +1,42 @@
+#ifndef _CACHE_JOURNAL_H_
+#define _CACHE_JOURNAL_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// next to each cache file, with this appended to its name
+#define CACHE_JOURNAL_SUFFIX ".netfs-journal"
+
+struct cache_journal {
+  int fd;               // of the sidecar
+  size_t block_size;
+  off_t size;           // of the remote file
+  int nblocks;
+  char *have;           // block i is in the cache file and checked
+};
+
+// the journal of the cache file tpath, open as cache_fd, for the remote
+// version st. Blocks an earlier run recorded for the same version are
+// checked against their checksums and kept, the rest will have to be
+// fetched. A journal of another version starts over and cache_fd is
+// truncated. NULL on error
+struct cache_journal *cache_journal_open(const char *tpath, int cache_fd,
+    const struct stat *st, size_t block_size);
+
+// the first run of missing blocks at or after *first, returns its length
+// in blocks with *first moved to its start, 0 if nothing is missing
+int cache_journal_missing(struct cache_journal *j, int *first);
+
+// block i landed in cache_fd, record it with the checksum of its bytes
+int cache_journal_record(struct cache_journal *j, int cache_fd, int block);
+
+void cache_journal_close(struct cache_journal *j);
+
+// the cache file tpath is about to change locally or is gone, its
+// journal no longer describes it
+void cache_journal_remove(const char *tpath);
+
+// the cache file moved, its journal goes along
+void cache_journal_rename(const char *tfrom, const char *tto);
+
+#endif
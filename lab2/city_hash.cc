@@ -0,0 +1,14 @@
+/*
+ * extern "C" wrapper so the C modules can use lab1's CityHash.
+ *
+ * */
+#include "city.h"
+#include "city_hash.h"
+
+void city_hash128(const void *buf, size_t len, struct city128 *out)
+{
+  uint128 h = CityHash128((const char *)buf, len);
+
+  out->lo = Uint128Low64(h);
+  out->hi = Uint128High64(h);
+}
@@ -0,0 +1,28 @@
+#ifndef _CITY_HASH_H_
+#define _CITY_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * C entry point to the CityHash code of lab1 (C++).
+ *
+ * */
+
+struct city128 {
+  uint64_t lo;
+  uint64_t hi;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CityHash128 of len bytes at buf
+void city_hash128(const void *buf, size_t len, struct city128 *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,445 @@
+/*
+ * Content addressed block store for cached files.
+ *
+ * The same data often sits at several remote paths (copies, renamed
+ * versions, vendored trees), and each of them used to be downloaded
+ * and cached on its own. Here files are cut in fixed size blocks,
+ * each block is stored once in an unlinked segment file under its
+ * CityHash128, and a cached file is just a map of where its blocks
+ * are. When the backend can tell the hashes of a file up front only
+ * the blocks that aren't stored yet cross the link.
+ *
+ * All slots in the segment are one block long, so a freed block just
+ * makes its slot reusable, no compaction. A block lives as long as a
+ * map refers to it. Maps are kept for the paths they were made for
+ * (valid while size and mtime match, like the pack) and for the open
+ * files using them. When the segment is full the least recently used
+ * paths are forgotten until a slot frees up.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "path_hash.h"
+#include "dedup_store.h"
+#include "stats.h"
+
+#define DEDUP_BLOCK_BUCKETS 65536
+#define DEDUP_FILE_BUCKETS 4096
+
+struct dedup_block {
+  struct city128 hash;
+  off_t slot;
+  int refs;                 // map entries pointing here
+  struct dedup_block *next;
+};
+
+struct dedup_file {
+  char *path;
+  off_t size;
+  time_t mtime;             // of the remote file when stored
+  struct dedup_map *map;
+  struct dedup_file *next;  // bucket chain
+  struct dedup_file *older, *newer;
+};
+
+static struct dedup_block *blocks[DEDUP_BLOCK_BUCKETS];
+static struct dedup_file *files[DEDUP_FILE_BUCKETS];
+static struct dedup_file *oldest, *newest;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int seg_fd = -1;
+static size_t block_size = 0;
+static off_t seg_end = 0;       // slots below this have been handed out
+static off_t dedup_budget = 0;
+static off_t *free_slots;       // handed out and given back
+static long nfree = 0;
+static long nstored = 0;        // distinct blocks
+
+static struct dedup_block *find_block(const struct city128 *hash)
+{
+  struct dedup_block *b;
+
+  for (b = blocks[hash->lo % DEDUP_BLOCK_BUCKETS]; b != NULL; b = b->next)
+    if (b->hash.lo == hash->lo && b->hash.hi == hash->hi)
+      return b;
+  return NULL;
+}
+
+static void block_put(struct dedup_block *b)
+{
+  struct dedup_block **pb;
+
+  if (--b->refs > 0)
+    return;
+  for (pb = &blocks[b->hash.lo % DEDUP_BLOCK_BUCKETS]; *pb != b; pb = &(*pb)->next);
+  *pb = b->next;
+  free_slots[nfree++] = b->slot;
+  nstored--;
+  free(b);
+}
+
+static void map_put(struct dedup_map *map)
+{
+  int i;
+
+  if (--map->refs > 0)
+    return;
+  for (i = 0; i < map->nblocks; ++i)
+    if (map->blocks[i] != NULL)
+      block_put(map->blocks[i]);
+  free(map->blocks);
+  free(map->slots);
+  free(map);
+}
+
+static struct dedup_map *map_new(off_t size)
+{
+  struct dedup_map *map = calloc(1, sizeof(struct dedup_map));
+
+  if (map == NULL)
+    return NULL;
+  map->size = size;
+  map->nblocks = (size + block_size - 1) / block_size;
+  map->slots = calloc(map->nblocks + 1, sizeof(off_t));
+  map->blocks = calloc(map->nblocks + 1, sizeof(struct dedup_block *));
+  if (map->slots == NULL || map->blocks == NULL) {
+    free(map->slots);
+    free(map->blocks);
+    free(map);
+    return NULL;
+  }
+  map->refs = 1;
+  return map;
+}
+
+static struct dedup_file **lookup(const char *path)
+{
+  struct dedup_file **pf;
+
+  for (pf = &files[path_hash(path, DEDUP_FILE_BUCKETS)]; *pf != NULL; pf = &(*pf)->next)
+    if (strcmp((*pf)->path, path) == 0)
+      return pf;
+  return pf;
+}
+
+static void lru_unlink(struct dedup_file *f)
+{
+  if (f->older != NULL)
+    f->older->newer = f->newer;
+  else
+    oldest = f->newer;
+  if (f->newer != NULL)
+    f->newer->older = f->older;
+  else
+    newest = f->older;
+  f->older = f->newer = NULL;
+}
+
+static void lru_push(struct dedup_file *f)
+{
+  f->older = newest;
+  f->newer = NULL;
+  if (newest != NULL)
+    newest->newer = f;
+  else
+    oldest = f;
+  newest = f;
+}
+
+static void remove_file(struct dedup_file **pf)
+{
+  struct dedup_file *f = *pf;
+
+  *pf = f->next;
+  lru_unlink(f);
+  map_put(f->map);
+  free(f->path);
+  free(f);
+}
+
+/*
+ * A free slot, forgetting old paths if needed. Blocks of open files
+ * stay, they are still referenced. Called with dedup_lock held.
+ *
+ * */
+static off_t alloc_slot()
+{
+  off_t slot;
+
+  while (nfree == 0 && seg_end + (off_t)block_size > dedup_budget && oldest != NULL)
+    remove_file(lookup(oldest->path));
+
+  if (nfree > 0)
+    return free_slots[--nfree];
+  if (seg_end + (off_t)block_size > dedup_budget)
+    return -1;
+  slot = seg_end;
+  seg_end += block_size;
+  return slot;
+}
+
+static int copy_block(int from, off_t src, off_t dst, size_t len)
+{
+  char buf[65536];
+  ssize_t n;
+
+  while (len > 0) {
+    n = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf), src);
+    if (n <= 0)
+      return n == 0 ? -EIO : -errno;
+    if (pwrite(seg_fd, buf, n, dst) != n)
+      return -EIO;
+    src += n;
+    dst += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static size_t block_len(off_t size, int i)
+{
+  off_t left = size - (off_t)i * block_size;
+  return left < (off_t)block_size ? left : block_size;
+}
+
+int dedup_init(size_t size, off_t budget)
+{
+  char tpath[] = "/tmp/netfs-dedup.XXXXXX";
+
+  if (size == 0 || budget < (off_t)size)
+    return 0;
+  if ((free_slots = malloc(budget / size * sizeof(off_t))) == NULL)
+    return -1;
+  if ((seg_fd = mkstemp(tpath)) == -1) {
+    perror("dedup segment");
+    free(free_slots);
+    return -1;
+  }
+  unlink(tpath); // only reachable through the fds
+  block_size = size;
+  dedup_budget = budget / size * size;
+  return 0;
+}
+
+size_t dedup_block_size()
+{
+  return block_size;
+}
+
+int dedup_open(const char *path, const struct stat *st, struct dedup_map **map)
+{
+  struct dedup_file **pf, *f;
+  int fd = -ENOENT;
+
+  if (block_size == 0)
+    return -ENOENT;
+
+  pthread_mutex_lock(&dedup_lock);
+  pf = lookup(path);
+  if ((f = *pf) != NULL) {
+    if (f->size != st->st_size || f->mtime != st->st_mtime) {
+      remove_file(pf); // changed on the remote side
+    } else if ((fd = dup(seg_fd)) == -1) {
+      fd = -errno;
+    } else {
+      f->map->refs++;
+      *map = f->map;
+      lru_unlink(f);
+      lru_push(f);
+      stats_count(STATS_DEDUP_HITS, 1);
+    }
+  }
+  pthread_mutex_unlock(&dedup_lock);
+  return fd;
+}
+
+int dedup_has(const struct city128 *hash)
+{
+  int has;
+
+  if (block_size == 0)
+    return 0;
+  pthread_mutex_lock(&dedup_lock);
+  has = find_block(hash) != NULL;
+  pthread_mutex_unlock(&dedup_lock);
+  return has;
+}
+
+int dedup_add(const char *path, const struct stat *st, int src_fd,
+    const struct city128 *hashes, const char *fetched, struct dedup_map **map)
+{
+  struct city128 *have;
+  struct dedup_map *m;
+  struct dedup_block *b;
+  struct dedup_file **pf, *f;
+  char *buf;
+  off_t slot;
+  ssize_t n;
+  int i, rc = 0, fd;
+
+  if (block_size == 0)
+    return -ENOENT;
+  if ((m = map_new(st->st_size)) == NULL)
+    return -ENOMEM;
+  have = calloc(m->nblocks + 1, sizeof(struct city128));
+  buf = malloc(block_size);
+  if (have == NULL || buf == NULL) {
+    rc = -ENOMEM;
+    goto out;
+  }
+
+  // hash what we have outside the lock, and trust it over what the
+  // remote side claimed
+  for (i = 0; i < m->nblocks; ++i) {
+    if (fetched != NULL && !fetched[i]) {
+      have[i] = hashes[i];
+      continue;
+    }
+    n = pread(src_fd, buf, block_len(m->size, i), (off_t)i * block_size);
+    if (n != (ssize_t)block_len(m->size, i)) {
+      rc = n < 0 ? -errno : -EIO;
+      goto out;
+    }
+    city_hash128(buf, n, &have[i]);
+  }
+
+  pthread_mutex_lock(&dedup_lock);
+  // first pin every block that is there already, so making room for
+  // the new ones can't take them away
+  for (i = 0; i < m->nblocks; ++i) {
+    if ((b = find_block(&have[i])) != NULL) {
+      b->refs++;
+      m->blocks[i] = b;
+      m->slots[i] = b->slot;
+      stats_count(fetched != NULL && !fetched[i] ?
+          STATS_DEDUP_SAVED : STATS_DEDUP_SHARED, 1);
+    } else if (fetched != NULL && !fetched[i]) {
+      rc = -ESTALE;
+      break;
+    }
+  }
+  for (i = 0; rc == 0 && i < m->nblocks; ++i) {
+    if (m->blocks[i] != NULL)
+      continue;
+    if ((b = find_block(&have[i])) != NULL) { // twice in this file
+      b->refs++;
+    } else if ((slot = alloc_slot()) < 0) {
+      rc = -ENOSPC;
+      break;
+    } else if ((rc = copy_block(src_fd, (off_t)i * block_size, slot,
+            block_len(m->size, i))) < 0 ||
+        (b = calloc(1, sizeof(struct dedup_block))) == NULL) {
+      free_slots[nfree++] = slot;
+      rc = rc < 0 ? rc : -ENOMEM;
+      break;
+    } else {
+      b->hash = have[i];
+      b->slot = slot;
+      b->refs = 1;
+      b->next = blocks[b->hash.lo % DEDUP_BLOCK_BUCKETS];
+      blocks[b->hash.lo % DEDUP_BLOCK_BUCKETS] = b;
+      nstored++;
+      stats_count(STATS_DEDUP_STORED, 1);
+    }
+    m->blocks[i] = b;
+    m->slots[i] = b->slot;
+  }
+
+  if (rc == 0 && (f = calloc(1, sizeof(struct dedup_file))) != NULL &&
+      (f->path = strdup(path)) != NULL && (fd = dup(seg_fd)) != -1) {
+    pf = lookup(path);
+    if (*pf != NULL)
+      remove_file(pf);
+    f->size = st->st_size;
+    f->mtime = st->st_mtime;
+    f->map = m;
+    f->next = files[path_hash(path, DEDUP_FILE_BUCKETS)];
+    files[path_hash(path, DEDUP_FILE_BUCKETS)] = f;
+    lru_push(f);
+    m->refs++;
+    *map = m;
+    m = NULL;
+    rc = fd;
+  } else if (rc == 0) {
+    rc = -ENOMEM;
+    if (f != NULL)
+      free(f->path);
+    free(f);
+  }
+  if (m != NULL)
+    map_put(m);
+  pthread_mutex_unlock(&dedup_lock);
+  m = NULL;
+
+out:
+  if (m != NULL)
+    map_put(m);
+  free(have);
+  free(buf);
+  return rc;
+}
+
+void dedup_map_put(struct dedup_map *map)
+{
+  pthread_mutex_lock(&dedup_lock);
+  map_put(map);
+  pthread_mutex_unlock(&dedup_lock);
+}
+
+void dedup_remove(const char *path)
+{
+  struct dedup_file **pf;
+
+  if (block_size == 0)
+    return;
+  pthread_mutex_lock(&dedup_lock);
+  pf = lookup(path);
+  if (*pf != NULL)
+    remove_file(pf);
+  pthread_mutex_unlock(&dedup_lock);
+}
+
+void dedup_rename(const char *from, const char *to)
+{
+  struct dedup_file **pf, *f;
+  char *copy;
+
+  if (block_size == 0 || (copy = strdup(to)) == NULL)
+    return;
+  pthread_mutex_lock(&dedup_lock);
+  pf = lookup(to);
+  if (*pf != NULL)
+    remove_file(pf);
+  pf = lookup(from);
+  if ((f = *pf) != NULL) {
+    *pf = f->next;
+    free(f->path);
+    f->path = copy;
+    f->next = files[path_hash(to, DEDUP_FILE_BUCKETS)];
+    files[path_hash(to, DEDUP_FILE_BUCKETS)] = f;
+    copy = NULL;
+  }
+  pthread_mutex_unlock(&dedup_lock);
+  free(copy);
+}
+
+void dedup_destroy()
+{
+  int i;
+
+  if (block_size == 0)
+    return;
+  pthread_mutex_lock(&dedup_lock);
+  fprintf(stderr, "[NETFS] dedup: %ld blocks of %lu bytes stored, "
+      "segment %ld bytes\n", nstored, (unsigned long)block_size, (long)seg_end);
+  for (i = 0; i < DEDUP_FILE_BUCKETS; ++i)
+    while (files[i] != NULL)
+      remove_file(&files[i]);
+  close(seg_fd);
+  seg_fd = -1;
+  pthread_mutex_unlock(&dedup_lock);
+}
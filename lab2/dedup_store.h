@@ -0,0 +1,54 @@
+#ifndef _DEDUP_STORE_H_
+#define _DEDUP_STORE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "city_hash.h"
+
+struct dedup_block;
+
+// where the blocks of one file live in the store segment
+struct dedup_map {
+  off_t size;                   // of the file
+  int nblocks;
+  int refs;                     // under the store lock
+  off_t *slots;                 // offset of block i in the segment
+  struct dedup_block **blocks;
+};
+
+// cut files in blocks of block_size bytes and keep up to budget bytes
+// of distinct blocks. block_size 0 disables the store
+int dedup_init(size_t block_size, off_t budget);
+
+// 0 if the store is off
+size_t dedup_block_size();
+
+// the map of path if it is still what the remote side has (same size
+// and mtime as st), with a reference. returns a new fd for the segment
+// or -ENOENT
+int dedup_open(const char *path, const struct stat *st, struct dedup_map **map);
+
+// is a block with this hash stored
+int dedup_has(const struct city128 *hash);
+
+// make the map of path. Block i comes from src_fd at the same offset
+// when fetched[i] is set (fetched NULL: all of them), otherwise it is
+// the stored block hashes[i] (hashes NULL: none given). returns a new
+// fd for the segment and the map with a reference, or -errno: -ESTALE
+// when a block that wasn't fetched is not stored anymore, -ENOSPC
+// when the new blocks don't fit
+int dedup_add(const char *path, const struct stat *st, int src_fd,
+    const struct city128 *hashes, const char *fetched, struct dedup_map **map);
+
+// drop a reference taken by dedup_open or dedup_add
+void dedup_map_put(struct dedup_map *map);
+
+// forget the map of path, it changed or went away
+void dedup_remove(const char *path);
+
+// the map of from is now the one of to, rename keeps size and mtime
+void dedup_rename(const char *from, const char *to);
+
+void dedup_destroy();
+
+#endif
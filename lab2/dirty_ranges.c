@@ -0,0 +1,101 @@
+/*
+ * Dirty byte ranges of a cached file.
+ *
+ * flush used to push the whole cache file back with O_TRUNC even if a
+ * single byte changed. Now every write marks its range here and only
+ * the dirty ranges are sent, with positioned sftp writes.
+ *
+ * A plain sorted list. Writes are mostly sequential so the new range
+ * lands at the end or merges with the last one, and a file rarely has
+ * more than a handful of disjoint ranges between two flushes.
+ *
+ * */
+#include <stdlib.h>
+
+#include "dirty_ranges.h"
+
+int dirty_add(struct dirty_list *list, off_t start, off_t end)
+{
+  struct dirty_range **pr, *r, *next;
+
+  if (end <= start)
+    return 0;
+
+  // find the first range that ends at or after start - gap
+  for (pr = &list->head; (r = *pr) != NULL; pr = &r->next)
+    if (r->end + DIRTY_MERGE_GAP >= start)
+      break;
+
+  if (r == NULL || r->start > end + DIRTY_MERGE_GAP) {
+    // nothing to merge with, insert before r
+    struct dirty_range *n = malloc(sizeof(struct dirty_range));
+    if (n == NULL)
+      return -1;
+    n->start = start;
+    n->end = end;
+    n->next = r;
+    *pr = n;
+    return 0;
+  }
+
+  // grow r and swallow the following ranges it now reaches
+  if (start < r->start)
+    r->start = start;
+  if (end > r->end)
+    r->end = end;
+  while ((next = r->next) != NULL && next->start <= r->end + DIRTY_MERGE_GAP) {
+    if (next->end > r->end)
+      r->end = next->end;
+    r->next = next->next;
+    free(next);
+  }
+  return 0;
+}
+
+void dirty_truncate(struct dirty_list *list, off_t size)
+{
+  struct dirty_range **pr, *r;
+
+  for (pr = &list->head; (r = *pr) != NULL; ) {
+    if (r->start >= size) {
+      *pr = NULL;
+      dirty_free(r);
+      return;
+    }
+    if (r->end > size)
+      r->end = size;
+    pr = &r->next;
+  }
+}
+
+off_t dirty_bytes(struct dirty_list *list)
+{
+  struct dirty_range *r;
+  off_t total = 0;
+
+  for (r = list->head; r != NULL; r = r->next)
+    total += r->end - r->start;
+  return total;
+}
+
+struct dirty_range *dirty_take(struct dirty_list *list)
+{
+  struct dirty_range *head = list->head;
+  list->head = NULL;
+  return head;
+}
+
+void dirty_free(struct dirty_range *head)
+{
+  struct dirty_range *next;
+
+  for (; head != NULL; head = next) {
+    next = head->next;
+    free(head);
+  }
+}
+
+void dirty_clear(struct dirty_list *list)
+{
+  dirty_free(dirty_take(list));
+}
@@ -0,0 +1,37 @@
+#ifndef _DIRTY_RANGES_H_
+#define _DIRTY_RANGES_H_
+
+#include <sys/types.h>
+
+// ranges closer than this are merged, one bigger write beats two round trips
+#define DIRTY_MERGE_GAP 4096
+
+// [start, end) of the cache file that differs from the remote file
+struct dirty_range {
+  off_t start;
+  off_t end;
+  struct dirty_range *next;
+};
+
+// sorted by start, never overlapping
+struct dirty_list {
+  struct dirty_range *head;
+};
+
+// mark [start, end) dirty, coalescing with the neighbours. -1 if out of memory
+int dirty_add(struct dirty_list *list, off_t start, off_t end);
+
+// forget everything at or beyond size (file got truncated)
+void dirty_truncate(struct dirty_list *list, off_t size);
+
+// total number of dirty bytes
+off_t dirty_bytes(struct dirty_list *list);
+
+// hand over the ranges to the caller, leaving list empty
+struct dirty_range *dirty_take(struct dirty_list *list);
+
+// free a chain returned by dirty_take, or the ranges in a list
+void dirty_free(struct dirty_range *head);
+void dirty_clear(struct dirty_list *list);
+
+#endif
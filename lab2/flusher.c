@@ -0,0 +1,150 @@
+/*
+ * Background uploader.
+ *
+ * With -o async_flush, close() no longer waits for the file to travel
+ * over sftp. flush puts the file in a bounded queue and returns at
+ * local disk speed, one thread drains the queue. fsync still waits
+ * for the upload, that is the durability point, and an upload error
+ * is reported on the next flush or fsync of the file.
+ *
+ * The queue holds a reference on the netfs_file, so the handle may be
+ * released before its data is out. The upload goes to wherever the
+ * file is called when its turn comes, renames in between included.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "flusher.h"
+
+static struct netfs_file **queue;
+static int queue_depth = 0;
+static int queue_head = 0;  // next item to upload
+static int queue_count = 0;
+static int stopping = 0;
+static flusher_upload_t upload_fn;
+static pthread_t flush_thread;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+
+static void *flusher_loop(void *arg)
+{
+  struct netfs_file *nf;
+  int rc;
+  (void) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count == 0 && !stopping)
+      pthread_cond_wait(&not_empty, &queue_lock);
+    if (queue_count == 0) {
+      pthread_mutex_unlock(&queue_lock); // stopping and drained
+      return NULL;
+    }
+    nf = queue[queue_head];
+    queue_head = (queue_head + 1) % queue_depth;
+    queue_count--;
+    pthread_cond_signal(&not_full);
+    pthread_mutex_unlock(&queue_lock);
+
+    // a flush arriving from now on has to queue the file again
+    pthread_mutex_lock(&nf->lock);
+    nf->queued = 0;
+    pthread_mutex_unlock(&nf->lock);
+
+    rc = upload_fn(nf);
+
+    pthread_mutex_lock(&nf->lock);
+    if (rc != 0)
+      nf->error = rc;
+    if (--nf->pending == 0)
+      pthread_cond_broadcast(&nf->idle);
+    pthread_mutex_unlock(&nf->lock);
+
+    netfs_file_put(nf);
+  }
+}
+
+int flusher_start(int depth, flusher_upload_t upload)
+{
+  if (depth < 1)
+    depth = 1;
+  queue = calloc(depth, sizeof(struct netfs_file *));
+  if (queue == NULL)
+    return -1;
+  queue_depth = depth;
+  upload_fn = upload;
+
+  if (pthread_create(&flush_thread, NULL, flusher_loop, NULL) != 0) {
+    perror("pthread_create");
+    free(queue);
+    return -1;
+  }
+  return 0;
+}
+
+int flusher_enqueue(struct netfs_file *nf)
+{
+  pthread_mutex_lock(&nf->lock);
+  if (nf->queued) {
+    // still waiting in line, that upload will pick up the new ranges
+    pthread_mutex_unlock(&nf->lock);
+    return 0;
+  }
+  nf->queued = 1;
+  nf->pending++;
+  nf->refs++;
+  pthread_mutex_unlock(&nf->lock);
+
+  pthread_mutex_lock(&queue_lock);
+  while (queue_count == queue_depth && !stopping)
+    pthread_cond_wait(&not_full, &queue_lock); // back pressure
+  if (stopping) {
+    pthread_mutex_unlock(&queue_lock);
+    pthread_mutex_lock(&nf->lock);
+    nf->queued = 0;
+    if (--nf->pending == 0)
+      pthread_cond_broadcast(&nf->idle);
+    pthread_mutex_unlock(&nf->lock);
+    netfs_file_put(nf);
+    return -ESHUTDOWN;
+  }
+  queue[(queue_head + queue_count) % queue_depth] = nf;
+  queue_count++;
+  pthread_cond_signal(&not_empty);
+  pthread_mutex_unlock(&queue_lock);
+  return 0;
+}
+
+int flusher_wait(struct netfs_file *nf)
+{
+  int rc;
+
+  pthread_mutex_lock(&nf->lock);
+  while (nf->pending > 0)
+    pthread_cond_wait(&nf->idle, &nf->lock);
+  rc = nf->error;
+  nf->error = 0;
+  pthread_mutex_unlock(&nf->lock);
+  return rc;
+}
+
+void flusher_stop()
+{
+  if (queue == NULL)
+    return;
+
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&not_empty);
+  pthread_cond_broadcast(&not_full);
+  pthread_mutex_unlock(&queue_lock);
+
+  pthread_join(flush_thread, NULL);
+  free(queue);
+  queue = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef _FLUSHER_H_
+#define _FLUSHER_H_
+
+#include "netfs_file.h"
+
+// uploads the dirty ranges of nf to its path, 0 or -errno
+typedef int (*flusher_upload_t)(struct netfs_file *nf);
+
+// start the uploader thread with room for depth queued files
+int flusher_start(int depth, flusher_upload_t upload);
+
+// queue nf for upload. blocks only while the queue is full
+int flusher_enqueue(struct netfs_file *nf);
+
+// wait until nothing is queued or in flight for nf.
+// returns the result of the last background upload and clears it
+int flusher_wait(struct netfs_file *nf);
+
+// upload whatever is queued and stop the thread
+void flusher_stop();
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Inode numbers for the low-level fuse API.
+ *
+ * The kernel names files by the inode numbers we give it in lookup
+ * replies, and tells us with forget when it stops using them. Each
+ * inode keeps the full remote path, so a request for it costs one hash
+ * lookup and a copy instead of the walk up the parents the high-level
+ * library does on every call. The last attributes the kernel got are
+ * kept too, to tell when a file changed on the remote side.
+ *
+ * Two chained hash tables over the same entries, by number and by
+ * path. Renaming a directory rewrites the paths of everything below
+ * it, walking the whole table; renames are rare next to lookups.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "path_hash.h"
+#include "inode_table.h"
+
+#define INODE_BUCKETS 16384
+
+struct netfs_inode {
+  uint64_t ino;
+  char *path;               // remote path, NULL once unlinked
+  uint64_t nlookup;         // kernel references, see forget
+  struct stat attr;         // last attributes sent to the kernel
+  int has_attr;
+  struct netfs_inode *ino_next;
+  struct netfs_inode *path_next;
+};
+
+static struct netfs_inode *by_ino[INODE_BUCKETS];
+static struct netfs_inode *by_path[INODE_BUCKETS];
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_ino = INODE_ROOT + 1;
+
+static struct netfs_inode *find_ino(uint64_t ino)
+{
+  struct netfs_inode *in;
+
+  for (in = by_ino[ino % INODE_BUCKETS]; in != NULL; in = in->ino_next)
+    if (in->ino == ino)
+      return in;
+  return NULL;
+}
+
+static struct netfs_inode *find_path(const char *path)
+{
+  struct netfs_inode *in;
+
+  for (in = by_path[path_hash(path, INODE_BUCKETS)]; in != NULL; in = in->path_next)
+    if (strcmp(in->path, path) == 0)
+      return in;
+  return NULL;
+}
+
+static void path_unlink(struct netfs_inode *in)
+{
+  struct netfs_inode **pin;
+
+  for (pin = &by_path[path_hash(in->path, INODE_BUCKETS)]; *pin != in; pin = &(*pin)->path_next);
+  *pin = in->path_next;
+}
+
+static void path_link(struct netfs_inode *in)
+{
+  unsigned int h = path_hash(in->path, INODE_BUCKETS);
+
+  in->path_next = by_path[h];
+  by_path[h] = in;
+}
+
+static struct netfs_inode *inode_new(uint64_t ino, const char *path)
+{
+  struct netfs_inode *in = calloc(1, sizeof(struct netfs_inode));
+
+  if (in == NULL)
+    return NULL;
+  if ((in->path = strdup(path)) == NULL) {
+    free(in);
+    return NULL;
+  }
+  in->ino = ino;
+  in->ino_next = by_ino[ino % INODE_BUCKETS];
+  by_ino[ino % INODE_BUCKETS] = in;
+  path_link(in);
+  return in;
+}
+
+static void inode_free(struct netfs_inode *in)
+{
+  struct netfs_inode **pin;
+
+  for (pin = &by_ino[in->ino % INODE_BUCKETS]; *pin != in; pin = &(*pin)->ino_next);
+  *pin = in->ino_next;
+  if (in->path != NULL) {
+    path_unlink(in);
+    free(in->path);
+  }
+  free(in);
+}
+
+// called with inode_lock held
+static int set_attr(struct netfs_inode *in, const struct stat *st)
+{
+  int changed = in->has_attr && !S_ISDIR(st->st_mode) &&
+    (in->attr.st_size != st->st_size ||
+     in->attr.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+     in->attr.st_mtim.tv_nsec != st->st_mtim.tv_nsec);
+
+  memcpy(&in->attr, st, sizeof(struct stat));
+  in->has_attr = 1;
+  return changed;
+}
+
+int inode_table_init()
+{
+  pthread_mutex_lock(&inode_lock);
+  if (find_ino(INODE_ROOT) == NULL && inode_new(INODE_ROOT, "/") == NULL) {
+    pthread_mutex_unlock(&inode_lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&inode_lock);
+  return 0;
+}
+
+uint64_t inode_lookup(const char *path, const struct stat *st, int *changed)
+{
+  struct netfs_inode *in;
+  uint64_t ino = 0;
+
+  pthread_mutex_lock(&inode_lock);
+  if ((in = find_path(path)) == NULL && (in = inode_new(next_ino, path)) != NULL)
+    next_ino++;
+  if (in != NULL) {
+    in->nlookup++;
+    *changed = set_attr(in, st);
+    ino = in->ino;
+  }
+  pthread_mutex_unlock(&inode_lock);
+  return ino;
+}
+
+int inode_set_attr(uint64_t ino, const struct stat *st)
+{
+  struct netfs_inode *in;
+  int changed = 0;
+
+  pthread_mutex_lock(&inode_lock);
+  if ((in = find_ino(ino)) != NULL)
+    changed = set_attr(in, st);
+  pthread_mutex_unlock(&inode_lock);
+  return changed;
+}
+
+int inode_path(uint64_t ino, char buf[PATH_MAX])
+{
+  struct netfs_inode *in;
+  int rc = -ESTALE;
+
+  pthread_mutex_lock(&inode_lock);
+  if ((in = find_ino(ino)) != NULL && in->path != NULL) {
+    // a rename may have moved it under a longer directory
+    if (snprintf(buf, PATH_MAX, "%s", in->path) >= PATH_MAX)
+      rc = -ENAMETOOLONG;
+    else
+      rc = 0;
+  }
+  pthread_mutex_unlock(&inode_lock);
+  return rc;
+}
+
+int inode_child_path(uint64_t parent, const char *name, char buf[PATH_MAX])
+{
+  struct netfs_inode *in;
+  int rc = -ESTALE;
+
+  pthread_mutex_lock(&inode_lock);
+  if ((in = find_ino(parent)) != NULL && in->path != NULL) {
+    if (snprintf(buf, PATH_MAX, "%s/%s", parent == INODE_ROOT ? "" : in->path,
+          name) >= PATH_MAX)
+      rc = -ENAMETOOLONG;
+    else
+      rc = 0;
+  }
+  pthread_mutex_unlock(&inode_lock);
+  return rc;
+}
+
+void inode_forget(uint64_t ino, uint64_t nlookup)
+{
+  struct netfs_inode *in;
+
+  if (ino == INODE_ROOT)
+    return;
+
+  pthread_mutex_lock(&inode_lock);
+  if ((in = find_ino(ino)) != NULL) {
+    in->nlookup = in->nlookup > nlookup ? in->nlookup - nlookup : 0;
+    if (in->nlookup == 0)
+      inode_free(in);
+  }
+  pthread_mutex_unlock(&inode_lock);
+}
+
+void inode_unlinked(const char *path)
+{
+  struct netfs_inode *in;
+
+  pthread_mutex_lock(&inode_lock);
+  if ((in = find_path(path)) != NULL && in->ino != INODE_ROOT) {
+    path_unlink(in);
+    free(in->path);
+    in->path = NULL;
+  }
+  pthread_mutex_unlock(&inode_lock);
+}
+
+void inode_renamed(const char *from, const char *to)
+{
+  struct netfs_inode *in, *moved = NULL, *next;
+  size_t len = strlen(from);
+  char *path;
+  int i;
+
+  inode_unlinked(to); // replaced, if it was there
+
+  pthread_mutex_lock(&inode_lock);
+  // take everything at or under from out of the path table first, the
+  // new paths could land in buckets we haven't looked at yet
+  for (i = 0; i < INODE_BUCKETS; ++i) {
+    for (in = by_path[i]; in != NULL; in = next) {
+      next = in->path_next;
+      if (strncmp(in->path, from, len) == 0 &&
+          (in->path[len] == '\0' || in->path[len] == '/')) {
+        path_unlink(in);
+        in->path_next = moved;
+        moved = in;
+      }
+    }
+  }
+  for (in = moved; in != NULL; in = next) {
+    next = in->path_next;
+    if ((path = malloc(strlen(to) + strlen(in->path) - len + 1)) != NULL) {
+      sprintf(path, "%s%s", to, in->path + len);
+      free(in->path);
+      in->path = path;
+      path_link(in);
+    } else {
+      free(in->path); // lost track of it, the kernel will get ESTALE
+      in->path = NULL;
+    }
+  }
+  pthread_mutex_unlock(&inode_lock);
+}
+
+void inode_table_destroy()
+{
+  int i;
+
+  pthread_mutex_lock(&inode_lock);
+  for (i = 0; i < INODE_BUCKETS; ++i)
+    while (by_ino[i] != NULL)
+      inode_free(by_ino[i]);
+  pthread_mutex_unlock(&inode_lock);
+}
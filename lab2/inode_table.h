@@ -0,0 +1,41 @@
+#ifndef _INODE_TABLE_H_
+#define _INODE_TABLE_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define INODE_ROOT 1
+
+// start with just the root, "/" as inode 1
+int inode_table_init();
+
+// the inode of path with one more kernel reference, added if new.
+// *changed is set if its size or mtime differ from st, the last ones
+// the kernel got (its pages may be stale). 0 if out of memory
+uint64_t inode_lookup(const char *path, const struct stat *st, int *changed);
+
+// remember st as the attributes the kernel has for ino, returns 1 if
+// size or mtime changed like inode_lookup
+int inode_set_attr(uint64_t ino, const struct stat *st);
+
+// copy the path of ino into buf, -ESTALE if it is unknown or unlinked,
+// -ENAMETOOLONG if it doesn't fit
+int inode_path(uint64_t ino, char buf[PATH_MAX]);
+
+// the path of name in directory parent, -ESTALE or -ENAMETOOLONG
+int inode_child_path(uint64_t parent, const char *name, char buf[PATH_MAX]);
+
+// the kernel dropped nlookup references to ino
+void inode_forget(uint64_t ino, uint64_t nlookup);
+
+// path is gone. its inode stays until the kernel forgets it, but a new
+// file at path gets a new one
+void inode_unlinked(const char *path);
+
+// from is now to, and so is everything under it
+void inode_renamed(const char *from, const char *to);
+
+void inode_table_destroy();
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Which remote version of each file the kernel page cache may hold.
+ *
+ * fuse drops the pages of a file on every open unless the open sets
+ * keep_cache, so every open of a file used to read it again from us.
+ * Here we remember the size and mtime of the remote file as of its
+ * last open. If they are the same on the next open, the pages the
+ * kernel kept are still good. When the remote file changed we leave
+ * keep_cache off and the kernel throws them away, the same check the
+ * auto_cache option of libfuse does.
+ *
+ * Entries live until the file is removed or renamed, one small struct
+ * per file ever opened.
+ *
+ * */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "path_hash.h"
+#include "kernel_cache.h"
+
+#define KERNEL_CACHE_BUCKETS 4096
+
+struct kernel_entry {
+  char *path;
+  off_t size;
+  struct timespec mtime;
+  struct kernel_entry *next;
+};
+
+static struct kernel_entry *buckets[KERNEL_CACHE_BUCKETS];
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled = 0;
+
+void kernel_cache_init()
+{
+  enabled = 1;
+}
+
+int kernel_cache_valid(const char *path, const struct stat *st)
+{
+  struct kernel_entry *e;
+  unsigned int h = path_hash(path, KERNEL_CACHE_BUCKETS);
+  int valid = 0;
+
+  if (!enabled)
+    return 0;
+
+  pthread_mutex_lock(&kernel_lock);
+  for (e = buckets[h]; e != NULL; e = e->next)
+    if (strcmp(e->path, path) == 0)
+      break;
+  if (e == NULL && (e = calloc(1, sizeof(struct kernel_entry))) != NULL) {
+    if ((e->path = strdup(path)) == NULL) {
+      free(e);
+      e = NULL;
+    } else {
+      e->size = -1; // nothing cached yet
+      e->next = buckets[h];
+      buckets[h] = e;
+    }
+  }
+  if (e != NULL) {
+    valid = e->size == st->st_size &&
+      e->mtime.tv_sec == st->st_mtim.tv_sec &&
+      e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+  }
+  pthread_mutex_unlock(&kernel_lock);
+  return valid;
+}
+
+void kernel_cache_forget(const char *path)
+{
+  struct kernel_entry **pe, *e;
+
+  if (!enabled)
+    return;
+
+  pthread_mutex_lock(&kernel_lock);
+  for (pe = &buckets[path_hash(path, KERNEL_CACHE_BUCKETS)]; (e = *pe) != NULL; pe = &e->next) {
+    if (strcmp(e->path, path) == 0) {
+      *pe = e->next;
+      free(e->path);
+      free(e);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&kernel_lock);
+}
+
+void kernel_cache_destroy()
+{
+  struct kernel_entry *e;
+  int i;
+
+  pthread_mutex_lock(&kernel_lock);
+  for (i = 0; i < KERNEL_CACHE_BUCKETS; ++i) {
+    while ((e = buckets[i]) != NULL) {
+      buckets[i] = e->next;
+      free(e->path);
+      free(e);
+    }
+  }
+  pthread_mutex_unlock(&kernel_lock);
+}
@@ -0,0 +1,19 @@
+#ifndef _KERNEL_CACHE_H_
+#define _KERNEL_CACHE_H_
+
+#include <sys/stat.h>
+
+// start remembering, off unless called
+void kernel_cache_init();
+
+// the kernel is about to cache path as the remote version st. returns 1
+// if what it may still have from the last open is that same version,
+// so the open can keep it
+int kernel_cache_valid(const char *path, const struct stat *st);
+
+// the kernel's copy of path is gone or moved (unlink, rename)
+void kernel_cache_forget(const char *path);
+
+void kernel_cache_destroy();
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ * Leases from the lease server, -o lease_server=HOST:PORT.
+ *
+ * Two mounts of the same remote tree used to keep private cache copies
+ * and upload over each other without knowing. With a lease server
+ * every open takes a read lease and every change (write, truncate,
+ * unlink, rename, chmod, utimens) a write lease, which makes the server
+ * recall the leases of the other mounts first. A written file keeps
+ * its write lease until the upload, and a recall of it uploads first.
+ *
+ * A lease also comes with the version of the file, which every write
+ * lease bumps. A cache copy made under version v is still the remote
+ * file as long as the lease says v: the open reuses it without a stat
+ * or a download, getattr answers from it without the attribute cache
+ * running out. Without a lease (none held, server down) everything is
+ * checked with the remote side as before.
+ *
+ * Leases are held past the operation that took them, until the server
+ * recalls them or their term runs out. Only leases in use are renewed.
+ * Coherence is close to open: a file that stays open here keeps the
+ * copy it was opened with, and directories have no leases.
+ *
+ * One thread reads the server's answers and recalls, another serves
+ * the recalls (they may upload) and renews.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "path_hash.h"
+#include "lease_client.h"
+#include "stats.h"
+
+#define LEASE_BUCKETS 4096
+#define LINE_MAX_LEN 4200
+
+struct lease_entry {
+  char *path;
+  int mode;                 // held, 0 for none
+  uint64_t version;
+  double expiry;            // our clock, from when it was asked for
+  int in_use;               // between lease_get and lease_put
+  int recalled;             // the server wants it back, no new users
+  unsigned long want_id;    // ACQ waiting for its OK
+  int want_mode;
+  double want_sent;
+  unsigned long renew_id;   // renewal waiting for its OK
+  double renew_sent;
+  int cached;               // cached_st is the copy made under cached_version
+  uint64_t cached_version;
+  struct stat cached_st;
+  struct lease_entry *next;
+};
+
+struct recall_item {
+  struct lease_entry *e;
+  struct recall_item *next;
+};
+
+static struct lease_entry *buckets[LEASE_BUCKETS];
+static struct recall_item *recalls;
+static int sock = -1;
+static int down = 1;        // no server, lease_get fails at once
+static int stopping = 0;
+static double term = 10;    // seconds, as the server said last
+static unsigned long next_id = 0;
+static lease_recall_t recall_fn;
+static pthread_t reader, worker;
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the entry of path, made if create is set. Called with lease_lock held
+static struct lease_entry *entry_find(const char *path, int create)
+{
+  unsigned int h = path_hash(path, LEASE_BUCKETS);
+  struct lease_entry *e;
+
+  for (e = buckets[h]; e != NULL; e = e->next)
+    if (strcmp(e->path, path) == 0)
+      return e;
+  if (!create || (e = calloc(1, sizeof(struct lease_entry))) == NULL)
+    return NULL;
+  if ((e->path = strdup(path)) == NULL) {
+    free(e);
+    return NULL;
+  }
+  e->next = buckets[h];
+  buckets[h] = e;
+  return e;
+}
+
+// one line to the server. Called with lease_lock held, which keeps
+// the lines of a path in order, so it must not block: a server too
+// slow to take a whole line is dropped like a lost one
+static void send_line(const char *line, int n)
+{
+  if (!down && send(sock, line, n, MSG_DONTWAIT | MSG_NOSIGNAL) != n)
+    shutdown(sock, SHUT_RDWR); // the reader notices
+}
+
+static void send_acq(struct lease_entry *e, unsigned long id, int mode)
+{
+  char line[LINE_MAX_LEN + 64];
+
+  send_line(line, snprintf(line, sizeof(line), "ACQ %lu %c %s\n", id,
+        mode == LEASE_WRITE ? 'W' : 'R', e->path));
+}
+
+static void send_rel(const char *path)
+{
+  char line[LINE_MAX_LEN + 16];
+
+  send_line(line, snprintf(line, sizeof(line), "REL %s\n", path));
+}
+
+int lease_get(const char *path, int mode)
+{
+  struct lease_entry *e;
+
+  if (down)
+    return -ENOTCONN;
+  if (strchr(path, '\n') != NULL)
+    return -EINVAL; // can't be said in the protocol
+
+  pthread_mutex_lock(&lease_lock);
+  if ((e = entry_find(path, 1)) == NULL) {
+    pthread_mutex_unlock(&lease_lock);
+    return -ENOMEM;
+  }
+  for (;;) {
+    if (down) {
+      pthread_mutex_unlock(&lease_lock);
+      return -ENOTCONN;
+    }
+    if (!e->recalled) {
+      if (e->mode >= mode && now() < e->expiry) {
+        e->in_use++;
+        pthread_mutex_unlock(&lease_lock);
+        return 0;
+      }
+      if (e->want_id == 0 || e->want_mode < mode) {
+        e->want_id = ++next_id;
+        e->want_mode = mode;
+        e->want_sent = now();
+        send_acq(e, e->want_id, mode);
+      }
+    }
+    pthread_cond_wait(&changed, &lease_lock);
+  }
+}
+
+void lease_put(const char *path)
+{
+  struct lease_entry *e;
+
+  pthread_mutex_lock(&lease_lock);
+  if ((e = entry_find(path, 0)) != NULL && e->in_use > 0 && --e->in_use == 0)
+    pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lease_lock);
+}
+
+void lease_cached(const char *path, const struct stat *st)
+{
+  struct lease_entry *e;
+
+  pthread_mutex_lock(&lease_lock);
+  if ((e = entry_find(path, 0)) != NULL && e->mode != 0) {
+    e->cached = 1;
+    e->cached_version = e->version;
+    memcpy(&e->cached_st, st, sizeof(struct stat));
+  }
+  pthread_mutex_unlock(&lease_lock);
+}
+
+int lease_cache_valid(const char *path, struct stat *st)
+{
+  struct lease_entry *e;
+  int valid = 0;
+
+  if (down)
+    return 0;
+
+  pthread_mutex_lock(&lease_lock);
+  if ((e = entry_find(path, 0)) != NULL && e->cached && e->mode != 0 &&
+      !e->recalled && e->cached_version == e->version && now() < e->expiry) {
+    memcpy(st, &e->cached_st, sizeof(struct stat));
+    valid = 1;
+  }
+  pthread_mutex_unlock(&lease_lock);
+  return valid;
+}
+
+void lease_cache_drop(const char *path)
+{
+  struct lease_entry *e;
+
+  pthread_mutex_lock(&lease_lock);
+  if ((e = entry_find(path, 0)) != NULL)
+    e->cached = 0;
+  pthread_mutex_unlock(&lease_lock);
+}
+
+// OK <id> R|W <ttl ms> <version> <path>. Called with lease_lock held
+static void got_ok(char *line)
+{
+  struct lease_entry *e;
+  unsigned long id;
+  unsigned long long ttl, version;
+  char mode;
+  int n;
+
+  if (sscanf(line, "OK %lu %c %llu %llu %n", &id, &mode, &ttl, &version, &n) != 4 ||
+      (e = entry_find(line + n, 0)) == NULL)
+    return;
+  if (term != ttl / 1000.0) {
+    term = ttl / 1000.0;
+    pthread_cond_signal(&work); // renewals are due on the new schedule
+  }
+  if (id == e->want_id) {
+    e->mode = mode == 'W' ? LEASE_WRITE : LEASE_READ;
+    e->version = version;
+    e->expiry = e->want_sent + term;
+    e->want_id = 0;
+    pthread_cond_broadcast(&changed);
+  } else if (id == e->renew_id) {
+    // a renewal answered after a release is no lease
+    if (e->mode != 0 && e->renew_sent + term > e->expiry)
+      e->expiry = e->renew_sent + term;
+    e->renew_id = 0;
+  }
+  // anything else answers a request given up on
+}
+
+// RECALL <path>. Called with lease_lock held
+static void got_recall(const char *path)
+{
+  struct lease_entry *e;
+  struct recall_item *r;
+
+  if ((e = entry_find(path, 0)) == NULL || e->mode == 0) {
+    // nothing here the server should wait for
+    send_rel(path);
+    return;
+  }
+  if (e->recalled)
+    return;
+  if ((r = malloc(sizeof(struct recall_item))) == NULL)
+    return; // it runs out on its own
+  e->recalled = 1;
+  r->e = e;
+  r->next = recalls;
+  recalls = r;
+  pthread_cond_signal(&work);
+}
+
+static void *reader_loop(void *arg)
+{
+  char in[LINE_MAX_LEN], *line, *nl;
+  int len = 0;
+  ssize_t n;
+  (void) arg;
+
+  while ((n = read(sock, in + len, sizeof(in) - 1 - len)) > 0) {
+    len += n;
+    in[len] = '\0';
+    pthread_mutex_lock(&lease_lock);
+    for (line = in; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+      *nl = '\0';
+      if (strncmp(line, "OK ", 3) == 0)
+        got_ok(line);
+      else if (strncmp(line, "RECALL /", 8) == 0)
+        got_recall(line + 7);
+    }
+    pthread_mutex_unlock(&lease_lock);
+    len -= line - in;
+    memmove(in, line, len);
+    if (len == sizeof(in) - 1)
+      break;
+  }
+
+  pthread_mutex_lock(&lease_lock);
+  if (!stopping)
+    fprintf(stderr, "[LEASE] lost the lease server, going on without leases\n");
+  down = 1;
+  pthread_cond_broadcast(&changed);
+  pthread_cond_broadcast(&work);
+  pthread_mutex_unlock(&lease_lock);
+  return NULL;
+}
+
+/*
+ * Give a recalled lease back once its users are done, after the
+ * recall function had its say. Called with lease_lock held.
+ *
+ * */
+static void serve_recall(struct lease_entry *e)
+{
+  struct timespec ts;
+  double until;
+  int mode = e->mode;
+
+  // first, a write lease held until an upload is let go by the upload
+  pthread_mutex_unlock(&lease_lock);
+  stats_count(STATS_LEASE_RECALLS, 1);
+  recall_fn(e->path, mode);
+  pthread_mutex_lock(&lease_lock);
+
+  // the others are done soon (netfs lets a written file's lease go in
+  // the recall function, uploaded or not), one stuck gets one term
+  clock_gettime(CLOCK_REALTIME, &ts);
+  until = ts.tv_sec + ts.tv_nsec / 1e9 + term;
+  ts.tv_sec = (time_t)until;
+  ts.tv_nsec = (long)((until - ts.tv_sec) * 1e9);
+  while (e->in_use > 0 && !down)
+    if (pthread_cond_timedwait(&changed, &lease_lock, &ts) == ETIMEDOUT)
+      break;
+
+  // REL first: an ACQ of ours must not reach the server before it
+  send_rel(e->path);
+  e->mode = 0;
+  e->recalled = 0;
+  e->renew_id = 0;
+  pthread_cond_broadcast(&changed);
+}
+
+static void renew_in_use()
+{
+  struct lease_entry *e;
+  double t = now();
+  int i;
+
+  for (i = 0; i < LEASE_BUCKETS; ++i) {
+    for (e = buckets[i]; e != NULL; e = e->next) {
+      if (e->in_use == 0 || e->mode == 0 || e->recalled || e->renew_id != 0 ||
+          e->expiry - t > term * 2 / 3)
+        continue;
+      e->renew_id = ++next_id;
+      e->renew_sent = t;
+      send_acq(e, e->renew_id, e->mode);
+    }
+  }
+}
+
+static void *worker_loop(void *arg)
+{
+  struct recall_item *r;
+  struct timespec ts;
+  double wake;
+  (void) arg;
+
+  pthread_mutex_lock(&lease_lock);
+  while (!stopping && !down) {
+    while ((r = recalls) != NULL) {
+      recalls = r->next;
+      serve_recall(r->e);
+      free(r);
+    }
+    renew_in_use();
+
+    // a third of the term, renewals go out with a third left at least
+    clock_gettime(CLOCK_REALTIME, &ts);
+    wake = ts.tv_sec + ts.tv_nsec / 1e9 + term / 3;
+    ts.tv_sec = (time_t)wake;
+    ts.tv_nsec = (long)((wake - ts.tv_sec) * 1e9);
+    if (recalls == NULL && !stopping && !down)
+      pthread_cond_timedwait(&work, &lease_lock, &ts);
+  }
+  // leave nobody waiting on a lease that is never coming back
+  while ((r = recalls) != NULL) {
+    recalls = r->next;
+    r->e->recalled = 0;
+    free(r);
+  }
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lease_lock);
+  return NULL;
+}
+
+static int lease_connect(const char *server)
+{
+  struct addrinfo hints, *res, *ai;
+  char host[256];
+  const char *port;
+  int fd = -1, one = 1;
+
+  if ((port = strrchr(server, ':')) == NULL || port - server >= (int)sizeof(host)) {
+    fprintf(stderr, "[LEASE] lease server %s is not host:port\n", server);
+    return -1;
+  }
+  memcpy(host, server, port - server);
+  host[port - server] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port + 1, &hints, &res) != 0) {
+    fprintf(stderr, "[LEASE] unknown lease server %s\n", server);
+    return -1;
+  }
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+      continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd == -1) {
+    fprintf(stderr, "[LEASE] can't reach lease server %s\n", server);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+int lease_start(const char *server, lease_recall_t recall)
+{
+  if ((sock = lease_connect(server)) == -1)
+    return -1;
+  recall_fn = recall;
+  down = 0;
+  stopping = 0;
+  if (pthread_create(&reader, NULL, reader_loop, NULL) != 0) {
+    down = 1;
+    close(sock);
+    return -1;
+  }
+  if (pthread_create(&worker, NULL, worker_loop, NULL) != 0) {
+    shutdown(sock, SHUT_RDWR);
+    pthread_join(reader, NULL);
+    close(sock);
+    return -1;
+  }
+  return 0;
+}
+
+void lease_stop()
+{
+  struct lease_entry *e;
+  int i;
+
+  if (sock == -1)
+    return;
+
+  pthread_mutex_lock(&lease_lock);
+  stopping = 1;
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&lease_lock);
+  // the server drops whatever we held along with the connection
+  shutdown(sock, SHUT_RDWR);
+  pthread_join(reader, NULL);
+  pthread_join(worker, NULL);
+  close(sock);
+  sock = -1;
+
+  pthread_mutex_lock(&lease_lock);
+  for (i = 0; i < LEASE_BUCKETS; ++i) {
+    while ((e = buckets[i]) != NULL) {
+      buckets[i] = e->next;
+      free(e->path);
+      free(e);
+    }
+  }
+  pthread_mutex_unlock(&lease_lock);
+}
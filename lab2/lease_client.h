@@ -0,0 +1,38 @@
+#ifndef _LEASE_CLIENT_H_
+#define _LEASE_CLIENT_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define LEASE_READ 1
+#define LEASE_WRITE 2
+
+// the server took the lease of path back. the last chance to send what
+// was written under a write lease
+typedef void (*lease_recall_t)(const char *path, int mode);
+
+// connect to the lease server at host:port and start the threads
+// talking to it. -1 if it can't be reached
+int lease_start(const char *server, lease_recall_t recall);
+
+// hold a lease on path for one operation, asking the server for it
+// unless one at least as strong is held. A recall waits for lease_put.
+// 0, or -errno when there is no server to ask, the caller goes on
+// without a lease
+int lease_get(const char *path, int mode);
+void lease_put(const char *path);
+
+// the cache copy of path, with the remote attributes st, is the version
+// of the lease held. call between lease_get and lease_put
+void lease_cached(const char *path, const struct stat *st);
+
+// is a lease on path held, and the cache copy of that same version. st
+// is filled from lease_cached then. Never asks the server
+int lease_cache_valid(const char *path, struct stat *st);
+
+// the cache copy of path is gone, or no longer the remote file
+void lease_cache_drop(const char *path);
+
+void lease_stop();
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ * Lease server for netfs mounts sharing one remote tree, see -o lease_server.
+ *
+ * A stand-in for a lock service next to the file server: one process,
+ * one poll loop, everything in memory. Clients hold per path leases,
+ * shared read leases or one exclusive write lease, for a term of
+ * -t seconds that they renew while they need it. A request that
+ * conflicts with leases of other clients makes the server recall them
+ * and waits until they are released, or have run out, or their
+ * client is gone. Requests of a path are granted in arrival order, so
+ * readers can't starve a writer.
+ *
+ * Every path has a version, bumped by each write lease granted. A
+ * client that cached a file under version v and gets a lease with the
+ * same v again knows nobody wrote it in between and keeps its copy
+ * without asking the file server. Versions start from the clock, a
+ * restarted server never hands out an old one again.
+ *
+ * The protocol is lines of text over TCP:
+ *
+ *   client: ACQ <id> R|W <path>   a lease, or a renewal of one held
+ *   client: REL <path>            give it back
+ *   server: OK <id> R|W <ttl ms> <version> <path>
+ *   server: RECALL <path>         release as soon as you can
+ *
+ * The id is the client's, OK carries the one of the request granted.
+ *
+ * Usage: ./leased [-p port] [-t lease seconds]
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "path_hash.h"
+
+#define MAX_CLIENTS 256
+#define LINE_MAX_LEN 4200
+#define LEASE_BUCKETS 4096
+
+enum { NONE = 0, READ = 1, WRITE = 2 };
+
+struct client {
+  int fd;                     // -1 when the slot is free
+  char in[LINE_MAX_LEN];
+  int len;
+};
+
+struct holder {
+  int client;
+  int mode;
+  double expiry;
+  int recalled;               // RECALL sent, waiting for REL
+  struct holder *next;
+};
+
+struct waiter {
+  int client;
+  int mode;
+  unsigned long id;
+  struct waiter *next;
+};
+
+// entries stay for the life of the server, they carry the version
+struct lease {
+  char *path;
+  uint64_t version;
+  struct holder *holders;
+  struct waiter *waiters;     // oldest first
+  struct lease *next;
+};
+
+static struct client clients[MAX_CLIENTS];
+static struct lease *buckets[LEASE_BUCKETS];
+static double term = 10;
+static uint64_t last_version;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct lease *lease_find(const char *path)
+{
+  unsigned int h = path_hash(path, LEASE_BUCKETS);
+  struct lease *l;
+
+  for (l = buckets[h]; l != NULL; l = l->next)
+    if (strcmp(l->path, path) == 0)
+      return l;
+  if ((l = calloc(1, sizeof(struct lease))) == NULL ||
+      (l->path = strdup(path)) == NULL) {
+    free(l);
+    return NULL;
+  }
+  l->version = ++last_version;
+  l->next = buckets[h];
+  buckets[h] = l;
+  return l;
+}
+
+// client sockets don't block, one whose socket buffer can't take a
+// whole line is too slow and is dropped. The shutdown makes the poll
+// loop see it gone, the caller may be walking the leases
+static void send_to(int c, const char *line, int n)
+{
+  if (write(clients[c].fd, line, n) != n)
+    shutdown(clients[c].fd, SHUT_RDWR);
+}
+
+static void send_ok(int c, unsigned long id, int mode, uint64_t version,
+    const char *path)
+{
+  char line[LINE_MAX_LEN + 96];
+
+  send_to(c, line, snprintf(line, sizeof(line), "OK %lu %c %llu %llu %s\n",
+        id, mode == WRITE ? 'W' : 'R', (unsigned long long)(term * 1000),
+        (unsigned long long)version, path));
+}
+
+static void send_recall(int c, const char *path)
+{
+  char line[LINE_MAX_LEN + 16];
+
+  send_to(c, line, snprintf(line, sizeof(line), "RECALL %s\n", path));
+}
+
+static struct holder *holder_of(struct lease *l, int c)
+{
+  struct holder *h;
+
+  for (h = l->holders; h != NULL; h = h->next)
+    if (h->client == c)
+      return h;
+  return NULL;
+}
+
+static void holder_remove(struct lease *l, int c)
+{
+  struct holder **ph, *h;
+
+  for (ph = &l->holders; (h = *ph) != NULL; ph = &h->next) {
+    if (h->client == c) {
+      *ph = h->next;
+      free(h);
+      return;
+    }
+  }
+}
+
+// do leases of other clients stand in the way of mode for c
+static int conflicts(struct lease *l, int c, int mode, int recall)
+{
+  struct holder *h;
+  int n = 0;
+
+  for (h = l->holders; h != NULL; h = h->next) {
+    if (h->client == c || (mode == READ && h->mode == READ))
+      continue;
+    n++;
+    if (recall && !h->recalled) {
+      h->recalled = 1;
+      send_recall(h->client, l->path);
+    }
+  }
+  return n;
+}
+
+static void grant(struct lease *l, int c, int mode, unsigned long id)
+{
+  struct holder *h = holder_of(l, c);
+
+  if (h == NULL) {
+    if ((h = calloc(1, sizeof(struct holder))) == NULL) {
+      shutdown(clients[c].fd, SHUT_RDWR);
+      return;
+    }
+    h->client = c;
+    h->next = l->holders;
+    l->holders = h;
+  }
+  if (mode == WRITE && h->mode != WRITE)
+    l->version = ++last_version;
+  if (mode > h->mode)
+    h->mode = mode;
+  h->expiry = now() + term;
+  send_ok(c, id, h->mode, l->version, l->path);
+}
+
+/*
+ * Grant what can be granted, oldest request first. The first one that
+ * has to wait gets the conflicting leases recalled, and the ones
+ * behind it wait too.
+ *
+ * */
+static void lease_progress(struct lease *l)
+{
+  struct waiter *w;
+  struct holder **ph, *h;
+  double t = now();
+
+  for (ph = &l->holders; (h = *ph) != NULL; ) {
+    if (h->expiry <= t) {
+      *ph = h->next;
+      free(h);
+    } else {
+      ph = &h->next;
+    }
+  }
+
+  while ((w = l->waiters) != NULL) {
+    if (conflicts(l, w->client, w->mode, 1) > 0)
+      break;
+    l->waiters = w->next;
+    grant(l, w->client, w->mode, w->id);
+    free(w);
+  }
+}
+
+static void lease_request(int c, unsigned long id, int mode, const char *path)
+{
+  struct lease *l;
+  struct holder *h;
+  struct waiter **pw, *w;
+
+  if ((l = lease_find(path)) == NULL) {
+    shutdown(clients[c].fd, SHUT_RDWR);
+    return;
+  }
+  // a renewal, or what is held already covers it
+  if ((h = holder_of(l, c)) != NULL && h->mode >= mode) {
+    grant(l, c, mode, id);
+    return;
+  }
+  if ((w = calloc(1, sizeof(struct waiter))) == NULL) {
+    shutdown(clients[c].fd, SHUT_RDWR);
+    return;
+  }
+  w->client = c;
+  w->mode = mode;
+  w->id = id;
+  for (pw = &l->waiters; *pw != NULL; pw = &(*pw)->next);
+  *pw = w;
+  lease_progress(l);
+}
+
+static void lease_release(int c, const char *path)
+{
+  struct lease *l;
+
+  if ((l = lease_find(path)) == NULL)
+    return;
+  holder_remove(l, c);
+  lease_progress(l);
+}
+
+// c is gone, with all it held and asked for
+static void client_gone(int c)
+{
+  struct lease *l;
+  struct waiter **pw, *w;
+  int i;
+
+  close(clients[c].fd);
+  clients[c].fd = -1;
+  clients[c].len = 0;
+  for (i = 0; i < LEASE_BUCKETS; ++i) {
+    for (l = buckets[i]; l != NULL; l = l->next) {
+      if (l->holders == NULL && l->waiters == NULL)
+        continue;
+      holder_remove(l, c);
+      for (pw = &l->waiters; (w = *pw) != NULL; ) {
+        if (w->client == c) {
+          *pw = w->next;
+          free(w);
+        } else {
+          pw = &w->next;
+        }
+      }
+      lease_progress(l);
+    }
+  }
+}
+
+static void client_line(int c, char *line)
+{
+  unsigned long id;
+  char mode;
+  int n;
+
+  if (sscanf(line, "ACQ %lu %c %n", &id, &mode, &n) == 2 &&
+      (mode == 'R' || mode == 'W') && line[n] == '/')
+    lease_request(c, id, mode == 'W' ? WRITE : READ, line + n);
+  else if (strncmp(line, "REL /", 5) == 0)
+    lease_release(c, line + 4);
+  else
+    fprintf(stderr, "[LEASED] bad request: %s\n", line);
+}
+
+static void client_input(int c)
+{
+  struct client *cl = &clients[c];
+  char *nl, *line;
+  ssize_t n;
+
+  n = read(cl->fd, cl->in + cl->len, sizeof(cl->in) - 1 - cl->len);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    client_gone(c);
+    return;
+  }
+  cl->len += n;
+  cl->in[cl->len] = '\0';
+  line = cl->in;
+  while ((nl = strchr(line, '\n')) != NULL) {
+    *nl = '\0';
+    client_line(c, line);
+    if (cl->fd == -1)
+      return;
+    line = nl + 1;
+  }
+  cl->len -= line - cl->in;
+  memmove(cl->in, line, cl->len);
+  if (cl->len == sizeof(cl->in) - 1) {
+    fprintf(stderr, "[LEASED] line too long, dropping client\n");
+    client_gone(c);
+  }
+}
+
+// ms until the next lease runs out, -1 if none does
+static int next_expiry()
+{
+  struct lease *l;
+  struct holder *h;
+  double t = now(), first = -1;
+  int i;
+
+  for (i = 0; i < LEASE_BUCKETS; ++i)
+    for (l = buckets[i]; l != NULL; l = l->next)
+      for (h = l->holders; h != NULL; h = h->next)
+        if (first < 0 || h->expiry < first)
+          first = h->expiry;
+  if (first < 0)
+    return -1;
+  return first <= t ? 0 : (int)((first - t) * 1000) + 1;
+}
+
+static void expire_all()
+{
+  struct lease *l;
+  int i;
+
+  for (i = 0; i < LEASE_BUCKETS; ++i)
+    for (l = buckets[i]; l != NULL; l = l->next)
+      if (l->holders != NULL)
+        lease_progress(l);
+}
+
+int main(int argc, char *argv[])
+{
+  struct pollfd fds[MAX_CLIENTS + 1];
+  struct sockaddr_in addr;
+  struct timeval tv;
+  int port = 7070, opt, lfd, one = 1, i, n, c;
+
+  while ((opt = getopt(argc, argv, "p:t:")) != -1) {
+    switch (opt) {
+      case 'p': port = atoi(optarg); break;
+      case 't': term = atof(optarg); break;
+      default:
+        printf("Usage: %s [-p port] [-t lease seconds]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (term <= 0) {
+    printf("The lease term must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  gettimeofday(&tv, NULL);
+  last_version = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+  if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(lfd, 64) == -1) {
+    perror("bind");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < MAX_CLIENTS; ++i)
+    clients[i].fd = -1;
+  fprintf(stderr, "[LEASED] port %d, %g second leases\n", port, term);
+
+  for (;;) {
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+    if ((n = poll(fds, MAX_CLIENTS + 1, next_expiry())) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if ((c = accept(lfd, NULL, NULL)) != -1) {
+        for (i = 0; i < MAX_CLIENTS && clients[i].fd != -1; ++i);
+        if (i == MAX_CLIENTS) {
+          close(c);
+        } else {
+          setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          fcntl(c, F_SETFL, fcntl(c, F_GETFL) | O_NONBLOCK);
+          clients[i].fd = c;
+          clients[i].len = 0;
+        }
+      }
+    }
+    for (i = 0; i < MAX_CLIENTS; ++i)
+      if (clients[i].fd != -1 && fds[i + 1].fd == clients[i].fd &&
+          (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        client_input(i);
+    expire_all();
+  }
+  return 0;
+}
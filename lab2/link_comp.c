@@ -0,0 +1,130 @@
+/*
+ * Adaptive compression for the local backend's simulated link.
+ *
+ * Deflating a chunk only helps when the time it saves on the wire is
+ * more than the time spent deflating and inflating it. Both depend on
+ * the data and the link, so we keep moving averages of the ratio and
+ * of the compressor speed, and compress only while
+ *
+ *     (1 - ratio) / bandwidth  >  1 / speed
+ *
+ * i.e. the wire time saved per byte beats the cpu time per byte. While
+ * it doesn't, every LINK_PROBE_EVERY chunk is still compressed, so we
+ * notice when the data (or the link) changes.
+ *
+ * zlib rather than lz4/zstd since that is what every box has; level 1
+ * is in the same league for this purpose.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "link_comp.h"
+
+#define LINK_PROBE_EVERY 16
+#define LINK_AVG_WEIGHT 0.25  // weight of the newest sample
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void link_comp_init(struct link_comp *lc, int level)
+{
+  lc->level = level > 9 ? 9 : level;
+  lc->ratio = 0.5;  // optimistic, so the first chunks try it
+  lc->speed = 0;    // unknown
+  lc->skipped = 0;
+  lc->raw = 0;
+  lc->wire = 0;
+  pthread_mutex_init(&lc->lock, NULL);
+}
+
+/*
+ * Should the next chunk be compressed. Called with lc->lock held.
+ *
+ * */
+static int link_comp_worth(struct link_comp *lc, double bandwidth)
+{
+  if (lc->speed <= 0)
+    return 1; // no measurement yet
+  if ((1 - lc->ratio) / bandwidth > 1 / lc->speed)
+    return 1;
+  if (++lc->skipped >= LINK_PROBE_EVERY)
+    return 1;
+  return 0;
+}
+
+/*
+ * Deflate buf, and inflate it again as the far side would. Returns the
+ * compressed size, or len if it didn't shrink (or zlib failed) and the
+ * chunk goes raw.
+ *
+ * */
+static size_t link_comp_roundtrip(int level, const void *buf, size_t len)
+{
+  uLongf zlen = compressBound(len), olen = len;
+  Bytef *zbuf = malloc(zlen);
+  Bytef *obuf = malloc(len);
+  size_t sent = len;
+
+  if (zbuf != NULL && obuf != NULL &&
+      compress2(zbuf, &zlen, buf, len, level) == Z_OK && zlen < len &&
+      uncompress(obuf, &olen, zbuf, zlen) == Z_OK && olen == len)
+    sent = zlen;
+
+  free(zbuf);
+  free(obuf);
+  return sent;
+}
+
+size_t link_comp_send(struct link_comp *lc, const void *buf, size_t len,
+    double bandwidth)
+{
+  double start, elapsed;
+  size_t sent = len;
+  int try;
+
+  if (lc->level <= 0 || bandwidth <= 0 || len == 0)
+    return len; // nothing to gain on an unlimited link
+
+  pthread_mutex_lock(&lc->lock);
+  try = link_comp_worth(lc, bandwidth);
+  if (try)
+    lc->skipped = 0;
+  pthread_mutex_unlock(&lc->lock);
+
+  if (try) {
+    start = now();
+    sent = link_comp_roundtrip(lc->level, buf, len);
+    elapsed = now() - start;
+  }
+
+  pthread_mutex_lock(&lc->lock);
+  if (try) {
+    lc->ratio += LINK_AVG_WEIGHT * ((double)sent / len - lc->ratio);
+    if (elapsed > 0) {
+      if (lc->speed <= 0)
+        lc->speed = len / elapsed;
+      else
+        lc->speed += LINK_AVG_WEIGHT * (len / elapsed - lc->speed);
+    }
+  }
+  lc->raw += len;
+  lc->wire += sent;
+  pthread_mutex_unlock(&lc->lock);
+
+  return sent;
+}
+
+void link_comp_destroy(struct link_comp *lc)
+{
+  if (lc->level > 0 && lc->raw > 0)
+    fprintf(stderr, "[NETFS] link compression: %lu bytes sent as %lu (%.0f%%)\n",
+        lc->raw, lc->wire, 100.0 * lc->wire / lc->raw);
+  pthread_mutex_destroy(&lc->lock);
+}
@@ -0,0 +1,28 @@
+#ifndef _LINK_COMP_H_
+#define _LINK_COMP_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+// adaptive compression of the data crossing a simulated link
+struct link_comp {
+  int level;          // zlib level, 0 = never compress
+  double ratio;       // compressed / raw size, moving average
+  double speed;       // raw bytes per second through deflate + inflate
+  int skipped;        // chunks sent raw since the last try
+  unsigned long raw;  // bytes handed to the link
+  unsigned long wire; // bytes that actually crossed it
+  pthread_mutex_t lock;
+};
+
+void link_comp_init(struct link_comp *lc, int level);
+
+// send len bytes of buf over a link of bandwidth bytes per second.
+// compresses when it is expected to be faster than sending raw, the
+// receiving side's inflate included. returns the bytes to book on the link.
+size_t link_comp_send(struct link_comp *lc, const void *buf, size_t len,
+    double bandwidth);
+
+void link_comp_destroy(struct link_comp *lc);
+
+#endif
@@ -24,39 +24,226 @@ http://api.libssh.org/master/libssh_tutor_guided_tour.html
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
-#include <libssh/libssh.h>
-#include <libssh/sftp.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "state.h"
-#include "ssh_connect.h"
-#include "sftp_connect.h"
+#include "backend.h"
+#include "attr_cache.h"
+#include "netfs_file.h"
+#include "flusher.h"
+#include "stats.h"
+#include "pack_cache.h"
+#include "prefetch.h"
+#include "dedup_store.h"
+#include "kernel_cache.h"
+#include "parallel_fetch.h"
+#include "cache_journal.h"
+#include "sparse.h"
+#include "lease_client.h"
+#include "netfs_ll.h"
+
+// where the files really are, sftp or a local stand-in
+static struct netfs_backend *backend;
+
+struct netfs_state *netfs_data;
+
+// zero runs smaller than this are sent anyway, one write beats several
+#define NETFS_SPARSE_UNIT 65536
+
+// read it to see the counters of every operation, cat works
+#define NETFS_STATS_PATH "/.netfs-stats"
+#define NETFS_STATS_MAX 65536
+
+#define NETFS_OPT(t, p, v) { t, offsetof(struct netfs_state, p), v }
+
+static struct fuse_opt netfs_opts[] = {
+  NETFS_OPT("cache_ttl=%lf", cache_ttl, 0),
+  NETFS_OPT("negative_ttl=%lf", negative_ttl, 0),
+  NETFS_OPT("connections=%d", connections, 0),
+  NETFS_OPT("async_flush", async_flush, 1),
+  NETFS_OPT("flush_queue=%d", flush_queue, 0),
+  NETFS_OPT("nobig_writes", big_writes, 0),
+  NETFS_OPT("backend=%s", backend_name, 0),
+  NETFS_OPT("rootdir=%s", rootdir, 0),
+  NETFS_OPT("latency_ms=%lf", latency_ms, 0),
+  NETFS_OPT("bandwidth_kbs=%lf", bandwidth_kbs, 0),
+  NETFS_OPT("stream_kbs=%lf", stream_kbs, 0),
+  NETFS_OPT("compression=%d", compression, 0),
+  NETFS_OPT("compression", compression, 1),
+  NETFS_OPT("pack_small=%d", pack_small_kb, 0),
+  NETFS_OPT("pack_size=%d", pack_size_mb, 0),
+  NETFS_OPT("prefetch", prefetch, 1),
+  NETFS_OPT("prefetch_max=%d", prefetch_max, 0),
+  NETFS_OPT("prefetch_kbs=%lf", prefetch_kbs, 0),
+  NETFS_OPT("dedup", dedup, 1),
+  NETFS_OPT("dedup_block=%d", dedup_block_kb, 0),
+  NETFS_OPT("dedup_size=%d", dedup_size_mb, 0),
+  NETFS_OPT("nokeep_cache", keep_cache, 0),
+  NETFS_OPT("kernel_ttl=%lf", kernel_ttl, 0),
+  NETFS_OPT("streams=%d", streams, 0),
+  NETFS_OPT("stream_piece=%d", stream_piece_kb, 0),
+  NETFS_OPT("lowlevel", lowlevel, 1),
+  NETFS_OPT("resume", resume, 1),
+  NETFS_OPT("resume_block=%d", resume_block_kb, 0),
+  NETFS_OPT("sparse", sparse, 1),
+  NETFS_OPT("lease_server=%s", lease_server, 0),
+  NETFS_OPT("cache_dir=%s", cache_dir, 0),
+  FUSE_OPT_END
+};
 
-static const char *rootdir =  "/home/ubuntu/shared";
-ssh_session session;
-sftp_session sftp;
-//#define FUSE_CAP_BIG_WRITES (1<<5)
+/*
+ * Create an equivalent structure in /tmp (or -o cache_dir) for caching.
+ * Since different files may exists in different directories with
+ * same name. we don't want path conflicts.
+ *
+ * */
+static void netfs_temppath(char fpath[PATH_MAX], const char *path)
+{
+  snprintf(fpath, PATH_MAX, "%s%s", NETFS_DATA->cache_dir, path);
+}
 
 /*
- * Get the full path of given resource
+ * Make the directories leading to the cache file tpath, the remote tree
+ * is mirrored under the cache directory as files get opened.
  *
  * */
-static void netfs_fullpath(char fpath[PATH_MAX], const char *path)
+static void netfs_cache_mkdirs(const char *tpath)
 {
-  strcpy(fpath, rootdir);
-  strncat(fpath, path, PATH_MAX);
+  char dir[PATH_MAX];
+  char *slash;
+
+  strncpy(dir, tpath, PATH_MAX - 1);
+  dir[PATH_MAX - 1] = '\0';
+  for (slash = strchr(dir + strlen(NETFS_DATA->cache_dir) + 1, '/'); slash != NULL;
+      slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(dir, 0700); // most of the time it is there already
+    *slash = '/';
+  }
 }
 
+/*
+ * A scratch file in /tmp that is gone as soon as its fd is closed.
+ *
+ * */
+static int netfs_anon_file()
+{
+  char tpath[] = "/tmp/netfs.XXXXXX";
+  int fd;
+
+  if ((fd = mkstemp(tpath)) == -1)
+    return -errno;
+  unlink(tpath);
+  return fd;
+}
 
 /*
- * Create an equivalent structure in /tmp directory for caching.
- * Since different files may exists in different directories with
- * same name. we don't want path conflicts.
+ * fstat of the cache file of nf, with the size of the file rather than
+ * the segment when it is packed. Called with nf->lock held.
  *
  * */
-static void netfs_temppath(char fpath[PATH_MAX], const char *path)
+static int netfs_cache_stat(struct netfs_file *nf, struct stat *st)
 {
-  strcpy(fpath, "/tmp");
-  strncat(fpath, path, PATH_MAX);
+  if (fstat(nf->fd, st) == -1)
+    return -1;
+  if (nf->length >= 0) {
+    st->st_size = nf->length;
+    st->st_blocks = (nf->length + 511) / 512;
+  }
+  return 0;
+}
+
+/*
+ * pread from a packed or deduped file, stopping at its end. Called
+ * with nf->lock held, see netfs_unpack.
+ *
+ * */
+static ssize_t netfs_packed_pread(struct netfs_file *nf, char *buf,
+    size_t size, off_t offset)
+{
+  size_t bs = dedup_block_size(), done = 0, n;
+  ssize_t len;
+  off_t pos;
+
+  if (offset >= nf->length)
+    return 0;
+  if (nf->length - offset < (off_t)size)
+    size = nf->length - offset;
+  if (nf->map == NULL)
+    return pread(nf->fd, buf, size, nf->base + offset);
+
+  // block by block, each one is wherever the store put it
+  while (done < size) {
+    pos = offset + done;
+    n = bs - pos % bs < size - done ? bs - pos % bs : size - done;
+    len = pread(nf->fd, buf + done, n, nf->map->slots[pos / bs] + pos % bs);
+    if (len <= 0)
+      return done > 0 ? (ssize_t)done : len;
+    done += len;
+  }
+  return done;
+}
+
+static void netfs_free_names(char **names, int count)
+{
+  if (names == NULL)
+    return;
+  while (count > 0)
+    free(names[--count]);
+  free(names);
+}
+
+struct netfs_dirfill {
+  const char *path;
+  void *buf;
+  fuse_fill_dir_t filler;
+  char **names;
+  int count;
+  int capacity;
+  int prefetched;   // files handed to the prefetcher so far
+  int prefetch_max;
+};
+
+/*
+ * Called by the backend for each entry of the directory being listed.
+ *
+ * */
+static int netfs_dirfill(void *ctx, const char *name, const struct stat *st)
+{
+  struct netfs_dirfill *df = ctx;
+  char cpath[PATH_MAX];
+
+  df->filler(df->buf, name, st, 0);
+
+  // the listing already carries the attributes, remember them so the
+  // getattr that follows every entry of ls -l is served locally.
+  if (strcmp(name, ".") && strcmp(name, "..")) {
+    snprintf(cpath, PATH_MAX, "%s/%s", strcmp(df->path, "/") ? df->path : "", name);
+    attr_cache_put(cpath, st);
+
+    // small files of a freshly listed directory are likely to be read
+    // next (ls followed by cat, grep -r, builds), fetch them ahead.
+    if (S_ISREG(st->st_mode) && st->st_size <= pack_threshold() &&
+        df->prefetched < df->prefetch_max && prefetch_enabled()) {
+      prefetch_enqueue(cpath, st);
+      df->prefetched++;
+    }
+  }
+  if (df->names != NULL && df->count == df->capacity) {
+    char **grown = realloc(df->names, 2 * df->capacity * sizeof(char *));
+    if (grown == NULL) {
+      netfs_free_names(df->names, df->count); // just don't cache this listing
+      df->names = NULL;
+    } else {
+      df->names = grown;
+      df->capacity *= 2;
+    }
+  }
+  if (df->names != NULL)
+    df->names[df->count++] = strdup(name);
+  return 0;
 }
 
 /*
@@ -69,46 +256,75 @@ static int netfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
 
 #ifdef DEBUG
-  fprintf(stderr, "[NETFS] getattr called. going to call remote sftp\n");
+  fprintf(stderr, "[NETFS:readdir] readdir called with path = %s\n", path);
 #endif
 
-  sftp_dir dir;
-  sftp_attributes attributes;
+  struct netfs_dirfill df;
   int rc;
   (void) offset;
   (void) fi;
 
-  char fpath[PATH_MAX];
-  netfs_fullpath(fpath, path);
-  dir = sftp_opendir(sftp, fpath);
-
-  fprintf(stderr, "[NETFS:readdir] FPATH: %s\n", fpath);
-  if (!dir) {
-    fprintf(stderr, "Directory not opened: %s\n",
-        ssh_get_error(session));
-    return -1;
+  if (attr_cache_fill_dir(path, buf, filler))
+    return EXIT_SUCCESS;
+
+  df.path = path;
+  df.buf = buf;
+  df.filler = filler;
+  df.count = 0;
+  df.capacity = 64;
+  df.names = malloc(df.capacity * sizeof(char *));
+  df.prefetched = 0;
+  df.prefetch_max = NETFS_DATA->prefetch_max;
+
+  if ((rc = backend->list(backend, path, netfs_dirfill, &df)) < 0) {
+    netfs_free_names(df.names, df.count);
+    return rc;
   }
 
-  while ((attributes = sftp_readdir(sftp, dir)) != NULL) {
-    filler(buf, attributes->name, NULL, 0);
-  }
+  if (df.names != NULL)
+    attr_cache_put_dir(path, df.names, df.count); // cache owns names now
 
-  if (!sftp_dir_eof(dir)) {
-    fprintf(stderr, "Can't list directory: %s\n", ssh_get_error(session));
-    sftp_closedir(dir);
-    return -1;
-  }
+  return EXIT_SUCCESS;
+}
 
-  rc = sftp_closedir(dir);
-  if (rc != SSH_OK) {
-    fprintf(stderr, "Can't close directory: %s\n",
-        ssh_get_error(session));
-    return -1;
+/*
+ * Attributes of an open file with changes the remote side hasn't seen
+ * yet: new, written, truncated, chmod or utimens waiting for the next
+ * upload. Returns 0 with stbuf filled, 1 if the remote ones are right.
+ *
+ * */
+static int netfs_local_attr(struct netfs_file *nf, struct stat *stbuf)
+{
+  struct stat st;
+  int local = 0;
+
+  pthread_mutex_lock(&nf->lock);
+  if (netfs_cache_stat(nf, &st) == 0 &&
+      (nf->created || nf->dirty.head != NULL || st.st_size != nf->remote_size ||
+       nf->set_mode || nf->set_times)) {
+    local = 1;
+    memcpy(stbuf, &nf->attr, sizeof(struct stat));
+    stbuf->st_size = st.st_size;
+    stbuf->st_blocks = st.st_blocks;
+    if (!nf->set_times && (nf->dirty.head != NULL || st.st_size != nf->remote_size)) {
+      stbuf->st_mtime = st.st_mtime;
+      stbuf->st_ctime = st.st_ctime;
+    }
   }
+  pthread_mutex_unlock(&nf->lock);
+  return local ? 0 : 1;
+}
 
-  sftp_attributes_free(attributes);
-
-  return EXIT_SUCCESS;
+/*
+ * Owner of the process behind the request being served.
+ *
+ * */
+static void netfs_caller(uid_t *uid, gid_t *gid)
+{
+  if (netfs_ll_caller(uid, gid) == 0)
+    return;
+  *uid = fuse_get_context()->uid;
+  *gid = fuse_get_context()->gid;
 }
 
 /*
@@ -118,47 +334,458 @@ static int netfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int netfs_getattr(const char *path, struct stat *stbuf)
 {
 #ifdef DEBUG
-  fprintf(stderr, "[NETFS] getattr called. going to call remote sftp\n");
+  fprintf(stderr, "[NETFS] getattr called. going to call remote\n");
 #endif
 
-  sftp_attributes attributes;
-  char fpath[PATH_MAX];
-  netfs_fullpath(fpath, path);
+  struct netfs_file *nf;
+  int rc;
 
-  // attributes = sftp_lstat(sftp, fpath);
-  if ((attributes = sftp_lstat(sftp, fpath)) == NULL) {
-    fprintf(stderr, "Unable to stat file/directory: %s\n", ssh_get_error(session));
-    return -1;
+  if (strcmp(path, NETFS_STATS_PATH) == 0) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    netfs_caller(&stbuf->st_uid, &stbuf->st_gid);
+    return 0; // size unknown until it is opened, read with direct_io
+  }
+
+  // files open here know better than the remote side
+  if ((nf = netfs_file_find(path)) != NULL) {
+    rc = netfs_local_attr(nf, stbuf);
+    netfs_file_put(nf);
+    if (rc == 0)
+      return 0;
   }
 
-  memset(stbuf, 0, sizeof(struct stat));
+  // nobody changed it since we cached it, the ttl doesn't matter
+  if (lease_cache_valid(path, stbuf))
+    return 0;
 
-  // name and group name are only set if openssh is used.
-  // fprintf(stderr, "owner name %s: group name %s", attributes->owner, attributes->group);
-  stbuf->st_mode = attributes->permissions;
-  stbuf->st_uid = attributes->uid;
-  stbuf->st_gid = attributes->gid;
-  stbuf->st_size = attributes->size;
-  stbuf->st_atime = attributes->atime;
-  stbuf->st_ctime = attributes->createtime;
-  stbuf->st_mtime = attributes->mtime;
-  stbuf->st_nlink = 1; // figure out a way to get hard link count
+  if ((rc = attr_cache_get(path, stbuf)) != 0)
+    return rc < 0 ? rc : 0;
 
-  sftp_attributes_free(attributes);
+  if ((rc = backend->stat(backend, path, stbuf)) < 0) {
+    if (rc == -ENOENT)
+      attr_cache_put_negative(path);
+    return rc;
+  }
 
+  attr_cache_put(path, stbuf);
   return 0;
 }
 
-sftp_attributes netfs_filesize(sftp_file file) {
-  sftp_attributes attributes;
+/*
+ * With -o sparse, zeros that came over the link become holes in the
+ * cache file fd of the remote version st, they take no room in /tmp.
+ * Passes fd (or an error) through.
+ *
+ * */
+static int netfs_cache_holes(int fd, const struct stat *st)
+{
+  off_t punched;
 
-  if ((attributes = sftp_fstat(file)) == NULL) {
-    fprintf(stderr, "Unable to stat file/directory: %s\n", ssh_get_error(session));
-    return -1;
+  if (fd < 0 || !NETFS_DATA->sparse || !S_ISREG(st->st_mode))
+    return fd;
+  if ((punched = sparse_punch_zeros(fd, 0, st->st_size)) > 0)
+    stats_count(STATS_SPARSE_PUNCHED, punched);
+  return fd;
+}
+
+/*
+ * Bring the cache file tpath up to the remote version st block by
+ * block, keeping what an earlier run left there and its journal
+ * vouches for. Returns the local fd, or -EAGAIN to download the whole
+ * file the usual way (no journal, or the file changed under us).
+ *
+ * */
+static int netfs_download_resume(const char *path, const char *tpath,
+    const struct stat *st)
+{
+  size_t block = (size_t)NETFS_DATA->resume_block_kb * 1024;
+  struct cache_journal *j;
+  int fd, first = 0, count, i;
+  ssize_t rc = 0;
+
+  if ((fd = open(tpath, O_RDWR | O_CREAT, st->st_mode & 0777)) == -1)
+    return -EAGAIN;
+  if ((j = cache_journal_open(tpath, fd, st, block)) == NULL) {
+    close(fd);
+    return -EAGAIN;
+  }
+
+  // one block per call, so the journal never trails by more than one
+  while (rc >= 0 && (count = cache_journal_missing(j, &first)) > 0) {
+    for (i = first; rc >= 0 && i < first + count; ++i) {
+      off_t off = (off_t)i * block;
+      off_t len = st->st_size - off < (off_t)block ? st->st_size - off : (off_t)block;
+
+      rc = backend->read_range(backend, path, fd, off, len);
+      if (rc >= 0 && rc != len)
+        rc = -EAGAIN; // shorter than it was a moment ago
+      if (rc >= 0)
+        rc = cache_journal_record(j, fd, i);
+    }
+    first += count;
+  }
+  cache_journal_close(j);
+
+  // a longer leftover of an older version, or holes never written
+  if (rc >= 0 && ftruncate(fd, st->st_size) == -1)
+    rc = -errno;
+  if (rc < 0) {
+    close(fd);
+    if (rc == -EAGAIN)
+      cache_journal_remove(tpath);
+    return rc;
+  }
+  return fd;
+}
+
+/*
+ * Copy the remote file with attributes st into the local file tpath.
+ * Files of at least two pieces come over several streams at once.
+ * Returns the local fd opened for reading and writing, or -errno.
+ *
+ * */
+static int netfs_download(const char *path, const char *tpath, const struct stat *st)
+{
+  struct netfs_state *state = NETFS_DATA;
+  off_t piece = (off_t)state->stream_piece_kb * 1024;
+  ssize_t rc = -EAGAIN;
+  int fd;
+
+  netfs_cache_mkdirs(tpath);
+  if (state->resume && S_ISREG(st->st_mode) &&
+      (fd = netfs_download_resume(path, tpath, st)) != -EAGAIN)
+    return netfs_cache_holes(fd, st);
+  fd = open(tpath, O_RDWR | O_CREAT | O_TRUNC, st->st_mode & 0777);
+  if (fd == -1) {
+    fprintf(stderr, "I couldn't open %s for writing.\n", tpath);
+    return -errno;
+  }
+
+  if (state->streams > 1 && S_ISREG(st->st_mode) && st->st_size >= 2 * piece)
+    rc = parallel_fetch(backend, path, fd, st->st_size, state->streams, piece);
+  // one stream, or the file changed size under the parallel fetch
+  if (rc == -EAGAIN && ftruncate(fd, 0) == 0)
+    rc = backend->read_range(backend, path, fd, 0, -1);
+  if (rc < 0) {
+    fprintf(stderr, "Error while reading file %s\n", path);
+    close(fd);
+    return rc;
+  }
+  return netfs_cache_holes(fd, st);
+}
+
+/*
+ * Open the stats file: a snapshot of the counters in an unlinked temp
+ * file, so read and read_buf serve it like any cache file. It never
+ * gets dirty, so flush has nothing to upload.
+ *
+ * */
+static int netfs_open_stats(struct fuse_file_info *fi)
+{
+  struct netfs_file *nf;
+  char *text;
+  size_t len;
+  int fd;
+
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    return -EACCES;
+
+  if ((text = malloc(NETFS_STATS_MAX)) == NULL)
+    return -ENOMEM;
+  len = stats_format(text, NETFS_STATS_MAX);
+
+  if ((fd = netfs_anon_file()) < 0) {
+    free(text);
+    return fd;
+  }
+  if (write(fd, text, len) != (ssize_t)len) {
+    free(text);
+    close(fd);
+    return -EIO;
+  }
+  free(text);
+
+  if ((nf = netfs_file_new(fd, len)) == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+  fi->direct_io = 1; // getattr said size 0, don't let the kernel trust it
+  fi->fh = (uintptr_t)nf;
+  return 0;
+}
+
+/*
+ * Small files opened for reading go to the pack segment. If the packed
+ * copy is current no transfer at all, otherwise it is fetched into a
+ * scratch file and appended. When the pack is full the scratch file
+ * itself serves as the cache file.
+ * Returns the fd, with the file at *base in it and *length long
+ * (-1 if the fd is the file's own), or -errno.
+ *
+ * */
+static int netfs_open_packed(const char *path, const struct stat *st,
+    off_t *base, off_t *length)
+{
+  ssize_t n;
+  int fd, scratch;
+
+  if ((fd = pack_open(path, st, base)) >= 0) {
+    *length = st->st_size;
+    return fd;
   }
-  return attributes;
+
+  if ((scratch = netfs_anon_file()) < 0)
+    return scratch;
+  if ((n = backend->read_range(backend, path, scratch, 0, -1)) < 0) {
+    close(scratch);
+    return n;
+  }
+
+  if ((fd = pack_add(path, st, scratch, n, 0, base)) < 0) {
+    *length = -1;
+    return scratch;
+  }
+  close(scratch);
+  *length = n;
+  return fd;
+}
+
+/*
+ * Larger files go through the dedup store when it is on. If the remote
+ * side can hash the file only the blocks we don't have are fetched,
+ * one request per run of missing blocks. Otherwise all of it is, and
+ * blocks we have already are at least not stored twice.
+ * Returns the fd, with *map set if it is the store and *length the
+ * file size, or -errno. Whatever the store can't take is downloaded
+ * to tpath as before.
+ *
+ * */
+static int netfs_open_dedup(const char *path, const char *tpath,
+    const struct stat *st, struct dedup_map **map, off_t *length)
+{
+  size_t bs = dedup_block_size();
+  int nblocks = (st->st_size + bs - 1) / bs;
+  struct city128 *hashes;
+  char *fetched;
+  ssize_t n = 0;
+  int i, j, fd, scratch = -1;
+
+  if ((fd = dedup_open(path, st, map)) >= 0) {
+    *length = st->st_size;
+    return fd;
+  }
+
+  hashes = malloc((nblocks + 1) * sizeof(struct city128));
+  fetched = calloc(nblocks + 1, 1);
+  if (hashes == NULL || fetched == NULL || (scratch = netfs_anon_file()) < 0)
+    goto download;
+
+  if (backend->block_hashes(backend, path, bs, hashes, nblocks) == nblocks) {
+    for (i = 0; n >= 0 && i < nblocks; i = j) {
+      if (dedup_has(&hashes[i])) {
+        j = i + 1;
+        continue;
+      }
+      for (j = i; j < nblocks && !dedup_has(&hashes[j]); ++j)
+        fetched[j] = 1;
+      n = backend->read_range(backend, path, scratch, (off_t)i * bs,
+          (off_t)(j - i) * bs);
+    }
+  } else {
+    // no hashes, or the file changed since st
+    free(hashes);
+    hashes = NULL;
+    n = backend->read_range(backend, path, scratch, 0, -1);
+  }
+  if (n < 0) {
+    fd = n;
+    goto out;
+  }
+
+  if ((fd = dedup_add(path, st, scratch, hashes, hashes ? fetched : NULL, map)) >= 0) {
+    *length = st->st_size;
+  } else if (hashes == NULL && n == st->st_size) {
+    fd = scratch; // the store is full, keep it as it is
+    scratch = -1;
+  } else {
+    goto download;
+  }
+
+out:
+  if (scratch >= 0)
+    close(scratch);
+  free(hashes);
+  free(fetched);
+  return fd;
+
+download:
+  if (scratch >= 0)
+    close(scratch);
+  free(hashes);
+  free(fetched);
+  return netfs_download(path, tpath, st);
+}
+
+/*
+ * Prefetcher callback: put path in the pack segment unless a current
+ * copy is there already. Runs on the prefetch thread, never seen by
+ * open until it asks for the file.
+ *
+ * */
+static ssize_t netfs_prefetch_one(const char *path, const struct stat *st)
+{
+  off_t base;
+  ssize_t n;
+  int fd, scratch;
+
+  if (pack_has(path, st))
+    return 0;
+
+  if ((scratch = netfs_anon_file()) < 0)
+    return scratch;
+  if ((n = backend->read_range(backend, path, scratch, 0, -1)) < 0) {
+    close(scratch);
+    return n;
+  }
+
+  fd = pack_add(path, st, scratch, n, 1, &base);
+  close(scratch);
+  if (fd < 0)
+    return fd;
+  close(fd);
+  return n;
+}
+
+/*
+ * Give a packed or deduped file a cache file of its own, it is about
+ * to change.
+ *
+ * */
+static int netfs_unpack(const char *path, struct netfs_file *nf)
+{
+  char tpath[PATH_MAX], buf[65536];
+  off_t done;
+  ssize_t n;
+  int fd;
+
+  pthread_mutex_lock(&nf->lock);
+  if (nf->length < 0) {
+    pthread_mutex_unlock(&nf->lock);
+    return 0;
+  }
+
+  netfs_temppath(tpath, path);
+  netfs_cache_mkdirs(tpath);
+  if ((fd = open(tpath, O_RDWR | O_CREAT | O_TRUNC, nf->attr.st_mode & 0777)) == -1) {
+    pthread_mutex_unlock(&nf->lock);
+    return -errno;
+  }
+  for (done = 0; done < nf->length; done += n) {
+    n = netfs_packed_pread(nf, buf, sizeof(buf), done);
+    if (n <= 0 || pwrite(fd, buf, n, done) != n) {
+      pthread_mutex_unlock(&nf->lock);
+      close(fd);
+      return -EIO;
+    }
+  }
+
+  // packed reads hold the lock, nobody else is using the old fd
+  close(nf->fd);
+  nf->fd = fd;
+  nf->base = 0;
+  nf->length = -1;
+  if (nf->map != NULL) {
+    dedup_map_put(nf->map);
+    nf->map = NULL;
+  }
+  pthread_mutex_unlock(&nf->lock);
+
+  pack_remove(path);
+  dedup_remove(path);
+  return 0;
+}
+
+/*
+ * With -o lease_server, the remote file of path changes under a write
+ * lease, the other mounts drop their copies first. Returns whether one
+ * is held, lease_put it after.
+ *
+ * */
+static int netfs_lease_write(const char *path)
+{
+  if (lease_get(path, LEASE_WRITE) < 0)
+    return 0;
+  lease_cache_drop(path);
+  return 1;
+}
+
+/*
+ * nf was just changed. It keeps a write lease from its first change
+ * until the upload, a queued upload included, so no other mount reads
+ * the remote file in between: a recall uploads first. A recall takes
+ * the lease away even if that upload fails, the next change or upload
+ * asks for a new one.
+ *
+ * */
+static void netfs_hold_write(const char *path, struct netfs_file *nf)
+{
+  char *copy;
+  int held;
+
+  pthread_mutex_lock(&nf->lock);
+  held = nf->lease_path != NULL;
+  pthread_mutex_unlock(&nf->lock);
+  if (held || !netfs_lease_write(path))
+    return;
+
+  copy = strdup(path);
+  pthread_mutex_lock(&nf->lock);
+  if (copy != NULL && nf->lease_path == NULL) {
+    nf->lease_path = copy;
+    copy = NULL;
+    held = 1;
+  }
+  pthread_mutex_unlock(&nf->lock);
+  if (!held) {
+    // out of memory, or another change took one meanwhile
+    lease_put(path);
+    free(copy);
+  }
+}
+
+// does nf have changes the remote file lacks. Called with nf->lock held
+static int netfs_changed(struct netfs_file *nf)
+{
+  struct stat st;
+
+  return !nf->unlinked && (nf->dirty.head != NULL || nf->created ||
+      nf->set_mode || nf->set_times ||
+      netfs_cache_stat(nf, &st) != 0 || st.st_size != nf->remote_size);
 }
 
+/*
+ * nf was uploaded. Unless it changed again meanwhile its write lease
+ * goes back to being an ordinary one, recalled like any other. A
+ * recalled one goes in any case.
+ *
+ * */
+static void netfs_drop_write(struct netfs_file *nf, int recalled)
+{
+  char *path = NULL;
+
+  pthread_mutex_lock(&nf->lock);
+  if (recalled || !netfs_changed(nf)) {
+    path = nf->lease_path;
+    nf->lease_path = NULL;
+  }
+  pthread_mutex_unlock(&nf->lock);
+  if (path != NULL) {
+    lease_put(path);
+    free(path);
+  }
+}
 
 /*
  * This methods downloads the file to /tmp
@@ -172,57 +799,155 @@ static int netfs_open(const char *path, struct fuse_file_info *fi)
   fprintf(stderr, "[NETFS:open] open called with path = %s\n", path);
 #endif
 
-  char fpath[PATH_MAX];
-  netfs_fullpath(fpath, path);
+  if (strcmp(path, NETFS_STATS_PATH) == 0)
+    return netfs_open_stats(fi);
+
+  struct netfs_file *nf;
+  struct stat st, local;
+  int fresh, rc, fd, leased;
+  int writing = (fi->flags & O_ACCMODE) != O_RDONLY;
 
   char tpath[PATH_MAX];
   netfs_temppath(tpath, path);
 
-  /* open the remote file */
-  sftp_file file = sftp_open(sftp, fpath, O_RDONLY, 0);
-  if (file == NULL) {
-    fprintf(stderr, "no podia abrir la ficha. %s\n", ssh_get_error(session));
-    return -1;
+  if ((nf = netfs_file_lookup(path, &fresh)) == NULL)
+    return -ENOMEM;
+
+  // already open, share the cache file (and its unsent changes)
+  if (!fresh) {
+    if ((rc = netfs_file_wait(nf)) == 0 && writing)
+      rc = netfs_unpack(path, nf);
+    if (rc == 0 && writing && NETFS_DATA->resume)
+      cache_journal_remove(tpath);
+    if (rc == 0 && writing)
+      lease_cache_drop(path);
+    if (rc < 0) {
+      netfs_file_put(nf);
+      return rc;
+    }
+    // same cache file as the other opens, same pages
+    fi->keep_cache = NETFS_DATA->keep_cache;
+    fi->fh = (uintptr_t)nf;
+    return 0;
   }
 
-  /* open the local file */
-  sftp_attributes attributes = netfs_filesize(file);
-  int fd = open(tpath,  O_WRONLY | O_CREAT | O_TRUNC, attributes->permissions);
-  if (fd == -1) {
-    fprintf(stderr, "I couldn't open /tmp/%s for writing.\n", tpath);
-    return -1;
+  // the version of the file we are about to cache can't change under
+  // a read lease
+  leased = lease_get(path, LEASE_READ) == 0;
+  if (leased && lease_cache_valid(path, &st) && (fd = open(tpath, O_RDWR)) >= 0) {
+    stats_count(STATS_LEASE_HITS, 1);
+  } else if ((fd = backend->stat(backend, path, &st)) >= 0) {
+    if (leased)
+      stats_count(STATS_LEASE_MISSES, 1);
+    if (!writing && S_ISREG(st.st_mode) && pack_threshold() > 0 &&
+        st.st_size <= pack_threshold())
+      fd = netfs_open_packed(path, &st, &nf->base, &nf->length);
+    else if (S_ISREG(st.st_mode) && dedup_block_size() > 0)
+      fd = netfs_open_dedup(path, tpath, &st, &nf->map, &nf->length);
+    else
+      fd = netfs_download(path, tpath, &st);
+  }
+  // we just copied it, both sides agree on the size
+  if (fd >= 0 && fstat(fd, &local) == -1) {
+    close(fd);
+    fd = -EIO;
+  }
+  if (fd >= 0 && nf->length >= 0)
+    local.st_size = nf->length;
+  // a cache file of its own, to be reused while nobody writes the file
+  if (leased && fd >= 0 && nf->length < 0 && !writing)
+    lease_cached(path, &st);
+  else if (leased)
+    lease_cache_drop(path);
+  if (leased)
+    lease_put(path);
+  netfs_file_ready(nf, fd, fd < 0 ? 0 : local.st_size, &st);
+  // deduped to save the transfer, but it needs a file of its own
+  if (fd >= 0 && writing && nf->map != NULL && (rc = netfs_unpack(path, nf)) < 0)
+    fd = rc;
+  // the cache file is going to differ from what the journal says
+  if (fd >= 0 && writing && NETFS_DATA->resume)
+    cache_journal_remove(tpath);
+  if (fd < 0) {
+    netfs_file_put(nf);
+    return fd;
   }
 
-  char buffer[16384];
-  int nbytes, nwritten;
-
-  /* read from remote and write to local */
-  for (;;) {
-    /* read */
-    nbytes = sftp_read(file, buffer, sizeof(buffer));
-    if (nbytes == 0) {
-      break; // EOF
-    } else if (nbytes < 0) {
-      fprintf(stderr, "Error while reading file: %s\n",
-          ssh_get_error(session));
-      sftp_close(file);
-      return -1;
-    }
-    /* write */
-    nwritten = write(fd, buffer, nbytes);
-    fprintf("Written %d\n", nbytes);
-    if (nwritten != nbytes) {
-      fprintf(stderr, "Error writing: %s\n",
-          strerror(errno));
-      sftp_close(file);
-      return -1;
+  // pages from the last open are good if the remote file didn't change
+  fi->keep_cache = kernel_cache_valid(path, &st);
+  fi->fh = (uintptr_t)nf; // store it to metadata.
+  return 0;
+}
+
+/*
+ * A new file. It only exists in the cache until its first upload, which
+ * creates it remotely together with the data, chmod and utimens that
+ * came in meanwhile. With async_flush that takes the whole create,
+ * write, close sequence (tar x, cp -r) off the network path. Without
+ * it the remote file is made right away, as before.
+ *
+ * */
+static int netfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  struct netfs_file *nf;
+  struct stat st;
+  char tpath[PATH_MAX];
+  int fresh, fd, rc;
+
+  if ((nf = netfs_file_lookup(path, &fresh)) == NULL)
+    return -ENOMEM;
+
+  netfs_temppath(tpath, path);
+  // the cache file is going to differ from what the journal says
+  if (NETFS_DATA->resume)
+    cache_journal_remove(tpath);
+  lease_cache_drop(path);
+
+  if (!fresh) {
+    rc = netfs_file_wait(nf);
+    if (rc == 0 && (fi->flags & O_EXCL))
+      rc = -EEXIST;
+    if (rc < 0) {
+      netfs_file_put(nf);
+      return rc;
     }
+    fi->fh = (uintptr_t)nf;
+    return 0;
+  }
+
+  netfs_cache_mkdirs(tpath);
+  if ((fd = open(tpath, O_RDWR | O_CREAT | O_TRUNC, mode & 0777)) == -1) {
+    rc = -errno;
+    goto fail;
   }
 
-  fi->fh = fd; // store it to metadata.
-  sftp_close(file);
-  sftp_attributes_free(attributes);
+  // the new file is a change like a write, made under a write lease
+  netfs_hold_write(path, nf);
+  if (!NETFS_DATA->async_flush &&
+      (rc = backend->create(backend, path, mode)) < 0) {
+    close(fd);
+    goto fail;
+  }
+
+  memset(&st, 0, sizeof(struct stat));
+  st.st_mode = S_IFREG | (mode & 07777);
+  st.st_nlink = 1;
+  netfs_caller(&st.st_uid, &st.st_gid);
+  st.st_atime = st.st_mtime = st.st_ctime = time(NULL);
+
+  nf->created = NETFS_DATA->async_flush; // nobody sees nf before ready
+  netfs_file_ready(nf, fd, 0, &st);
+
+  // no more negative entry, and the parent listing is stale
+  attr_cache_invalidate(path);
+
+  fi->fh = (uintptr_t)nf;
   return 0;
+
+fail:
+  netfs_file_ready(nf, rc, 0, NULL);
+  netfs_file_put(nf);
+  return rc;
 }
 
 /*
@@ -235,178 +960,1022 @@ static int netfs_read(const char *path, char *buf, size_t size, off_t offset,
 #ifdef DEBUG
   fprintf(stderr, "[NETFS:read] read called with path = %s\n", path);
 #endif
-  size_t len;
-  (void) fi;
-
-  char tpath[PATH_MAX];
-  netfs_temppath(tpath, path);
+  struct netfs_file *nf = NETFS_FILE(fi);
+  ssize_t len;
+
+  if (nf == NULL)
+    return -EBADF;
+
+  pthread_mutex_lock(&nf->lock);
+  if (nf->length >= 0) {
+    // packed or deduped, hold the lock, see unpack
+    len = netfs_packed_pread(nf, buf, size, offset);
+    pthread_mutex_unlock(&nf->lock);
+  } else {
+    pthread_mutex_unlock(&nf->lock);
+    len = pread(nf->fd, buf, size, offset);
+  }
 
-  int fd = open(tpath, S_IREAD); // READ from the temp file.
-  if (fd == -1) {
-    fprintf(stderr, "I couldn't open /tmp/%s for writing.\n", tpath);
-    return -1;
+  if (len < 0) {
+    fprintf(stderr, "I couldn't read from cache of %s.\n", path);
+    return -errno;
   }
 
-  if (pread(fd, buf, size, offset) < 0) {
-    fprintf(stderr, "I couldn't read from %s.\n", tpath);
-    return -1;
+  return len;
+}
+
+/*
+ * Same as read, but instead of copying the data into a buffer we tell
+ * fuse where it lives in the cache file. fuse splices it from there
+ * straight into the reply, no copy through our address space.
+ * fuse frees the bufvec.
+ *
+ * Packed and deduped files are copied out instead: the fd must not
+ * escape, it changes when the file gets unpacked.
+ *
+ * */
+static int netfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  struct netfs_file *nf = NETFS_FILE(fi);
+  struct fuse_bufvec *src;
+  if (nf == NULL)
+    return -EBADF;
+
+  if ((src = malloc(sizeof(struct fuse_bufvec))) == NULL)
+    return -ENOMEM;
+
+  if (nf->length >= 0) {
+    char *mem = malloc(size);
+    int len;
+
+    if (mem == NULL || (len = netfs_read(path, mem, size, offset, fi)) < 0) {
+      free(mem);
+      free(src);
+      return mem == NULL ? -ENOMEM : -EIO;
+    }
+    *src = FUSE_BUFVEC_INIT(len);
+    src->buf[0].mem = mem; // fuse frees it along with the bufvec
+    *bufp = src;
+    return 0;
   }
 
-  return size;
+  *src = FUSE_BUFVEC_INIT(size);
+  src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  src->buf[0].fd = nf->fd;
+  src->buf[0].pos = offset;
+
+  *bufp = src;
+  return 0;
 }
 
 /*
- * This method writes to tmp file.
+ * This method writes to tmp file and remembers the range so flush
+ * knows what to send back.
+ *
+ * The data comes as a fuse_bufvec. When fuse read the request with
+ * splice it is still sitting in a pipe, and fuse_buf_copy splices it
+ * into the cache file without it ever entering our address space.
  *
  * */
+static int netfs_write_buf(const char *path, struct fuse_bufvec *buf,
+    off_t offset, struct fuse_file_info *fi)
+{
+  struct netfs_file *nf = NETFS_FILE(fi);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+  ssize_t res;
+
+  if (nf == NULL) {
+    fprintf(stderr, "file handler not valid\n");
+    return -EBADF;
+  }
+
+  dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  dst.buf[0].fd = nf->fd;
+  dst.buf[0].pos = offset;
+
+  pthread_mutex_lock(&nf->lock);
+  if (nf->length >= 0) {
+    // opened for writing means unpacked, this is not supposed to happen
+    pthread_mutex_unlock(&nf->lock);
+    return -EBADF;
+  }
+  res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+  if (res < 0) {
+    pthread_mutex_unlock(&nf->lock);
+    fprintf(stderr, "unable to write: %s\n", strerror(-res));
+    return res;
+  }
+  if (dirty_add(&nf->dirty, offset, offset + res) == -1) {
+    pthread_mutex_unlock(&nf->lock);
+    return -ENOMEM;
+  }
+  pthread_mutex_unlock(&nf->lock);
+  netfs_hold_write(path, nf);
+
+  // size and mtime changed under the cached attributes
+  attr_cache_invalidate(path);
+
+  return res;
+}
+
 static int netfs_write(const char *path, const char *buf, size_t size, off_t offset,
-    struct fuse_file_info *file)
+    struct fuse_file_info *fi)
 {
+  struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
 
-  //char tpath[PATH_MAX];
-  //netfs_temppath(tpath, path);
+  src.buf[0].mem = (void *)buf;
+  return netfs_write_buf(path, &src, offset, fi);
+}
 
+struct netfs_upload {
+  const char *path;
   int fd;
-  if (file->fh != NULL && file->fh != -1) {
-    fd = file->fh;
+  mode_t mode;
+  off_t sent;       // bytes that went out
+  off_t high;       // end of the remote file as far as we wrote it
+};
+
+static int netfs_upload_run(void *ctx, off_t offset, off_t len)
+{
+  struct netfs_upload *up = ctx;
+  ssize_t nbytes;
+
+  nbytes = backend->write_range(backend, up->path, up->fd, offset, len, up->mode);
+  if (nbytes < 0)
+    return nbytes;
+  up->sent += nbytes;
+  if (offset + nbytes > up->high)
+    up->high = offset + nbytes;
+  return 0;
+}
+
+/*
+ * Send [start, end) of the cache file. With -o sparse, the part past
+ * remote_size, where the remote file has nothing yet, goes without its
+ * holes and zero blocks: a later write or the final truncate leaves
+ * zeros there all the same. Below remote_size zeros have to be sent,
+ * they may be replacing data.
+ *
+ * */
+static int netfs_upload_range(struct netfs_upload *up, off_t start, off_t end,
+    off_t remote_size)
+{
+  off_t split = start > remote_size ? start : remote_size;
+  off_t sent;
+  int rc;
+
+  if (!NETFS_DATA->sparse || end <= remote_size)
+    return netfs_upload_run(up, start, end - start);
+  if (split > start && (rc = netfs_upload_run(up, start, split - start)) < 0)
+    return rc;
+  sent = up->sent;
+  rc = sparse_walk_data(up->fd, split, end - split, NETFS_SPARSE_UNIT,
+      netfs_upload_run, up);
+  if (rc == 0)
+    stats_count(STATS_SPARSE_SKIPPED, (end - split) - (up->sent - sent));
+  return rc;
+}
+
+/*
+ * Send the dirty ranges of the cache file to the remote file with
+ * positioned writes, then whatever else changed locally: the file
+ * itself if we created it, its size, mode and times. What fails to go
+ * out stays pending for the next attempt.
+ *
+ * */
+static int netfs_upload_dirty(struct netfs_file *nf)
+{
+  char path[PATH_MAX];
+  struct dirty_range *ranges, *r;
+  struct netfs_upload up;
+  struct stat st, attr;
+  off_t remote_size;
+  int rc = 0, created, set_mode, set_times;
+
+  netfs_file_path(nf, path);
+
+  pthread_mutex_lock(&nf->lock);
+  if (nf->unlinked || path[0] == '\0') {
+    pthread_mutex_unlock(&nf->lock);
+    return 0; // gone, the data goes with it
   }
-  else {
-    perror("file handler not valid");
-    return -1;
-    //fd = open(tpath, O_WRONLY); // READ from the temp file.
-    //file->fh = fd;
+  if (netfs_cache_stat(nf, &st) == -1) {
+    pthread_mutex_unlock(&nf->lock);
+    fprintf(stderr, "Unable to fstat temp file locally");
+    return -EIO;
+  }
+  if (nf->dirty.head == NULL && st.st_size == nf->remote_size &&
+      !nf->created && !nf->set_mode && !nf->set_times) {
+    pthread_mutex_unlock(&nf->lock);
+    return 0; // clean, nothing to send
+  }
+  // writes coming in while we upload mark new ranges, sent next time
+  ranges = dirty_take(&nf->dirty);
+  created = nf->created;
+  set_mode = nf->set_mode;
+  set_times = nf->set_times;
+  memcpy(&attr, &nf->attr, sizeof(struct stat));
+  nf->created = nf->set_mode = nf->set_times = 0;
+  remote_size = nf->remote_size;
+  pthread_mutex_unlock(&nf->lock);
+
+  // the first write creates the file, only an empty one needs a create
+  if (created && ranges == NULL)
+    rc = backend->create(backend, path, attr.st_mode);
+
+  up.path = path;
+  up.fd = nf->fd;
+  up.mode = created ? attr.st_mode : st.st_mode;
+  up.sent = 0;
+  up.high = remote_size;
+  for (r = ranges; r != NULL && rc == 0; r = r->next)
+    rc = netfs_upload_range(&up, r->start, r->end, remote_size);
+
+  // cut the remote file, or grow it where nothing was written
+  if (rc == 0 && st.st_size != up.high)
+    rc = backend->truncate(backend, path, st.st_size);
+
+  // after the data, which would bump mtime again
+  if (rc == 0 && set_mode)
+    rc = backend->chmod(backend, path, attr.st_mode);
+  if (rc == 0 && set_times) {
+    struct timespec ts[2] = { attr.st_atim, attr.st_mtim };
+    rc = backend->utimens(backend, path, ts);
   }
 
-  if (fd == -1) {
- //   fprintf(stderr, "Couldn't open %s for writing.\n", tpath);
-    return -1;
+  pthread_mutex_lock(&nf->lock);
+  if (rc == 0) {
+    nf->remote_size = st.st_size;
+  } else {
+    // put the ranges back for the next attempt
+    for (r = ranges; r != NULL; r = r->next)
+      dirty_add(&nf->dirty, r->start, r->end);
+    nf->created |= created;
+    nf->set_mode |= set_mode;
+    if (set_times && !nf->set_times) {
+      nf->attr.st_atim = attr.st_atim;
+      nf->attr.st_mtim = attr.st_mtim;
+      nf->set_times = 1;
+    }
   }
+  pthread_mutex_unlock(&nf->lock);
+  dirty_free(ranges);
 
-  int res = write(fd, buf, size);
-//  int res = pwrite(fd, buf, size, offset);
+#ifdef DEBUG
+  if (rc == 0)
+    fprintf(stderr, "[DEBUG] WRITTEN %ld of %ld BYTES TO REMOTE FILE %s\n",
+        (long)up.sent, (long)st.st_size, path);
+#endif
+  return rc;
+}
 
-  if (res == -1) {
-    perror("unable to write");
-    return -1;
+/*
+ * Push the local changes of nf to the remote file. Also the upload
+ * function of the background flusher.
+ *
+ * */
+static int netfs_sync_file(struct netfs_file *nf)
+{
+  char path[PATH_MAX];
+  int rc, changed;
+
+  // a recall may have taken the write lease since the last change
+  netfs_file_path(nf, path);
+  pthread_mutex_lock(&nf->lock);
+  changed = path[0] != '\0' && netfs_changed(nf);
+  pthread_mutex_unlock(&nf->lock);
+  if (changed)
+    netfs_hold_write(path, nf);
+
+  if ((rc = netfs_upload_dirty(nf)) < 0)
+    return rc;
+  netfs_drop_write(nf, 0);
+
+  netfs_file_path(nf, path);
+  if (path[0] != '\0')
+    attr_cache_invalidate(path);
+  return 0;
+}
+
+/*
+ * The lease server wants the lease of path back. What the other mount
+ * is after is newer than anything we cached, and what was written here
+ * under a write lease goes out before the lease does.
+ *
+ * */
+static void netfs_recall(const char *path, int mode)
+{
+  struct netfs_file *nf;
+
+  attr_cache_invalidate(path);
+  kernel_cache_forget(path);
+  if (mode == LEASE_WRITE && (nf = netfs_file_find(path)) != NULL) {
+    if (netfs_upload_dirty(nf) < 0)
+      fprintf(stderr, "[NETFS] %s: upload on lease recall failed\n", path);
+    netfs_drop_write(nf, 1);
+    netfs_file_put(nf);
   }
+}
 
-  return size;
+/*
+ * In async mode hand the file to the uploader, otherwise upload now.
+ * The error of an earlier background upload is reported here.
+ *
+ * */
+static int netfs_sync_async(struct netfs_file *nf)
+{
+  int rc;
+
+  if (!NETFS_DATA->async_flush)
+    return netfs_sync_file(nf);
+
+  pthread_mutex_lock(&nf->lock);
+  rc = nf->error;
+  nf->error = 0;
+  pthread_mutex_unlock(&nf->lock);
+
+  if (flusher_enqueue(nf) != 0)
+    return netfs_sync_file(nf); // couldn't queue, do it ourselves
+  return rc;
 }
 
 /*
  * This method sends back the changes to remote server.
+ * Called on every close() of the file.
  *
  * */
 static int netfs_flush(const char* path, struct fuse_file_info *fi) {
-  char tpath[PATH_MAX], fpath[PATH_MAX], buf[16384];
-  int nbytes;
-  int fd = fi->fh;
+  struct netfs_file *nf = NETFS_FILE(fi);
 
-  netfs_temppath(tpath, path);
-  netfs_fullpath(fpath, path);
-  close(fd); // flush and save the data
+  (void) path;
 
-  sftp_file remotefile = sftp_open(sftp, fpath, O_RDWR | O_CREAT | O_TRUNC, 0);
-  fd = open(tpath, O_RDONLY); // READ from the temp file.
-  if (fd == -1) {
-    fprintf(stderr, "Unable to open temp file locally");
-    return -1;
+  if (nf == NULL)
+    return 0;
+  return netfs_sync_async(nf);
+}
+
+/*
+ * fsync is the durability point, wait for any background upload and
+ * send what is left.
+ *
+ * */
+static int netfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  struct netfs_file *nf = NETFS_FILE(fi);
+  int rc;
+  (void) path;
+  (void) datasync;
+
+  if (nf == NULL)
+    return 0;
+
+  rc = flusher_wait(nf);
+  if (rc == 0)
+    rc = netfs_sync_file(nf);
+  return rc;
+}
+
+/*
+ * Last close of the file. Anything still dirty goes out now (or is
+ * queued), the cache file is closed when the last reference goes.
+ *
+ * */
+static int netfs_release(const char *path, struct fuse_file_info *fi)
+{
+  struct netfs_file *nf = NETFS_FILE(fi);
+  int rc;
+  (void) path;
+
+  if (nf == NULL)
+    return 0;
+
+  rc = netfs_sync_async(nf);
+
+  netfs_file_put(nf);
+  fi->fh = 0;
+  return rc;
+}
+
+/*
+ * Mount time negotiation with the kernel.
+ *
+ * */
+static void *netfs_init(struct fuse_conn_info *conn)
+{
+  struct netfs_state *state = NETFS_DATA;
+
+  // up to max_write bytes per write request instead of one page. A
+  // 100 MB cp takes 800 write requests of 128 KB instead of 25600
+  if (state->big_writes && (conn->capable & FUSE_CAP_BIG_WRITES))
+    conn->want |= FUSE_CAP_BIG_WRITES;
+
+  // let write requests be spliced off the fuse device
+  if (conn->capable & FUSE_CAP_SPLICE_READ)
+    conn->want |= FUSE_CAP_SPLICE_READ;
+
+  // let read_buf replies be spliced from the cache file
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+
+  // threads are started here and not in main, fuse_main forks into
+  // the background before calling us and threads don't survive that
+  if (state->async_flush &&
+      flusher_start(state->flush_queue, netfs_sync_file) == -1) {
+    fprintf(stderr, "[NETFS] async_flush disabled\n");
+    state->async_flush = 0;
   }
+  if (state->prefetch && prefetch_start(state->prefetch_max * 4,
+        state->prefetch_kbs, netfs_prefetch_one) == -1)
+    fprintf(stderr, "[NETFS] prefetch disabled\n");
+  if (state->lease_server != NULL &&
+      lease_start(state->lease_server, netfs_recall) == -1)
+    fprintf(stderr, "[NETFS] no lease server, caches are not coherent\n");
+
+  return state;
+}
 
-  struct stat *st = malloc(sizeof(struct stat));
-  if (stat(tpath, st) == -1) {
-    fprintf(stderr, "Unable to fstat temp file locally");
-    return -1;
+/*
+ * Unmount. Wait for the uploader to drain its queue.
+ *
+ * */
+static void netfs_destroy(void *private_data)
+{
+  char *text;
+
+  (void) private_data;
+  prefetch_stop();
+  flusher_stop();
+  // after the last upload, which may still need its write lease
+  lease_stop();
+
+  if ((text = malloc(NETFS_STATS_MAX)) != NULL) {
+    stats_format(text, NETFS_STATS_MAX);
+    fprintf(stderr, "[NETFS] operation stats\n%s", text);
+    free(text);
   }
+}
 
-  if (remotefile == NULL) {
-    fprintf(stderr, "I couldn't open remote %s for writing.\n", fpath);
-    return -1;
+
+/*
+ * New size for an open file. The remote file follows on the next upload.
+ *
+ * */
+static int netfs_truncate_file(const char *path, struct netfs_file *nf, off_t size)
+{
+  char tpath[PATH_MAX];
+  int rc;
+
+  if ((rc = netfs_unpack(path, nf)) < 0)
+    return rc;
+  if (NETFS_DATA->resume) {
+    netfs_temppath(tpath, path);
+    cache_journal_remove(tpath);
   }
+  lease_cache_drop(path);
 
-  for(;;){
-    nbytes = read(fd, buf, sizeof(buf));
-    if (nbytes == 0){
-      break;
-    }
-    else if (nbytes < 0) {
-      fprintf(stderr, "I couldn't open %s for reading.\n", tpath);
-      return -1;
-    }
+  pthread_mutex_lock(&nf->lock);
+  if (ftruncate(nf->fd, size) == -1) {
+    pthread_mutex_unlock(&nf->lock);
+    return -errno;
+  }
+  dirty_truncate(&nf->dirty, size);
+  pthread_mutex_unlock(&nf->lock);
+  netfs_hold_write(path, nf);
 
-    if ((sftp_write(remotefile, buf, nbytes)) != nbytes) {
-      fprintf(stderr, "I couldn't write to remote file  %s; %s .\n", fpath, ssh_get_error(session));
-      return -1;
-    }
+  return netfs_sync_async(nf);
+}
+
+static int netfs_truncate(const char *path, off_t size)
+{
+  struct netfs_file *nf;
+  int rc, leased;
+
+  if ((nf = netfs_file_find(path)) != NULL) {
+    rc = netfs_truncate_file(path, nf, size);
+    netfs_file_put(nf);
+  } else {
+    leased = netfs_lease_write(path);
+    rc = backend->truncate(backend, path, size);
+    if (leased)
+      lease_put(path);
   }
+  attr_cache_invalidate(path);
+  return rc;
+}
 
-  fprintf(stderr, "[DEBUG] WRITTEN TO REMOTE FILE %s\n", fpath);
+static int netfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+  struct netfs_file *nf = NETFS_FILE(fi);
+  int rc;
 
-  close(fd);
-  sftp_close(remotefile);
-  return 0;
+  if (nf == NULL)
+    return -EBADF;
+
+  rc = netfs_truncate_file(path, nf, size);
+  attr_cache_invalidate(path);
+  return rc;
 }
 
+static int netfs_mkdir(const char *path, mode_t mode)
+{
+  int rc = backend->mkdir(backend, path, mode);
+
+  attr_cache_invalidate(path);
+  return rc;
+}
 
 /*
- * Doing nothing. Just a stub method.
+ * An open file stops going to the remote side. One that was never
+ * uploaded doesn't exist there, nothing to remove.
  *
  * */
-int netfs_utimens(const char* path, const struct timespec ts[2]) {
-  return 0;
+static int netfs_unlink(const char *path)
+{
+  char tpath[PATH_MAX];
+  struct netfs_file *nf;
+  int created = 0, rc = 0, leased;
+
+  if ((nf = netfs_file_find(path)) != NULL) {
+    pthread_mutex_lock(&nf->lock);
+    nf->unlinked = 1;
+    pthread_mutex_unlock(&nf->lock);
+    netfs_file_forget(nf);
+
+    flusher_wait(nf); // let an upload already under way land first
+    pthread_mutex_lock(&nf->lock);
+    created = nf->created;
+    pthread_mutex_unlock(&nf->lock);
+    netfs_file_put(nf);
+  }
+
+  leased = netfs_lease_write(path);
+  if (!created)
+    rc = backend->unlink(backend, path);
+  if (leased)
+    lease_put(path);
+
+  // open handles keep the cache file alive
+  netfs_temppath(tpath, path);
+  unlink(tpath);
+  if (NETFS_DATA->resume)
+    cache_journal_remove(tpath);
+  pack_remove(path);
+  dedup_remove(path);
+  kernel_cache_forget(path);
+
+  attr_cache_invalidate(path);
+  return rc;
+}
+
+static int netfs_rmdir(const char *path)
+{
+  char tpath[PATH_MAX];
+  int rc;
+
+  if ((rc = backend->rmdir(backend, path)) == 0) {
+    netfs_temppath(tpath, path);
+    rmdir(tpath);
+  }
+  attr_cache_invalidate(path);
+  attr_cache_invalidate_tree(path);
+  return rc;
+}
+
+/*
+ * Everything open under from is uploaded first, so the remote side
+ * moves the latest version, then the open files and cache files follow
+ * the new name.
+ *
+ * */
+static int netfs_rename(const char *from, const char *to)
+{
+  char tfrom[PATH_MAX], tto[PATH_MAX];
+  struct netfs_file **files, *target;
+  const char *first, *second;
+  int i, n, rc = 0, leased1, leased2;
+
+  n = netfs_file_find_tree(from, &files);
+  for (i = 0; i < n; ++i) {
+    if (rc == 0 && (rc = flusher_wait(files[i])) == 0)
+      rc = netfs_sync_file(files[i]);
+    netfs_file_put(files[i]);
+  }
+  free(files);
+  if (rc < 0)
+    return rc;
+
+  // an open file being replaced must not upload over the new one
+  if ((target = netfs_file_find(to)) != NULL)
+    flusher_wait(target);
+
+  // always in the same order, two mounts renaming across each other
+  // must not each hold the lease the other waits for
+  first = strcmp(from, to) < 0 ? from : to;
+  second = first == from ? to : from;
+  leased1 = netfs_lease_write(first);
+  leased2 = netfs_lease_write(second);
+  rc = backend->rename(backend, from, to);
+  if (leased2)
+    lease_put(second);
+  if (leased1)
+    lease_put(first);
+
+  if (rc == 0) {
+    if (target != NULL) {
+      pthread_mutex_lock(&target->lock);
+      target->unlinked = 1;
+      pthread_mutex_unlock(&target->lock);
+    }
+    netfs_file_rename(from, to);
+
+    netfs_temppath(tfrom, from);
+    netfs_temppath(tto, to);
+    netfs_cache_mkdirs(tto);
+    rename(tfrom, tto); // fine if it was never cached
+    if (NETFS_DATA->resume)
+      cache_journal_rename(tfrom, tto);
+    pack_remove(from);  // packed copies are cheap to fetch again
+    pack_remove(to);
+    dedup_rename(from, to);
+    kernel_cache_forget(from);
+    kernel_cache_forget(to);
+  }
+  if (target != NULL)
+    netfs_file_put(target);
+
+  attr_cache_invalidate(from);
+  attr_cache_invalidate(to);
+  attr_cache_invalidate_tree(from);
+  attr_cache_invalidate_tree(to);
+  return rc;
+}
+
+/*
+ * An open file keeps the new mode until its next upload, which is
+ * queued right away. Anything else is changed remotely now.
+ *
+ * */
+static int netfs_chmod(const char *path, mode_t mode)
+{
+  struct netfs_file *nf;
+  int rc, leased;
+
+  if ((nf = netfs_file_find(path)) != NULL) {
+    pthread_mutex_lock(&nf->lock);
+    nf->attr.st_mode = (nf->attr.st_mode & S_IFMT) | (mode & 07777);
+    nf->set_mode = 1;
+    pthread_mutex_unlock(&nf->lock);
+    netfs_hold_write(path, nf);
+    rc = netfs_sync_async(nf);
+    netfs_file_put(nf);
+  } else {
+    leased = netfs_lease_write(path);
+    rc = backend->chmod(backend, path, mode);
+    if (leased)
+      lease_put(path);
+  }
+  attr_cache_invalidate(path);
+  return rc;
+}
+
+/*
+ * Same as chmod. UTIME_NOW and UTIME_OMIT are resolved here, the
+ * backends get two real times.
+ *
+ * */
+static int netfs_utimens(const char *path, const struct timespec ts[2])
+{
+  struct timespec now, times[2];
+  struct netfs_file *nf;
+  struct stat st;
+  int i, rc, leased;
+
+  if ((rc = netfs_getattr(path, &st)) < 0)
+    return rc;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (i = 0; i < 2; ++i) {
+    if (ts[i].tv_nsec == UTIME_NOW)
+      times[i] = now;
+    else if (ts[i].tv_nsec == UTIME_OMIT)
+      times[i] = i == 0 ? st.st_atim : st.st_mtim;
+    else
+      times[i] = ts[i];
+  }
+
+  if ((nf = netfs_file_find(path)) != NULL) {
+    pthread_mutex_lock(&nf->lock);
+    nf->attr.st_atim = times[0];
+    nf->attr.st_mtim = times[1];
+    nf->set_times = 1;
+    pthread_mutex_unlock(&nf->lock);
+    netfs_hold_write(path, nf);
+    rc = netfs_sync_async(nf);
+    netfs_file_put(nf);
+  } else {
+    leased = netfs_lease_write(path);
+    rc = backend->utimens(backend, path, times);
+    if (leased)
+      lease_put(path);
+  }
+  attr_cache_invalidate(path);
+  return rc;
+}
+
+/*
+ * What fuse actually calls: the operations above, timed into the
+ * stats. Calls between the operations themselves are not counted
+ * twice.
+ *
+ * */
+static int timed_getattr(const char *path, struct stat *stbuf)
+{
+  return STATS_TIME(STATS_GETATTR, netfs_getattr(path, stbuf));
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_READDIR, netfs_readdir(path, buf, filler, offset, fi));
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_OPEN, netfs_open(path, fi));
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_READ, netfs_read(path, buf, size, offset, fi));
+}
+
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_READ_BUF, netfs_read_buf(path, bufp, size, offset, fi));
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_WRITE, netfs_write(path, buf, size, offset, fi));
+}
+
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf,
+    off_t offset, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_WRITE_BUF, netfs_write_buf(path, buf, offset, fi));
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_FLUSH, netfs_flush(path, fi));
+}
+
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_FSYNC, netfs_fsync(path, datasync, fi));
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_RELEASE, netfs_release(path, fi));
+}
+
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_CREATE, netfs_create(path, mode, fi));
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+  return STATS_TIME(STATS_MKDIR, netfs_mkdir(path, mode));
+}
+
+static int timed_unlink(const char *path)
+{
+  return STATS_TIME(STATS_UNLINK, netfs_unlink(path));
+}
+
+static int timed_rmdir(const char *path)
+{
+  return STATS_TIME(STATS_RMDIR, netfs_rmdir(path));
+}
+
+static int timed_rename(const char *from, const char *to)
+{
+  return STATS_TIME(STATS_RENAME, netfs_rename(from, to));
+}
+
+static int timed_truncate(const char *path, off_t size)
+{
+  return STATS_TIME(STATS_TRUNCATE, netfs_truncate(path, size));
+}
+
+static int timed_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+  return STATS_TIME(STATS_FTRUNCATE, netfs_ftruncate(path, size, fi));
+}
+
+static int timed_chmod(const char *path, mode_t mode)
+{
+  return STATS_TIME(STATS_CHMOD, netfs_chmod(path, mode));
+}
+
+static int timed_utimens(const char *path, const struct timespec ts[2])
+{
+  return STATS_TIME(STATS_UTIMENS, netfs_utimens(path, ts));
 }
 
 static struct fuse_operations netfs_oper = {
-  .getattr = netfs_getattr,
-  .readdir = netfs_readdir,
-  .open = netfs_open,
-  .read = netfs_read,
-  .write = netfs_write,
-  .flush = netfs_flush,
-  .utimens= netfs_utimens,
+  .getattr = timed_getattr,
+  .readdir = timed_readdir,
+  .open = timed_open,
+  .read = timed_read,
+  .read_buf = timed_read_buf,
+  .write = timed_write,
+  .write_buf = timed_write_buf,
+  .flush = timed_flush,
+  .fsync = timed_fsync,
+  .release = timed_release,
+  .create = timed_create,
+  .mkdir = timed_mkdir,
+  .unlink = timed_unlink,
+  .rmdir = timed_rmdir,
+  .rename = timed_rename,
+  .truncate = timed_truncate,
+  .ftruncate = timed_ftruncate,
+  .chmod = timed_chmod,
+  .utimens = timed_utimens,
+  .init = netfs_init,
+  .destroy = netfs_destroy,
 };
 
 
+/*
+ * Picks the mount point out of the non option arguments and keeps
+ * username and hostname for ourselves.
+ *
+ * */
+static int netfs_opt_proc(void *data, const char *arg, int key,
+    struct fuse_args *outargs)
+{
+  struct netfs_state *state = data;
+  (void) outargs;
+
+  if (key != FUSE_OPT_KEY_NONOPT)
+    return 1;
+
+  if (!state->mountpoint_seen) {
+    state->mountpoint_seen = 1;
+    return 1; // fuse needs this one
+  }
+  if (state->username == NULL) {
+    state->username = strdup(arg);
+    return 0;
+  }
+  if (state->hostname == NULL) {
+    state->hostname = strdup(arg);
+    return 0;
+  }
+  fprintf(stderr, "Unexpected argument %s\n", arg);
+  return -1;
+}
+
 /*
  * Main method to start the FUSE deamon.
- * Usage: ./netfs mountdir username hostname
+ * Usage: ./netfs mountdir [options] username hostname
+ *        ./netfs mountdir -o backend=local,rootdir=DIR [options]
  *
  * */
 int main(int argc, char *argv[])
 {
 
   // sanity check
-  if (argc < 3) {
-    printf("Usage %s <mountdir> <username> <hostname>\n", argv[0]);
+  if (argc < 2) {
+    printf("Usage %s <mountdir> [options] <username> <hostname>\n"
+        "      %s <mountdir> -o backend=local,rootdir=<dir> [options]\n"
+        "options: -o rootdir=DIR,cache_ttl=N,negative_ttl=N,connections=N,\n"
+        "            async_flush,flush_queue=N,nobig_writes,compression[=LEVEL],\n"
+        "            pack_small=KB,pack_size=MB,\n"
+        "            prefetch,prefetch_max=N,prefetch_kbs=N,\n"
+        "            dedup,dedup_block=KB,dedup_size=MB,\n"
+        "            nokeep_cache,kernel_ttl=N,\n"
+        "            streams=N,stream_piece=KB,lowlevel,\n"
+        "            resume,resume_block=KB,sparse,\n"
+        "            lease_server=HOST:PORT,cache_dir=DIR,\n"
+        "            latency_ms=N,bandwidth_kbs=N,stream_kbs=N (local backend only)\n",
+        argv[0], argv[0]);
     exit(EXIT_SUCCESS); /* bye */
   }
 
   int fuse_main_ret;
-
-  char *username = argv[argc-2]; // second last parameter is username
-  char *hostname = argv[argc-1]; // last parameter is hostname
-
-  session = create_ssh_connection(username, hostname);
-  sftp = create_sftp_connection(session);
-
+  char kernel_opts[128];
 
   struct netfs_state *netfs_state;
-  netfs_state = malloc(sizeof(struct netfs_state));
+  netfs_state = calloc(1, sizeof(struct netfs_state));
 
   if (netfs_state == NULL) {
     perror("malloc");
     abort();
   }
 
-  //  show_remote_processes(session);
-  //  fuse_opt_add_arg(NULL, "-obig_writes");
+  // defaults, all can be overridden with -o, see the usage line
+  netfs_state->cache_ttl = 5;
+  netfs_state->negative_ttl = 1;
+  netfs_state->connections = 4;
+  netfs_state->flush_queue = 64;
+  netfs_state->big_writes = 1;
+  netfs_state->keep_cache = 1;
+  netfs_state->kernel_ttl = 1; // what fuse uses when not told
+  netfs_state->pack_size_mb = 256;
+  netfs_state->prefetch_max = 128;
+  netfs_state->dedup_block_kb = 64;
+  netfs_state->dedup_size_mb = 512;
+  netfs_state->streams = 1;
+  netfs_state->stream_piece_kb = 4096;
+  netfs_state->resume_block_kb = 1024;
+  netfs_state->cache_dir = "/tmp";
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, netfs_state, netfs_opts, netfs_opt_proc) == -1) {
+    fprintf(stderr, "Unable to parse options\n");
+    exit(EXIT_FAILURE);
+  }
+  if (netfs_state->cache_dir[0] != '/') {
+    fprintf(stderr, "cache_dir has to be an absolute path\n");
+    exit(EXIT_FAILURE);
+  }
+  attr_cache_init(netfs_state->cache_ttl, netfs_state->negative_ttl);
+  // prefetched files are kept in the pack segment
+  if (netfs_state->prefetch && netfs_state->pack_small_kb == 0)
+    netfs_state->pack_small_kb = 64;
+  pack_init((off_t)netfs_state->pack_small_kb * 1024,
+      (off_t)netfs_state->pack_size_mb * 1024 * 1024);
+  if (netfs_state->dedup && dedup_init((size_t)netfs_state->dedup_block_kb * 1024,
+        (off_t)netfs_state->dedup_size_mb * 1024 * 1024) == -1)
+    exit(EXIT_FAILURE);
+
+  // writes arrive one page at a time without it. max_write can still
+  // be given with -o max_write=N (the kernel caps it at 128k).
+  if (netfs_state->big_writes)
+    fuse_opt_add_arg(&args, "-obig_writes");
+
+  // how long the kernel trusts a lookup or getattr before asking again.
+  // our own caches answer those cheaply, but not asking at all is
+  // cheaper still, mmap and stat heavy programs feel every request.
+  // files changed on the remote side show up after this long at most.
+  // the low-level frontend puts them in its replies itself
+  snprintf(kernel_opts, sizeof(kernel_opts),
+      "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+      netfs_state->kernel_ttl, netfs_state->kernel_ttl,
+      netfs_state->negative_ttl);
+  if (!netfs_state->lowlevel)
+    fuse_opt_add_arg(&args, kernel_opts);
+  if (netfs_state->keep_cache)
+    kernel_cache_init();
+
+  if (netfs_state->backend_name != NULL &&
+      strcmp(netfs_state->backend_name, "local") == 0) {
+    if (netfs_state->rootdir == NULL) {
+      fprintf(stderr, "The local backend needs -o rootdir=DIR\n");
+      exit(EXIT_FAILURE);
+    }
+    backend = backend_local_new(netfs_state->rootdir,
+        netfs_state->latency_ms, netfs_state->bandwidth_kbs,
+        netfs_state->stream_kbs, netfs_state->compression,
+        netfs_state->sparse);
+  } else {
+    if (netfs_state->username == NULL || netfs_state->hostname == NULL) {
+      fprintf(stderr, "Missing <username> <hostname>\n");
+      exit(EXIT_FAILURE);
+    }
+    backend = backend_sftp_new(netfs_state->username, netfs_state->hostname,
+        netfs_state->rootdir ? netfs_state->rootdir : "/home/ubuntu/shared",
+        netfs_state->connections, netfs_state->compression);
+  }
+  if (backend == NULL || (backend = backend_stats_new(backend)) == NULL)
+    exit(EXIT_FAILURE);
 
-  fuse_main_ret = fuse_main(argc-2, argv, &netfs_oper, netfs_state);
+  // no -s: fuse serves requests on multiple threads, the backends are
+  // safe to call concurrently.
+  netfs_data = netfs_state;
+  if (netfs_state->lowlevel)
+    fuse_main_ret = netfs_ll_main(&args, &netfs_oper);
+  else
+    fuse_main_ret = fuse_main(args.argc, args.argv, &netfs_oper, netfs_state);
 
   fprintf(stderr, "Exiting Successfuly");
-  disconnect_sftp(sftp);
-  disconnect_ssh(session);
+  fuse_opt_free_args(&args);
+  attr_cache_destroy();
+  kernel_cache_destroy();
+  pack_destroy();
+  dedup_destroy();
+  backend->destroy(backend);
 
   return fuse_main_ret;
 }
-
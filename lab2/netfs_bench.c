@@ -0,0 +1,382 @@
+/*
+ * Workload driver for netfs benchmarks.
+ *
+ * Runs one workload against a directory (normally a netfs mount) with
+ * a number of threads, timing every system call. Prints per operation
+ * count, errors, throughput and a log2 latency histogram.
+ *
+ * Workloads:
+ *   seqread   read each file start to end in blocks
+ *   seqwrite  overwrite each file start to end in blocks
+ *   randread  random 4 KB preads inside each file
+ *   meta      create, stat, readdir and unlink empty files
+ *   smallfile open, read whole, close; timed as one operation
+ *   reread    smallfile twice per file, the second pass is "reread" and
+ *             shows what the kernel page cache kept
+ *
+ * -M reads whole files (smallfile, reread) through mmap instead of read.
+ *
+ * Files are <dir>/bench.<i>, i < nfiles. Create them first with -P
+ * (preferably directly in the backing directory, see bench.sh).
+ *
+ * Usage: ./nbench -d <dir> -w <workload> [-n files] [-s size KB]
+ *                 [-b block KB] [-t threads] [-o ops per thread] [-P] [-M]
+ *
+ * */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BILLION 1000000000
+#define TIME_TYPE CLOCK_MONOTONIC
+#define NBUCKETS 32   // log2 microseconds, up to ~35 minutes
+
+enum op { OP_OPEN, OP_READ, OP_WRITE, OP_CLOSE, OP_STAT, OP_CREATE,
+  OP_READDIR, OP_UNLINK, OP_FILE, OP_REREAD, NOPS };
+
+static const char *op_names[NOPS] = { "open", "read", "write", "close",
+  "stat", "create", "readdir", "unlink", "file", "reread" };
+
+struct op_stats {
+  long count;
+  long errors;
+  long bytes;
+  double total;   // seconds
+  double max;
+  long hist[NBUCKETS];
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  struct op_stats stats[NOPS];
+};
+
+static char *dir = ".";
+static char *workload = NULL;
+static int nfiles = 4;
+static long file_size = 1024 * 1024;
+static size_t block_size = 128 * 1024;
+static int nthreads = 1;
+static int nops = 1000;
+static int use_mmap = 0;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(TIME_TYPE, &ts);
+  return ts.tv_sec + ts.tv_nsec / (double) BILLION;
+}
+
+static void record(struct worker *w, enum op op, double start, long ret, long bytes)
+{
+  struct op_stats *s = &w->stats[op];
+  double elapsed = now() - start;
+  long us = (long)(elapsed * 1e6);
+  int b = 0;
+
+  s->count++;
+  if (ret < 0) {
+    s->errors++;
+    return;
+  }
+  s->bytes += bytes;
+  s->total += elapsed;
+  if (elapsed > s->max)
+    s->max = elapsed;
+  while (us > 1 && b < NBUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  s->hist[b]++;
+}
+
+static void file_name(char path[PATH_MAX], int i)
+{
+  snprintf(path, PATH_MAX, "%s/bench.%d", dir, i);
+}
+
+static void seq_file(struct worker *w, int i, char *buf, int writing)
+{
+  char path[PATH_MAX];
+  double t;
+  long off, n;
+  int fd;
+
+  file_name(path, i);
+  t = now();
+  fd = open(path, writing ? O_WRONLY : O_RDONLY);
+  record(w, OP_OPEN, t, fd, 0);
+  if (fd == -1)
+    return;
+
+  for (off = 0; off < file_size; off += n) {
+    t = now();
+    if (writing) {
+      n = write(fd, buf, block_size);
+      record(w, OP_WRITE, t, n, n);
+    } else {
+      n = read(fd, buf, block_size);
+      record(w, OP_READ, t, n, n);
+    }
+    if (n <= 0)
+      break;
+  }
+
+  t = now();
+  record(w, OP_CLOSE, t, close(fd), 0);
+}
+
+static void rand_read(struct worker *w, char *buf)
+{
+  char path[PATH_MAX];
+  unsigned int seed = w->id;
+  double t;
+  long n, pages;
+  int i, fd;
+
+  file_name(path, w->id % nfiles);
+  t = now();
+  fd = open(path, O_RDONLY);
+  record(w, OP_OPEN, t, fd, 0);
+  if (fd == -1)
+    return;
+
+  pages = file_size / 4096 > 0 ? file_size / 4096 : 1;
+  for (i = 0; i < nops; i++) {
+    t = now();
+    n = pread(fd, buf, 4096, (rand_r(&seed) % pages) * 4096);
+    record(w, OP_READ, t, n, n);
+  }
+  t = now();
+  record(w, OP_CLOSE, t, close(fd), 0);
+}
+
+static void meta(struct worker *w)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  struct dirent *entry;
+  DIR *d;
+  double t;
+  long n;
+  int i, fd;
+
+  for (i = 0; i < nops; i++) {
+    snprintf(path, PATH_MAX, "%s/meta.%d.%d", dir, w->id, i);
+    t = now();
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd != -1)
+      close(fd);
+    record(w, OP_CREATE, t, fd, 0);
+
+    t = now();
+    record(w, OP_STAT, t, stat(path, &st), 0);
+  }
+
+  t = now();
+  n = -1;
+  if ((d = opendir(dir)) != NULL) {
+    for (n = 0; (entry = readdir(d)) != NULL; n++);
+    closedir(d);
+  }
+  record(w, OP_READDIR, t, n, 0);
+
+  for (i = 0; i < nops; i++) {
+    snprintf(path, PATH_MAX, "%s/meta.%d.%d", dir, w->id, i);
+    t = now();
+    record(w, OP_UNLINK, t, unlink(path), 0);
+  }
+}
+
+// touch every page of the file through a mapping, returns the bytes seen
+static long map_file(int fd)
+{
+  struct stat st;
+  volatile char sum = 0;
+  char *map;
+  long off;
+
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if (st.st_size == 0)
+    return 0;
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  for (off = 0; off < st.st_size; off += 4096)
+    sum += map[off];
+  munmap(map, st.st_size);
+  return st.st_size;
+}
+
+static void small_file(struct worker *w, int i, char *buf, enum op op)
+{
+  char path[PATH_MAX];
+  double t = now();
+  long n, total = 0;
+  int fd;
+
+  file_name(path, i);
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    record(w, op, t, -1, 0);
+    return;
+  }
+  if (use_mmap) {
+    n = total = map_file(fd);
+  } else {
+    while ((n = read(fd, buf, block_size)) > 0)
+      total += n;
+  }
+  close(fd);
+  record(w, op, t, n, total);
+}
+
+static void *run(void *arg)
+{
+  struct worker *w = arg;
+  char *buf = malloc(block_size);
+  int i;
+
+  memset(buf, 'a' + w->id % 26, block_size);
+
+  if (!strcmp(workload, "randread")) {
+    rand_read(w, buf);
+  } else if (!strcmp(workload, "meta")) {
+    meta(w);
+  } else {
+    for (i = w->id; i < nfiles; i += nthreads) {
+      if (!strcmp(workload, "seqread"))
+        seq_file(w, i, buf, 0);
+      else if (!strcmp(workload, "seqwrite"))
+        seq_file(w, i, buf, 1);
+      else
+        small_file(w, i, buf, OP_FILE); // smallfile, first pass of reread
+    }
+    // second pass once every file has been read, not right after
+    for (i = w->id; !strcmp(workload, "reread") && i < nfiles; i += nthreads)
+      small_file(w, i, buf, OP_REREAD);
+  }
+  free(buf);
+  return NULL;
+}
+
+static int prepare()
+{
+  char path[PATH_MAX];
+  char *buf = malloc(block_size);
+  long off;
+  int i, fd;
+
+  memset(buf, 'x', block_size);
+  for (i = 0; i < nfiles; i++) {
+    file_name(path, i);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+      perror(path);
+      return 1;
+    }
+    for (off = 0; off < file_size; off += block_size)
+      write(fd, buf, file_size - off < (long)block_size ? file_size - off : block_size);
+    close(fd);
+  }
+  free(buf);
+  return 0;
+}
+
+static void report(struct worker *workers, double elapsed)
+{
+  struct op_stats total;
+  int op, i, b;
+
+  printf("workload %s: %d threads, %d files of %ld KB, %0.3f seconds\n",
+      workload, nthreads, nfiles, file_size / 1024, elapsed);
+  printf("%-8s %8s %6s %10s %10s %10s %10s\n", "op", "count", "errors",
+      "mean ms", "max ms", "ops/s", "MB/s");
+
+  for (op = 0; op < NOPS; op++) {
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+      struct op_stats *s = &workers[i].stats[op];
+      total.count += s->count;
+      total.errors += s->errors;
+      total.bytes += s->bytes;
+      total.total += s->total;
+      if (s->max > total.max)
+        total.max = s->max;
+      for (b = 0; b < NBUCKETS; b++)
+        total.hist[b] += s->hist[b];
+    }
+    if (total.count == 0)
+      continue;
+
+    printf("%-8s %8ld %6ld %10.3f %10.3f %10.1f %10.2f\n", op_names[op],
+        total.count, total.errors,
+        total.count > total.errors ? total.total * 1000 / (total.count - total.errors) : 0,
+        total.max * 1000, total.count / elapsed,
+        total.bytes / elapsed / (1024 * 1024));
+
+    // latency histogram, bucket b holds [2^b, 2^(b+1)) microseconds
+    for (b = 0; b < NBUCKETS; b++)
+      if (total.hist[b])
+        printf("    < %8ld us: %ld\n", 2L << b, total.hist[b]);
+  }
+}
+
+int
+main(int argc, char *argv[]) {
+  struct worker *workers;
+  double start;
+  int i, c, prep = 0;
+
+  while ((c = getopt(argc, argv, "d:w:n:s:b:t:o:PM")) != -1) {
+    switch (c) {
+      case 'd': dir = optarg; break;
+      case 'w': workload = optarg; break;
+      case 'n': nfiles = atoi(optarg); break;
+      case 's': file_size = atol(optarg) * 1024; break;
+      case 'b': block_size = atol(optarg) * 1024; break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'o': nops = atoi(optarg); break;
+      case 'P': prep = 1; break;
+      case 'M': use_mmap = 1; break;
+      default:
+        printf("Usage: %s -d <dir> -w <seqread|seqwrite|randread|meta|smallfile|reread>"
+            " [-n files] [-s size KB] [-b block KB] [-t threads] [-o ops] [-P] [-M]\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (block_size == 0 || nthreads < 1 || nfiles < 1) {
+    printf("Block size, threads and files must be positive\n");
+    exit(1);
+  }
+
+  if (prep)
+    return prepare();
+
+  if (workload == NULL) {
+    printf("Missing -w <workload>\n");
+    exit(1);
+  }
+
+  workers = calloc(nthreads, sizeof(struct worker));
+  start = now();
+  for (i = 0; i < nthreads; i++) {
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  report(workers, now() - start);
+  free(workers);
+  return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * Lifetime of the per open file state. The fuse handle owns one
+ * reference, every upload queued in the background flusher owns
+ * another, so release can return while the file is still going out.
+ *
+ * Files opened through the mount are also kept in a table by path, so
+ * two opens of a file share one cache file, and namespace operations
+ * (getattr, truncate, unlink, rename...) can see what has not reached
+ * the remote side yet. An entry stays until its last reference is gone,
+ * queued uploads included.
+ *
+ * Lock order: the table lock before any nf->lock.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "path_hash.h"
+#include "netfs_file.h"
+#include "dedup_store.h"
+#include "lease_client.h"
+
+#define NETFS_FILE_BUCKETS 1024
+
+static struct netfs_file *table[NETFS_FILE_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// is path at or under dir
+static int path_under(const char *path, const char *dir)
+{
+  size_t len = strlen(dir);
+
+  if (strncmp(path, dir, len) != 0)
+    return 0;
+  return path[len] == '\0' || path[len] == '/' || strcmp(dir, "/") == 0;
+}
+
+static void table_insert(struct netfs_file *nf)
+{
+  unsigned int h = path_hash(nf->path, NETFS_FILE_BUCKETS);
+
+  nf->hnext = table[h];
+  table[h] = nf;
+}
+
+static void table_remove(struct netfs_file *nf)
+{
+  struct netfs_file **pn;
+
+  if (nf->path == NULL)
+    return;
+  for (pn = &table[path_hash(nf->path, NETFS_FILE_BUCKETS)]; *pn != NULL; pn = &(*pn)->hnext) {
+    if (*pn == nf) {
+      *pn = nf->hnext;
+      break;
+    }
+  }
+  free(nf->path);
+  nf->path = NULL;
+}
+
+static struct netfs_file *table_lookup(const char *path)
+{
+  struct netfs_file *nf;
+
+  for (nf = table[path_hash(path, NETFS_FILE_BUCKETS)]; nf != NULL; nf = nf->hnext)
+    if (strcmp(nf->path, path) == 0)
+      return nf;
+  return NULL;
+}
+
+struct netfs_file *netfs_file_new(int fd, off_t remote_size)
+{
+  struct netfs_file *nf = calloc(1, sizeof(struct netfs_file));
+
+  if (nf == NULL)
+    return NULL;
+  nf->fd = fd;
+  nf->length = -1;
+  nf->remote_size = remote_size;
+  nf->refs = 1;
+  nf->ready = 1;
+  pthread_mutex_init(&nf->lock, NULL);
+  pthread_cond_init(&nf->idle, NULL);
+  return nf;
+}
+
+struct netfs_file *netfs_file_lookup(const char *path, int *fresh)
+{
+  struct netfs_file *nf;
+
+  pthread_mutex_lock(&table_lock);
+  if ((nf = table_lookup(path)) != NULL) {
+    netfs_file_get(nf);
+    pthread_mutex_unlock(&table_lock);
+    *fresh = 0;
+    return nf;
+  }
+
+  if ((nf = netfs_file_new(-1, 0)) == NULL ||
+      (nf->path = strdup(path)) == NULL) {
+    pthread_mutex_unlock(&table_lock);
+    free(nf);
+    return NULL;
+  }
+  nf->ready = 0;
+  table_insert(nf);
+  pthread_mutex_unlock(&table_lock);
+  *fresh = 1;
+  return nf;
+}
+
+void netfs_file_ready(struct netfs_file *nf, int fd, off_t remote_size,
+    const struct stat *attr)
+{
+  if (fd < 0) {
+    // let the next open try again
+    pthread_mutex_lock(&table_lock);
+    table_remove(nf);
+    pthread_mutex_unlock(&table_lock);
+  }
+
+  pthread_mutex_lock(&nf->lock);
+  nf->fd = fd;
+  nf->remote_size = remote_size;
+  if (attr != NULL)
+    memcpy(&nf->attr, attr, sizeof(struct stat));
+  nf->ready = 1;
+  pthread_cond_broadcast(&nf->idle);
+  pthread_mutex_unlock(&nf->lock);
+}
+
+int netfs_file_wait(struct netfs_file *nf)
+{
+  int rc;
+
+  pthread_mutex_lock(&nf->lock);
+  while (!nf->ready)
+    pthread_cond_wait(&nf->idle, &nf->lock);
+  rc = nf->fd < 0 ? nf->fd : 0;
+  pthread_mutex_unlock(&nf->lock);
+  return rc;
+}
+
+struct netfs_file *netfs_file_find(const char *path)
+{
+  struct netfs_file *nf, *found = NULL;
+
+  pthread_mutex_lock(&table_lock);
+  if ((nf = table_lookup(path)) != NULL) {
+    pthread_mutex_lock(&nf->lock);
+    // one still being fetched has nothing to add yet
+    if (nf->ready && nf->fd >= 0) {
+      nf->refs++;
+      found = nf;
+    }
+    pthread_mutex_unlock(&nf->lock);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return found;
+}
+
+int netfs_file_find_tree(const char *path, struct netfs_file ***files)
+{
+  struct netfs_file *nf, **found = NULL, **grown;
+  int i, count = 0, capacity = 0;
+
+  pthread_mutex_lock(&table_lock);
+  for (i = 0; i < NETFS_FILE_BUCKETS; ++i) {
+    for (nf = table[i]; nf != NULL; nf = nf->hnext) {
+      if (!path_under(nf->path, path))
+        continue;
+      if (count == capacity) {
+        capacity = capacity ? 2 * capacity : 16;
+        if ((grown = realloc(found, capacity * sizeof(*found))) == NULL)
+          goto out;
+        found = grown;
+      }
+      netfs_file_get(nf);
+      found[count++] = nf;
+    }
+  }
+out:
+  pthread_mutex_unlock(&table_lock);
+  *files = found;
+  return count;
+}
+
+void netfs_file_path(struct netfs_file *nf, char path[PATH_MAX])
+{
+  pthread_mutex_lock(&table_lock);
+  strncpy(path, nf->path ? nf->path : "", PATH_MAX - 1);
+  path[PATH_MAX - 1] = '\0';
+  pthread_mutex_unlock(&table_lock);
+}
+
+void netfs_file_forget(struct netfs_file *nf)
+{
+  pthread_mutex_lock(&table_lock);
+  table_remove(nf);
+  pthread_mutex_unlock(&table_lock);
+}
+
+void netfs_file_rename(const char *from, const char *to)
+{
+  struct netfs_file *nf, *moved = NULL, **pn;
+  char npath[PATH_MAX];
+  size_t len = strlen(from);
+  char *copy;
+  int i;
+
+  pthread_mutex_lock(&table_lock);
+  // whatever was open under the target name is gone, the caller has
+  // marked it unlinked
+  if ((nf = table_lookup(to)) != NULL)
+    table_remove(nf);
+
+  for (i = 0; i < NETFS_FILE_BUCKETS; ++i) {
+    pn = &table[i];
+    while ((nf = *pn) != NULL) {
+      if (path_under(nf->path, from)) {
+        *pn = nf->hnext;
+        nf->hnext = moved;
+        moved = nf;
+      } else {
+        pn = &nf->hnext;
+      }
+    }
+  }
+
+  while ((nf = moved) != NULL) {
+    moved = nf->hnext;
+    snprintf(npath, PATH_MAX, "%s%s", to, nf->path + len);
+    if ((copy = strdup(npath)) != NULL) {
+      free(nf->path);
+      nf->path = copy;
+    }
+    table_insert(nf);
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+
+void netfs_file_get(struct netfs_file *nf)
+{
+  pthread_mutex_lock(&nf->lock);
+  nf->refs++;
+  pthread_mutex_unlock(&nf->lock);
+}
+
+void netfs_file_put(struct netfs_file *nf)
+{
+  int refs;
+
+  // under the table lock, so a lookup can't pick up a file on its way out
+  pthread_mutex_lock(&table_lock);
+  pthread_mutex_lock(&nf->lock);
+  refs = --nf->refs;
+  pthread_mutex_unlock(&nf->lock);
+  if (refs == 0)
+    table_remove(nf);
+  pthread_mutex_unlock(&table_lock);
+
+  if (refs > 0)
+    return;
+
+  if (nf->fd >= 0)
+    close(nf->fd);
+  if (nf->map != NULL)
+    dedup_map_put(nf->map);
+  if (nf->lease_path != NULL) {
+    lease_put(nf->lease_path); // never uploaded, it runs out
+    free(nf->lease_path);
+  }
+  dirty_clear(&nf->dirty);
+  pthread_cond_destroy(&nf->idle);
+  pthread_mutex_destroy(&nf->lock);
+  free(nf);
+}
@@ -0,0 +1,78 @@
+#ifndef _NETFS_FILE_H_
+#define _NETFS_FILE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include "dirty_ranges.h"
+
+struct dedup_map;
+
+// per open file, stored in fuse_file_info->fh
+struct netfs_file {
+  int fd;                   // the cache file in /tmp, -errno if opening failed
+  off_t base;               // packed: where the file starts in fd
+  off_t length;             // packed: its size. -1 for a cache file of its own
+  struct dedup_map *map;    // deduped (fd is the block store): where its blocks are
+  off_t remote_size;        // size of the remote file when last synced
+  struct dirty_list dirty;  // what has to go back to the remote file
+  int refs;                 // fuse handles + queued background uploads
+  int queued;               // waiting in the uploader queue
+  int pending;              // background uploads not finished yet
+  int error;                // result of the last background upload
+  struct stat attr;         // remote attributes, plus our chmod and utimens
+  int created;              // made by create, not on the remote side yet
+  int unlinked;             // removed, nothing more goes to the remote side
+  int set_mode;             // attr.st_mode waits for the next upload
+  int set_times;            // attr times wait for the next upload
+  int ready;                // fd is set, see netfs_file_lookup
+  char *lease_path;         // write lease held until the changes are uploaded
+  pthread_mutex_t lock;
+  pthread_cond_t idle;      // signalled when pending drops to 0 or on ready
+
+  char *path;               // key in the open file table, follows renames
+  struct netfs_file *hnext; // table chain, under the table lock
+};
+
+#define NETFS_FILE(fi) ((struct netfs_file *) (uintptr_t) (fi)->fh)
+
+// wrap an open cache file, the caller holds the first reference.
+// not in the open file table, for files that only live here
+struct netfs_file *netfs_file_new(int fd, off_t remote_size);
+
+// the open file of path, with a reference. If there is none a new one
+// is added, *fresh set, and the caller has to fetch the file and call
+// netfs_file_ready. NULL if out of memory
+struct netfs_file *netfs_file_lookup(const char *path, int *fresh);
+
+// a fresh file is fetched. fd < 0 is the error, the file leaves the table
+void netfs_file_ready(struct netfs_file *nf, int fd, off_t remote_size,
+    const struct stat *attr);
+
+// wait until a looked up file is ready, 0 or the error of fetching it
+int netfs_file_wait(struct netfs_file *nf);
+
+// the open (and ready) file of path with a reference, NULL if none
+struct netfs_file *netfs_file_find(const char *path);
+
+// all open files at or under path, with a reference each. returns the
+// count and a malloced array in *files
+int netfs_file_find_tree(const char *path, struct netfs_file ***files);
+
+// copy the current path of nf, "" once it left the table
+void netfs_file_path(struct netfs_file *nf, char path[PATH_MAX]);
+
+// take nf out of the table, the next open of its path starts afresh
+void netfs_file_forget(struct netfs_file *nf);
+
+// from and everything under it is now called to
+void netfs_file_rename(const char *from, const char *to);
+
+void netfs_file_get(struct netfs_file *nf);
+
+// drop a reference, the last one closes the cache file
+void netfs_file_put(struct netfs_file *nf);
+
+#endif
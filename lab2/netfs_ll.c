@@ -0,0 +1,620 @@
+/*
+ * Low-level fuse frontend, mount with -o lowlevel.
+ *
+ * The high-level library turns every request into a path by walking
+ * its node tree up to the root under one global lock, deeper trees
+ * cost more on every call. Here the kernel gets the numbers of the
+ * inode table in lookup replies, and a request is one hash lookup away
+ * from its path. The path handlers of netfs.c still do the real work,
+ * through the same fuse_operations table the high-level library gets,
+ * so the stats and caches are the same whichever frontend is used.
+ *
+ * Knowing the inodes also lets us tell the kernel to drop its pages of
+ * a file that changed on the remote side, as soon as a lookup or
+ * getattr sees it, instead of waiting for the next open.
+ *
+ * */
+#define FUSE_USE_VERSION 30
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "state.h"
+#include "netfs_ll.h"
+#include "netfs_file.h"
+#include "inode_table.h"
+
+#define LL_NOTIFY_QUEUE 256
+
+static const struct fuse_operations *ll_ops;
+static struct fuse_chan *ll_chan;
+
+// the request this thread is serving, for netfs_ll_caller
+static __thread fuse_req_t current_req;
+
+// inodes whose pages the kernel should drop. the notification is sent
+// from a thread of its own, never from inside a request handler
+static fuse_ino_t notify_queue[LL_NOTIFY_QUEUE];
+static int notify_head = 0;
+static int notify_count = 0;
+static int notify_stopping = 0;
+static int notify_running = 0;
+static pthread_t notify_thread;
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+
+int netfs_ll_caller(uid_t *uid, gid_t *gid)
+{
+  const struct fuse_ctx *ctx;
+
+  if (current_req == NULL)
+    return -1;
+  ctx = fuse_req_ctx(current_req);
+  *uid = ctx->uid;
+  *gid = ctx->gid;
+  return 0;
+}
+
+static void *notify_loop(void *arg)
+{
+  fuse_ino_t ino;
+  int rc;
+  (void) arg;
+
+  pthread_mutex_lock(&notify_lock);
+  for (;;) {
+    while (notify_count == 0 && !notify_stopping)
+      pthread_cond_wait(&notify_cond, &notify_lock);
+    if (notify_count == 0)
+      break;
+    ino = notify_queue[notify_head];
+    notify_head = (notify_head + 1) % LL_NOTIFY_QUEUE;
+    notify_count--;
+    pthread_mutex_unlock(&notify_lock);
+
+    // off 0, len 0: attributes and every cached page
+    rc = fuse_lowlevel_notify_inval_inode(ll_chan, ino, 0, 0);
+    if (rc < 0 && rc != -ENOENT) // ENOENT: the kernel forgot it already
+      fprintf(stderr, "[NETFS] notify_inval_inode %lu: %s\n",
+          (unsigned long) ino, strerror(-rc));
+
+    pthread_mutex_lock(&notify_lock);
+  }
+  pthread_mutex_unlock(&notify_lock);
+  return NULL;
+}
+
+/*
+ * Size or mtime of ino moved since the kernel last heard of it. If the
+ * file is open here the change is our own writing, otherwise someone
+ * changed it on the remote side and the kernel's pages are stale.
+ *
+ * */
+static void ll_changed(fuse_ino_t ino, const char *path)
+{
+  struct netfs_file *nf;
+
+  if ((nf = netfs_file_find(path)) != NULL) {
+    netfs_file_put(nf);
+    return;
+  }
+
+  pthread_mutex_lock(&notify_lock);
+  if (notify_running && notify_count < LL_NOTIFY_QUEUE) { // else the next open notices
+    notify_queue[(notify_head + notify_count) % LL_NOTIFY_QUEUE] = ino;
+    notify_count++;
+    pthread_cond_signal(&notify_cond);
+  }
+  pthread_mutex_unlock(&notify_lock);
+}
+
+// the path of ino for serving req. replies with the error and returns
+// -1 if there is none
+static int ll_path(fuse_req_t req, fuse_ino_t ino, char path[PATH_MAX])
+{
+  int rc;
+
+  current_req = req;
+  if ((rc = inode_path(ino, path)) < 0) {
+    fuse_reply_err(req, -rc);
+    return -1;
+  }
+  return 0;
+}
+
+static int ll_child_path(fuse_req_t req, fuse_ino_t parent, const char *name,
+    char path[PATH_MAX])
+{
+  int rc;
+
+  current_req = req;
+  if ((rc = inode_child_path(parent, name, path)) < 0) {
+    fuse_reply_err(req, -rc);
+    return -1;
+  }
+  return 0;
+}
+
+// the path of an open ino. the handlers of open files work on the
+// handle, an unlinked file still has to be read, written and released
+static void ll_open_path(fuse_req_t req, fuse_ino_t ino, char path[PATH_MAX])
+{
+  current_req = req;
+  if (inode_path(ino, path) < 0)
+    path[0] = '\0';
+}
+
+// attributes of path and its inode, with one more kernel reference
+static int ll_entry(const char *path, struct fuse_entry_param *e)
+{
+  int rc, changed;
+
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  if ((rc = ll_ops->getattr(path, &e->attr)) < 0)
+    return rc;
+  if ((e->ino = inode_lookup(path, &e->attr, &changed)) == 0)
+    return -ENOMEM;
+  if (changed)
+    ll_changed(e->ino, path);
+  e->attr.st_ino = e->ino;
+  e->attr_timeout = NETFS_DATA->kernel_ttl;
+  e->entry_timeout = NETFS_DATA->kernel_ttl;
+  return 0;
+}
+
+static void ll_reply_entry(fuse_req_t req, int rc, struct fuse_entry_param *e)
+{
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else if (fuse_reply_entry(req, e) != 0)
+    inode_forget(e->ino, 1); // interrupted, the kernel never got it
+}
+
+// what read_buf handed us, fd buffers point into cache files
+static void ll_free_bufvec(struct fuse_bufvec *bufv)
+{
+  size_t i;
+
+  for (i = 0; i < bufv->count; ++i)
+    if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+      free(bufv->buf[i].mem);
+  free(bufv);
+}
+
+static void netfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  (void) userdata;
+
+  ll_ops->init(conn);
+
+  // after fuse_daemonize, like the threads netfs_init starts
+  pthread_mutex_lock(&notify_lock);
+  notify_stopping = 0;
+  notify_running = pthread_create(&notify_thread, NULL, notify_loop, NULL) == 0;
+  pthread_mutex_unlock(&notify_lock);
+  if (!notify_running)
+    fprintf(stderr, "[NETFS] no invalidation of remote changes\n");
+}
+
+static void netfs_ll_destroy(void *userdata)
+{
+  pthread_mutex_lock(&notify_lock);
+  notify_stopping = 1;
+  pthread_cond_signal(&notify_cond);
+  pthread_mutex_unlock(&notify_lock);
+  if (notify_running)
+    pthread_join(notify_thread, NULL);
+  notify_running = 0;
+
+  ll_ops->destroy(userdata);
+}
+
+static void netfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param e;
+  char path[PATH_MAX];
+  int rc;
+
+  if (ll_child_path(req, parent, name, path) == -1)
+    return;
+
+  rc = ll_entry(path, &e);
+  if (rc == -ENOENT && NETFS_DATA->negative_ttl > 0) {
+    // ino 0: the kernel remembers the name doesn't exist
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    e.entry_timeout = NETFS_DATA->negative_ttl;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  ll_reply_entry(req, rc, &e);
+}
+
+static void netfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  inode_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void netfs_ll_forget_multi(fuse_req_t req, size_t count,
+    struct fuse_forget_data *forgets)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+    inode_forget(forgets[i].ino, forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+
+static void netfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  int rc;
+  (void) fi;
+
+  if (ll_path(req, ino, path) == -1)
+    return;
+  if ((rc = ll_ops->getattr(path, &st)) < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  st.st_ino = ino;
+  if (inode_set_attr(ino, &st))
+    ll_changed(ino, path);
+  fuse_reply_attr(req, &st, NETFS_DATA->kernel_ttl);
+}
+
+/*
+ * One request for chmod, truncate and utimens, in that order, the way
+ * the high-level library splits it. No chown, like before.
+ *
+ * */
+static void netfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+    int to_set, struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+  struct timespec ts[2];
+  struct stat st;
+  int rc = 0;
+
+  if (fi != NULL)
+    ll_open_path(req, ino, path);
+  else if (ll_path(req, ino, path) == -1)
+    return;
+
+  if (to_set & FUSE_SET_ATTR_MODE)
+    rc = ll_ops->chmod(path, attr->st_mode);
+  if (rc == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+    rc = -ENOSYS;
+  if (rc == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    rc = fi != NULL ? ll_ops->ftruncate(path, attr->st_size, fi) :
+      ll_ops->truncate(path, attr->st_size);
+  if (rc == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    ts[0] = attr->st_atim;
+    ts[1] = attr->st_mtim;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+      ts[0].tv_nsec = UTIME_NOW;
+    else if (!(to_set & FUSE_SET_ATTR_ATIME))
+      ts[0].tv_nsec = UTIME_OMIT;
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+      ts[1].tv_nsec = UTIME_NOW;
+    else if (!(to_set & FUSE_SET_ATTR_MTIME))
+      ts[1].tv_nsec = UTIME_OMIT;
+    rc = ll_ops->utimens(path, ts);
+  }
+  if (rc == 0)
+    rc = ll_ops->getattr(path, &st);
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  st.st_ino = ino;
+  inode_set_attr(ino, &st); // our own change, the kernel knows
+  fuse_reply_attr(req, &st, NETFS_DATA->kernel_ttl);
+}
+
+/*
+ * A listing is read in full on opendir and handed out in pieces, the
+ * offsets the kernel comes back with are offsets into it.
+ *
+ * */
+struct ll_dir {
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t capacity;
+};
+
+static int ll_dir_fill(void *ctx, const char *name, const struct stat *stbuf,
+    off_t off)
+{
+  struct ll_dir *d = ctx;
+  struct stat st;
+  size_t len;
+  char *grown;
+  (void) off;
+
+  memset(&st, 0, sizeof(struct stat));
+  if (stbuf != NULL)
+    st.st_mode = stbuf->st_mode;
+  st.st_ino = 0xffffffff; // unknown until looked up, as the high-level library says
+
+  len = fuse_add_direntry(d->req, NULL, 0, name, NULL, 0);
+  if (d->size + len > d->capacity) {
+    size_t capacity = d->capacity ? d->capacity * 2 : 4096;
+    while (capacity < d->size + len)
+      capacity *= 2;
+    if ((grown = realloc(d->buf, capacity)) == NULL)
+      return 1;
+    d->buf = grown;
+    d->capacity = capacity;
+  }
+  fuse_add_direntry(d->req, d->buf + d->size, d->capacity - d->size, name,
+      &st, d->size + len);
+  d->size += len;
+  return 0;
+}
+
+static void netfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+  struct ll_dir *d;
+  int rc;
+
+  if (ll_path(req, ino, path) == -1)
+    return;
+  if ((d = calloc(1, sizeof(struct ll_dir))) == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  d->req = req;
+  if ((rc = ll_ops->readdir(path, d, ll_dir_fill, 0, fi)) < 0) {
+    free(d->buf);
+    free(d);
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  fi->fh = (uintptr_t) d;
+  if (fuse_reply_open(req, fi) != 0) {
+    free(d->buf);
+    free(d);
+  }
+}
+
+static void netfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t off, struct fuse_file_info *fi)
+{
+  struct ll_dir *d = (struct ll_dir *) (uintptr_t) fi->fh;
+  (void) ino;
+
+  if ((size_t) off >= d->size)
+    fuse_reply_buf(req, NULL, 0);
+  else
+    fuse_reply_buf(req, d->buf + off, off + size > d->size ? d->size - off : size);
+}
+
+static void netfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  struct ll_dir *d = (struct ll_dir *) (uintptr_t) fi->fh;
+  (void) ino;
+
+  free(d->buf);
+  free(d);
+  fuse_reply_err(req, 0);
+}
+
+static void netfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+  int rc;
+
+  if (ll_path(req, ino, path) == -1)
+    return;
+  if ((rc = ll_ops->open(path, fi)) < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  if (fuse_reply_open(req, fi) != 0)
+    ll_ops->release(path, fi); // interrupted, there won't be a release
+}
+
+static void netfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode, struct fuse_file_info *fi)
+{
+  struct fuse_entry_param e;
+  char path[PATH_MAX];
+  int rc;
+
+  if (ll_child_path(req, parent, name, path) == -1)
+    return;
+  if ((rc = ll_ops->create(path, mode, fi)) < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  if ((rc = ll_entry(path, &e)) < 0) {
+    ll_ops->release(path, fi);
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    ll_ops->release(path, fi);
+    inode_forget(e.ino, 1);
+  }
+}
+
+static void netfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+    struct fuse_file_info *fi)
+{
+  struct fuse_bufvec *bufv = NULL;
+  char path[PATH_MAX];
+  int rc;
+
+  ll_open_path(req, ino, path);
+  if ((rc = ll_ops->read_buf(path, &bufv, size, off, fi)) < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  ll_free_bufvec(bufv);
+}
+
+static void netfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+  int rc;
+
+  ll_open_path(req, ino, path);
+  if ((rc = ll_ops->write_buf(path, bufv, off, fi)) < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_write(req, rc);
+}
+
+static void netfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+
+  ll_open_path(req, ino, path);
+  fuse_reply_err(req, -ll_ops->flush(path, fi));
+}
+
+static void netfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+
+  ll_open_path(req, ino, path);
+  fuse_reply_err(req, -ll_ops->fsync(path, datasync, fi));
+}
+
+static void netfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+
+  ll_open_path(req, ino, path);
+  fuse_reply_err(req, -ll_ops->release(path, fi));
+}
+
+static void netfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode)
+{
+  struct fuse_entry_param e;
+  char path[PATH_MAX];
+  int rc;
+
+  if (ll_child_path(req, parent, name, path) == -1)
+    return;
+  if ((rc = ll_ops->mkdir(path, mode)) == 0)
+    rc = ll_entry(path, &e);
+  ll_reply_entry(req, rc, &e);
+}
+
+static void netfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  char path[PATH_MAX];
+  int rc;
+
+  if (ll_child_path(req, parent, name, path) == -1)
+    return;
+  if ((rc = ll_ops->unlink(path)) == 0)
+    inode_unlinked(path);
+  fuse_reply_err(req, -rc);
+}
+
+static void netfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  char path[PATH_MAX];
+  int rc;
+
+  if (ll_child_path(req, parent, name, path) == -1)
+    return;
+  if ((rc = ll_ops->rmdir(path)) == 0)
+    inode_unlinked(path);
+  fuse_reply_err(req, -rc);
+}
+
+static void netfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+    fuse_ino_t newparent, const char *newname)
+{
+  char from[PATH_MAX], to[PATH_MAX];
+  int rc;
+
+  if (ll_child_path(req, parent, name, from) == -1 ||
+      ll_child_path(req, newparent, newname, to) == -1)
+    return;
+  if ((rc = ll_ops->rename(from, to)) == 0)
+    inode_renamed(from, to);
+  fuse_reply_err(req, -rc);
+}
+
+static struct fuse_lowlevel_ops netfs_ll_oper = {
+  .init = netfs_ll_init,
+  .destroy = netfs_ll_destroy,
+  .lookup = netfs_ll_lookup,
+  .forget = netfs_ll_forget,
+  .forget_multi = netfs_ll_forget_multi,
+  .getattr = netfs_ll_getattr,
+  .setattr = netfs_ll_setattr,
+  .opendir = netfs_ll_opendir,
+  .readdir = netfs_ll_readdir,
+  .releasedir = netfs_ll_releasedir,
+  .open = netfs_ll_open,
+  .create = netfs_ll_create,
+  .read = netfs_ll_read,
+  .write_buf = netfs_ll_write_buf,
+  .flush = netfs_ll_flush,
+  .fsync = netfs_ll_fsync,
+  .release = netfs_ll_release,
+  .mkdir = netfs_ll_mkdir,
+  .unlink = netfs_ll_unlink,
+  .rmdir = netfs_ll_rmdir,
+  .rename = netfs_ll_rename,
+};
+
+/*
+ * What fuse_main does for the high-level API: mount, go to the
+ * background unless -f, serve on multiple threads unless -s.
+ *
+ * */
+int netfs_ll_main(struct fuse_args *args, const struct fuse_operations *ops)
+{
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+  int err = -1;
+
+  ll_ops = ops;
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1 ||
+      inode_table_init() == -1)
+    return 1;
+
+  if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+    se = fuse_lowlevel_new(args, &netfs_ll_oper, sizeof(netfs_ll_oper), NULL);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        ll_chan = ch;
+        if (fuse_daemonize(foreground) != -1)
+          err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se); // calls destroy
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+  inode_table_destroy();
+  return err ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _NETFS_LL_H_
+#define _NETFS_LL_H_
+
+#include <sys/types.h>
+
+struct fuse_args;
+struct fuse_operations;
+
+// mount and serve the low-level fuse API until unmounted, every request
+// ends up in the path handlers of ops. returns the exit code for main
+int netfs_ll_main(struct fuse_args *args, const struct fuse_operations *ops);
+
+// owner of the process behind the low-level request this thread is
+// serving, -1 when it isn't serving one
+int netfs_ll_caller(uid_t *uid, gid_t *gid);
+
+#endif
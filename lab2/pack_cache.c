@@ -0,0 +1,295 @@
+/*
+ * Packed cache segment for small files.
+ *
+ * A cache file per remote file costs an inode, a create and an open in
+ * /tmp for every one of them, which dominates on trees of tiny files.
+ * Files up to the threshold are appended instead to one unlinked
+ * segment file, with an index of path -> (offset, length) in memory.
+ * Opens get their own dup of the segment fd and read at offset.
+ *
+ * A copy stays valid while the remote file has the same size and
+ * mtime, so opening it again skips the transfer. Replaced and removed
+ * copies leave dead space behind; when there is more dead than live
+ * space the live copies are moved to a fresh segment. Files still open
+ * on the old one keep it alive through their dup'd fds.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "path_hash.h"
+#include "pack_cache.h"
+#include "stats.h"
+
+#define PACK_BUCKETS 4096
+#define PACK_COMPACT_MIN (1024 * 1024)  // don't bother for less dead space
+#define PACK_COPY_CHUNK 65536
+
+struct pack_entry {
+  char *path;
+  off_t offset;
+  off_t len;
+  time_t mtime;   // of the remote file when copied
+  int prefetched; // fetched ahead and not opened yet
+  struct pack_entry *next;
+};
+
+static struct pack_entry *buckets[PACK_BUCKETS];
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static int seg_fd = -1;
+static off_t seg_end = 0;   // where the next copy goes
+static off_t live = 0;      // bytes of copies in the index
+static off_t dead = 0;      // bytes of replaced or removed copies
+static off_t pack_max = 0;
+static off_t pack_budget = 0;
+static unsigned long compactions;
+
+static int segment_new()
+{
+  char tpath[] = "/tmp/netfs-pack.XXXXXX";
+  int fd;
+
+  if ((fd = mkstemp(tpath)) == -1)
+    return -errno;
+  unlink(tpath); // only reachable through the fds
+  return fd;
+}
+
+static int copy_range(int from, off_t src, int to, off_t dst, off_t len)
+{
+  char buf[PACK_COPY_CHUNK];
+  ssize_t n;
+
+  while (len > 0) {
+    n = pread(from, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf), src);
+    if (n <= 0)
+      return n == 0 ? -EIO : -errno; // the copy is shorter than we were told
+    if (pwrite(to, buf, n, dst) != n)
+      return -EIO;
+    src += n;
+    dst += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static struct pack_entry **lookup(const char *path)
+{
+  struct pack_entry **pe;
+
+  for (pe = &buckets[path_hash(path, PACK_BUCKETS)]; *pe != NULL; pe = &(*pe)->next)
+    if (strcmp((*pe)->path, path) == 0)
+      return pe;
+  return pe;
+}
+
+static void remove_entry(struct pack_entry **pe)
+{
+  struct pack_entry *e = *pe;
+
+  *pe = e->next;
+  if (e->prefetched)
+    stats_count(STATS_PREFETCH_WASTED, 1);
+  live -= e->len;
+  dead += e->len;
+  free(e->path);
+  free(e);
+}
+
+/*
+ * Move every live copy to a new segment. Called with pack_lock held.
+ *
+ * */
+static int compact()
+{
+  struct pack_entry *e;
+  off_t end = 0;
+  int fd, i, rc;
+
+  if ((fd = segment_new()) < 0)
+    return fd;
+
+  for (i = 0; i < PACK_BUCKETS; ++i) {
+    for (e = buckets[i]; e != NULL; e = e->next) {
+      if ((rc = copy_range(seg_fd, e->offset, fd, end, e->len)) < 0) {
+        close(fd); // the old segment is still intact, keep using it
+        return rc;
+      }
+      end += e->len;
+    }
+  }
+
+  // second pass only once nothing can fail
+  end = 0;
+  for (i = 0; i < PACK_BUCKETS; ++i) {
+    for (e = buckets[i]; e != NULL; e = e->next) {
+      e->offset = end;
+      end += e->len;
+    }
+  }
+  close(seg_fd);
+  seg_fd = fd;
+  seg_end = end;
+  dead = 0;
+  compactions++;
+  return 0;
+}
+
+int pack_init(off_t threshold, off_t budget)
+{
+  pack_max = threshold;
+  pack_budget = budget;
+  if (pack_max <= 0)
+    return 0;
+
+  if ((seg_fd = segment_new()) < 0) {
+    fprintf(stderr, "Unable to create the pack segment: %s\n", strerror(-seg_fd));
+    pack_max = 0;
+    return -1;
+  }
+  return 0;
+}
+
+off_t pack_threshold()
+{
+  return pack_max;
+}
+
+int pack_open(const char *path, const struct stat *st, off_t *base)
+{
+  struct pack_entry *e;
+  int fd = -ENOENT;
+
+  if (pack_max <= 0)
+    return -ENOENT;
+
+  pthread_mutex_lock(&pack_lock);
+  e = *lookup(path);
+  if (e != NULL && e->len == st->st_size && e->mtime == st->st_mtime) {
+    if ((fd = dup(seg_fd)) == -1)
+      fd = -errno;
+    *base = e->offset;
+    if (e->prefetched) {
+      e->prefetched = 0;
+      stats_count(STATS_PREFETCH_USED, 1);
+    }
+    stats_count(STATS_PACK_HITS, 1);
+  } else {
+    stats_count(STATS_PACK_MISSES, 1);
+  }
+  pthread_mutex_unlock(&pack_lock);
+  return fd;
+}
+
+int pack_has(const char *path, const struct stat *st)
+{
+  struct pack_entry *e;
+  int has;
+
+  if (pack_max <= 0)
+    return 0;
+
+  pthread_mutex_lock(&pack_lock);
+  e = *lookup(path);
+  has = e != NULL && e->len == st->st_size && e->mtime == st->st_mtime;
+  pthread_mutex_unlock(&pack_lock);
+  return has;
+}
+
+int pack_add(const char *path, const struct stat *st, int src_fd, off_t len,
+    int prefetched, off_t *base)
+{
+  struct pack_entry **pe, *e;
+  int fd, rc;
+
+  if (len > pack_max)
+    return -EFBIG;
+
+  pthread_mutex_lock(&pack_lock);
+  pe = lookup(path);
+  if (*pe != NULL)
+    remove_entry(pe); // an older copy
+
+  if (live + len > pack_budget) {
+    pthread_mutex_unlock(&pack_lock);
+    return -ENOSPC;
+  }
+  // full of dead space, or mostly dead: squeeze it out first
+  if ((seg_end + len > pack_budget || dead > live) && dead > PACK_COMPACT_MIN &&
+      (rc = compact()) < 0) {
+    pthread_mutex_unlock(&pack_lock);
+    return rc;
+  }
+
+  if ((e = calloc(1, sizeof(struct pack_entry))) == NULL ||
+      (e->path = strdup(path)) == NULL) {
+    pthread_mutex_unlock(&pack_lock);
+    free(e);
+    return -ENOMEM;
+  }
+  // small files, copying under the lock is cheaper than coordinating
+  if ((rc = copy_range(src_fd, 0, seg_fd, seg_end, len)) < 0 ||
+      (fd = dup(seg_fd)) == -1) {
+    rc = rc < 0 ? rc : -errno;
+    dead += len; // whatever made it in is garbage
+    seg_end += len;
+    pthread_mutex_unlock(&pack_lock);
+    free(e->path);
+    free(e);
+    return rc;
+  }
+  e->offset = seg_end;
+  e->len = len;
+  e->mtime = st->st_mtime;
+  e->prefetched = prefetched;
+  pe = lookup(path);
+  e->next = *pe;
+  *pe = e;
+  seg_end += len;
+  live += len;
+  *base = e->offset;
+  pthread_mutex_unlock(&pack_lock);
+  return fd;
+}
+
+void pack_remove(const char *path)
+{
+  struct pack_entry **pe;
+
+  if (pack_max <= 0)
+    return;
+
+  pthread_mutex_lock(&pack_lock);
+  if (*(pe = lookup(path)) != NULL)
+    remove_entry(pe);
+  pthread_mutex_unlock(&pack_lock);
+}
+
+void pack_destroy()
+{
+  struct pack_entry *e, *next;
+  int i;
+
+  if (pack_max <= 0)
+    return;
+
+  fprintf(stderr, "[NETFS] pack: %ld bytes live, %ld dead, %lu compactions\n",
+      (long)live, (long)dead, compactions);
+
+  pthread_mutex_lock(&pack_lock);
+  for (i = 0; i < PACK_BUCKETS; ++i) {
+    for (e = buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      free(e->path);
+      free(e);
+    }
+    buckets[i] = NULL;
+  }
+  close(seg_fd);
+  seg_fd = -1;
+  pthread_mutex_unlock(&pack_lock);
+}
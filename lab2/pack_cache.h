@@ -0,0 +1,33 @@
+#ifndef _PACK_CACHE_H_
+#define _PACK_CACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// files up to threshold bytes are packed, the segment holds up to
+// budget bytes of them. threshold 0 disables packing
+int pack_init(off_t threshold, off_t budget);
+
+// largest file that gets packed, 0 if packing is off
+off_t pack_threshold();
+
+// the packed copy of path if it is still what the remote side has
+// (same size and mtime as st). returns a new fd for the segment and
+// the offset of the file in *base, or -ENOENT
+int pack_open(const char *path, const struct stat *st, off_t *base);
+
+// is there a current copy of path, without opening it
+int pack_has(const char *path, const struct stat *st);
+
+// append len bytes of src_fd (from offset 0) as the copy of path,
+// prefetched if nobody asked for it yet. returns a new fd for the
+// segment and the offset in *base, or -errno if it doesn't fit
+int pack_add(const char *path, const struct stat *st, int src_fd, off_t len,
+    int prefetched, off_t *base);
+
+// forget the copy of path, it changed or went away
+void pack_remove(const char *path);
+
+void pack_destroy();
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Download one file over several streams at once.
+ *
+ * A single sftp session tops out well below the link: the ssh channel
+ * window caps what is in flight, and all of the session's encryption
+ * runs on one core. read_range checks out its own pooled session for
+ * every call, so splitting a big file into pieces and fetching them
+ * from a few threads puts several sessions, and cores, to work on it.
+ * Each piece lands in the cache file at its own offset.
+ *
+ * Pieces are handed out from a shared cursor rather than one fixed
+ * range per thread, so a slow session doesn't leave the others idle
+ * at the end.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "parallel_fetch.h"
+
+struct fetch_job {
+  struct netfs_backend *be;
+  const char *path;
+  int fd;
+  off_t size;
+  off_t piece;
+  off_t next;         // start of the next piece nobody took yet
+  ssize_t error;      // first failure, 0 if none
+  off_t copied;
+  pthread_mutex_t lock;
+};
+
+static void *fetch_stream(void *arg)
+{
+  struct fetch_job *job = arg;
+  off_t start, len;
+  ssize_t n;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    if (job->error < 0 || job->next >= job->size) {
+      pthread_mutex_unlock(&job->lock);
+      return NULL;
+    }
+    start = job->next;
+    len = job->size - start < job->piece ? job->size - start : job->piece;
+    job->next += len;
+    pthread_mutex_unlock(&job->lock);
+
+    n = job->be->read_range(job->be, job->path, job->fd, start, len);
+
+    pthread_mutex_lock(&job->lock);
+    if (n < 0 && job->error == 0)
+      job->error = n;
+    else if (n >= 0)
+      job->copied += n;
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+ssize_t parallel_fetch(struct netfs_backend *be, const char *path, int fd,
+    off_t size, int streams, off_t min_piece)
+{
+  struct fetch_job job;
+  pthread_t *threads;
+  int i, started = 0;
+
+  job.be = be;
+  job.path = path;
+  job.fd = fd;
+  job.size = size;
+  // a few pieces per stream so they even out
+  job.piece = size / (streams * 4);
+  if (job.piece < min_piece)
+    job.piece = min_piece;
+  if (job.piece < 1)
+    job.piece = 1;
+  job.next = 0;
+  job.error = 0;
+  job.copied = 0;
+  pthread_mutex_init(&job.lock, NULL);
+
+  // the calling thread is one of the streams
+  if ((threads = malloc(streams * sizeof(pthread_t))) != NULL) {
+    for (i = 1; i < streams && (off_t)i * job.piece < size; ++i) {
+      if (pthread_create(&threads[started], NULL, fetch_stream, &job) != 0)
+        break; // fewer streams, same result
+      started++;
+    }
+  }
+  fetch_stream(&job);
+  for (i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_mutex_destroy(&job.lock);
+
+  if (job.error < 0)
+    return job.error;
+  // a short piece means the file shrank since it was stat'ed
+  return job.copied < size ? -EAGAIN : job.copied;
+}
@@ -0,0 +1,13 @@
+#ifndef _PARALLEL_FETCH_H_
+#define _PARALLEL_FETCH_H_
+
+#include <sys/types.h>
+#include "backend.h"
+
+// copy the first size bytes of path into fd at the same offsets, with
+// up to streams read_range calls running at once, each at least
+// min_piece bytes. returns the bytes copied or -errno
+ssize_t parallel_fetch(struct netfs_backend *be, const char *path, int fd,
+    off_t size, int streams, off_t min_piece);
+
+#endif
@@ -0,0 +1,11 @@
+#include "path_hash.h"
+
+unsigned int path_hash(const char *path, unsigned int buckets)
+{
+  unsigned int h = 2166136261u;
+  while (*path) {
+    h ^= (unsigned char)*path++;
+    h *= 16777619u;
+  }
+  return h % buckets;
+}
@@ -0,0 +1,8 @@
+#ifndef _PATH_HASH_H_
+#define _PATH_HASH_H_
+
+// bucket of path in a table of the given number of buckets. FNV-1a,
+// every path keyed table of netfs uses it
+unsigned int path_hash(const char *path, unsigned int buckets);
+
+#endif
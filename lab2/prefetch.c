@@ -0,0 +1,155 @@
+/*
+ * Background prefetch of small files.
+ *
+ * Builds and scripts list a directory and then open every file in it.
+ * readdir already tells us the sizes, so the small files can be on
+ * their way before the first open. One thread works through a bounded
+ * queue that readdir fills without ever waiting: when the queue is
+ * full the file is simply not prefetched. The thread uses one pool
+ * connection at a time, and is paced to kbs so foreground reads keep
+ * most of the link.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "prefetch.h"
+#include "stats.h"
+
+struct prefetch_item {
+  char *path;
+  struct stat st;
+};
+
+static struct prefetch_item *queue;
+static int queue_depth = 0;
+static int queue_head = 0;
+static int queue_count = 0;
+static int stopping = 0;
+static double rate = 0;   // bytes per second, 0 = unlimited
+static prefetch_fetch_t fetch_fn;
+static pthread_t prefetch_thread;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+  struct timespec ts;
+  double d = t - now();
+
+  if (d <= 0)
+    return;
+  ts.tv_sec = (time_t)d;
+  ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+  nanosleep(&ts, NULL);
+}
+
+static void *prefetch_loop(void *arg)
+{
+  struct prefetch_item item;
+  ssize_t n;
+  double next = 0;  // earliest start of the next fetch
+  (void) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count == 0 && !stopping)
+      pthread_cond_wait(&not_empty, &queue_lock);
+    if (stopping) {
+      pthread_mutex_unlock(&queue_lock);
+      return NULL;
+    }
+    item = queue[queue_head];
+    queue_head = (queue_head + 1) % queue_depth;
+    queue_count--;
+    pthread_mutex_unlock(&queue_lock);
+
+    if (rate > 0)
+      sleep_until(next);
+
+    if ((n = fetch_fn(item.path, &item.st)) > 0) {
+      stats_count(STATS_PREFETCH_FILES, 1);
+      stats_count(STATS_PREFETCH_BYTES, n);
+      if (rate > 0)
+        next = (next > now() ? next : now()) + n / rate;
+    }
+    free(item.path);
+  }
+}
+
+int prefetch_start(int depth, double kbs, prefetch_fetch_t fetch)
+{
+  if (depth < 1)
+    depth = 1;
+  queue = calloc(depth, sizeof(struct prefetch_item));
+  if (queue == NULL)
+    return -1;
+  queue_depth = depth;
+  rate = kbs * 1024;
+  fetch_fn = fetch;
+
+  if (pthread_create(&prefetch_thread, NULL, prefetch_loop, NULL) != 0) {
+    perror("pthread_create");
+    free(queue);
+    queue = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int prefetch_enabled()
+{
+  return queue != NULL;
+}
+
+void prefetch_enqueue(const char *path, const struct stat *st)
+{
+  char *copy;
+
+  if (queue == NULL)
+    return;
+
+  pthread_mutex_lock(&queue_lock);
+  if (queue_count == queue_depth || stopping ||
+      (copy = strdup(path)) == NULL) {
+    pthread_mutex_unlock(&queue_lock);
+    stats_count(STATS_PREFETCH_DROPPED, 1);
+    return;
+  }
+  queue[(queue_head + queue_count) % queue_depth].path = copy;
+  memcpy(&queue[(queue_head + queue_count) % queue_depth].st, st, sizeof(struct stat));
+  queue_count++;
+  pthread_cond_signal(&not_empty);
+  pthread_mutex_unlock(&queue_lock);
+  stats_count(STATS_PREFETCH_QUEUED, 1);
+}
+
+void prefetch_stop()
+{
+  if (queue == NULL)
+    return;
+
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&not_empty);
+  pthread_mutex_unlock(&queue_lock);
+
+  pthread_join(prefetch_thread, NULL);
+  while (queue_count > 0) {
+    free(queue[queue_head].path);
+    queue_head = (queue_head + 1) % queue_depth;
+    queue_count--;
+  }
+  free(queue);
+  queue = NULL;
+}
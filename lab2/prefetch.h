@@ -0,0 +1,24 @@
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// fetches path (attributes st) into the cache. returns the bytes moved,
+// 0 if the cache had it already, or -errno
+typedef ssize_t (*prefetch_fetch_t)(const char *path, const struct stat *st);
+
+// start the prefetch thread with room for depth queued files, moving at
+// most kbs KB/s (0 = as fast as the link goes)
+int prefetch_start(int depth, double kbs, prefetch_fetch_t fetch);
+
+// is the prefetcher running
+int prefetch_enabled();
+
+// queue path for fetching. never blocks, a full queue drops it
+void prefetch_enqueue(const char *path, const struct stat *st);
+
+// drop whatever is still queued and stop the thread
+void prefetch_stop();
+
+#endif
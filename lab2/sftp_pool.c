@@ -0,0 +1,88 @@
+/*
+ * Pool of ssh/sftp connections.
+ *
+ * A libssh session must not be used by two threads at the same time,
+ * and one sftp channel answers one request at a time anyway. fuse runs
+ * the callbacks on several threads, so each callback checks out its own
+ * connection for the duration of the call. Reads of different files
+ * then go over different channels in parallel.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sftp_pool.h"
+#include "ssh_connect.h"
+#include "sftp_connect.h"
+
+static struct sftp_conn *free_list = NULL;
+static struct sftp_conn *all_conns = NULL;
+static int pool_size = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+int sftp_pool_init(char *username, char *hostname, int size, int compression)
+{
+  int i;
+
+  if (size < 1)
+    size = 1;
+
+  ssh_init(); // global crypto state, before any thread touches libssh
+
+  all_conns = calloc(size, sizeof(struct sftp_conn));
+  if (all_conns == NULL) {
+    perror("calloc");
+    return -1;
+  }
+
+  // failures in here exit, same as for the single connection before.
+  for (i = 0; i < size; ++i) {
+    all_conns[i].session = create_ssh_connection(username, hostname, compression);
+    all_conns[i].sftp = create_sftp_connection(all_conns[i].session);
+    all_conns[i].next = free_list;
+    free_list = &all_conns[i];
+  }
+  pool_size = size;
+
+  return 0;
+}
+
+struct sftp_conn *sftp_pool_get()
+{
+  struct sftp_conn *conn;
+
+  pthread_mutex_lock(&pool_lock);
+  while (free_list == NULL)
+    pthread_cond_wait(&pool_cond, &pool_lock);
+  conn = free_list;
+  free_list = conn->next;
+  pthread_mutex_unlock(&pool_lock);
+
+  conn->next = NULL;
+  return conn;
+}
+
+void sftp_pool_put(struct sftp_conn *conn)
+{
+  pthread_mutex_lock(&pool_lock);
+  conn->next = free_list;
+  free_list = conn;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void sftp_pool_destroy()
+{
+  int i;
+
+  for (i = 0; i < pool_size; ++i) {
+    disconnect_sftp(all_conns[i].sftp);
+    disconnect_ssh(all_conns[i].session);
+  }
+  free(all_conns);
+  all_conns = NULL;
+  free_list = NULL;
+  pool_size = 0;
+}
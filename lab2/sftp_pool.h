@@ -0,0 +1,27 @@
+#ifndef _SFTP_POOL_H_
+#define _SFTP_POOL_H_
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+// one ssh session with its sftp channel. only one thread uses it at a time.
+struct sftp_conn {
+  ssh_session session;
+  sftp_session sftp;
+  struct sftp_conn *next;
+};
+
+// open size connections to hostname as username, compressed at the
+// given zlib level (0 = off)
+int sftp_pool_init(char *username, char *hostname, int size, int compression);
+
+// check out a connection, waits if all of them are in use
+struct sftp_conn *sftp_pool_get();
+
+// give the connection back to the pool
+void sftp_pool_put(struct sftp_conn *conn);
+
+// close all the connections
+void sftp_pool_destroy();
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Holes and zero blocks of cache and remote files.
+ *
+ * VM images and preallocated databases are mostly zeros, and used to
+ * cross the link byte for byte and take their full size in /tmp. The
+ * helpers here find the data of a file with SEEK_DATA/SEEK_HOLE, tell
+ * zero blocks apart from the rest, and put holes back with fallocate
+ * instead of writing zeros. See -o sparse in netfs.c and the local
+ * backend.
+ *
+ * */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sparse.h"
+
+#define SPARSE_CHUNK (1024 * 1024)
+
+static const char zero_block[SPARSE_BLOCK];
+
+off_t sparse_next_data(int fd, off_t *start, off_t end)
+{
+  off_t data, hole;
+
+  if (*start >= end)
+    return end;
+  if ((data = lseek(fd, *start, SEEK_DATA)) == -1) {
+    if (errno == ENXIO) // nothing but hole up to the end of the file
+      *start = end;
+    return end;
+  }
+  if (data >= end) {
+    *start = end;
+    return end;
+  }
+  if ((hole = lseek(fd, data, SEEK_HOLE)) == -1 || hole > end)
+    hole = end;
+  *start = data;
+  return hole;
+}
+
+int sparse_is_zero(const char *buf, size_t len)
+{
+  size_t n;
+
+  for (; len > 0; buf += n, len -= n) {
+    n = len < SPARSE_BLOCK ? len : SPARSE_BLOCK;
+    if (memcmp(buf, zero_block, n) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Runs of blocks of the data of fd that are all zeros (zeros set) or
+ * not. Holes end a run either way.
+ *
+ * */
+static int sparse_walk(int fd, off_t offset, off_t len, size_t block, int zeros,
+    sparse_run_t fn, void *ctx)
+{
+  size_t chunk = block > SPARSE_CHUNK ? block : SPARSE_CHUNK - SPARSE_CHUNK % block;
+  off_t end = offset + len, pos = offset, data, data_end, run = -1, p, b, bend;
+  ssize_t n;
+  char *buf;
+  int rc = 0;
+
+  if ((buf = malloc(chunk)) == NULL)
+    return -ENOMEM;
+
+  while (rc == 0 && pos < end) {
+    data = pos;
+    data_end = sparse_next_data(fd, &data, end);
+    if (run >= 0 && data > pos) {
+      rc = fn(ctx, run, pos - run);
+      run = -1;
+    }
+    for (p = data; rc == 0 && p < data_end; p += n) {
+      // chunks end on block boundaries
+      off_t chunk_end = (p / block) * block + chunk;
+      if (chunk_end > data_end)
+        chunk_end = data_end;
+      if ((n = pread(fd, buf, chunk_end - p, p)) <= 0) {
+        data_end = p; // got shorter under us
+        if (n < 0)
+          rc = -errno;
+        break;
+      }
+      for (b = p; rc == 0 && b < p + n; b = bend) {
+        bend = (b / block + 1) * block;
+        if (bend > p + n)
+          bend = p + n;
+        if (sparse_is_zero(buf + (b - p), bend - b) == zeros) {
+          if (run < 0)
+            run = b;
+        } else if (run >= 0) {
+          rc = fn(ctx, run, b - run);
+          run = -1;
+        }
+      }
+    }
+    pos = data_end;
+    if (data_end == data && data < end)
+      break; // short file, nothing more
+  }
+  if (rc == 0 && run >= 0)
+    rc = fn(ctx, run, pos - run);
+  free(buf);
+  return rc;
+}
+
+int sparse_walk_data(int fd, off_t offset, off_t len, size_t block,
+    sparse_run_t fn, void *ctx)
+{
+  return sparse_walk(fd, offset, len, block, 0, fn, ctx);
+}
+
+struct punch_ctx {
+  int fd;
+  off_t punched;
+};
+
+static int punch_run(void *ctx, off_t offset, off_t len)
+{
+  struct punch_ctx *pc = ctx;
+
+  if (fallocate(pc->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == -1)
+    return -errno;
+  pc->punched += len;
+  return 0;
+}
+
+off_t sparse_punch_zeros(int fd, off_t offset, off_t len)
+{
+  struct punch_ctx pc = { fd, 0 };
+  int rc;
+
+  if ((rc = sparse_walk(fd, offset, len, SPARSE_BLOCK, 1, punch_run, &pc)) < 0)
+    return rc;
+  return pc.punched;
+}
+
+int sparse_zero_range(int fd, off_t offset, off_t len)
+{
+  struct stat st;
+  off_t done;
+  ssize_t n;
+
+  if (len <= 0)
+    return 0;
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == -1) {
+    if (errno != EOPNOTSUPP)
+      return -errno;
+    // no holes here, zeros the slow way
+    for (done = 0; done < len; done += n) {
+      n = len - done < SPARSE_BLOCK ? len - done : SPARSE_BLOCK;
+      if (pwrite(fd, zero_block, n, offset + done) != n)
+        return -EIO;
+    }
+    return 0;
+  }
+  // KEEP_SIZE: a range past the end needs its last byte to exist. not
+  // ftruncate, a concurrent write further out must survive
+  if (fstat(fd, &st) == -1)
+    return -errno;
+  if (st.st_size < offset + len && pwrite(fd, zero_block, 1, offset + len - 1) != 1)
+    return -EIO;
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include <sys/types.h>
+
+// holes are punched in units of this, the usual filesystem block
+#define SPARSE_BLOCK 4096
+
+// called for each run a walk finds, returns 0 to go on or -errno
+typedef int (*sparse_run_t)(void *ctx, off_t offset, off_t len);
+
+// find the next data of fd in [*start, end): *start is moved to where it
+// begins, the return value is where it ends. *start == end when there is
+// none. Filesystems without SEEK_DATA have nothing but data
+off_t sparse_next_data(int fd, off_t *start, off_t end);
+
+// is buf all zeros
+int sparse_is_zero(const char *buf, size_t len);
+
+// call fn for every run of [offset, offset + len) of fd that is data and
+// not made of all zero blocks of block bytes (aligned to the file).
+// returns 0, the first error of fn or -errno
+int sparse_walk_data(int fd, off_t offset, off_t len, size_t block,
+    sparse_run_t fn, void *ctx);
+
+// turn the all zero SPARSE_BLOCKs of [offset, offset + len) of fd into
+// holes. returns the bytes punched or -errno
+off_t sparse_punch_zeros(int fd, off_t offset, off_t len);
+
+// make [offset, offset + len) of fd read as zeros without writing them,
+// growing fd if it is shorter. returns 0 or -errno
+int sparse_zero_range(int fd, off_t offset, off_t len);
+
+#endif
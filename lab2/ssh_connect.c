@@ -12,7 +12,7 @@
 #include <stdlib.h>
 
 int verify_knownhost(ssh_session session);
-ssh_session create_ssh_connection(char *username, char *hostname) {
+ssh_session create_ssh_connection(char *username, char *hostname, int compression) {
   int rc;
   int verbosity = SSH_LOG_PROTOCOL;
   // Open session and set options
@@ -21,6 +21,12 @@ ssh_session create_ssh_connection(char *username, char *hostname) {
     exit(-1);
   ssh_options_set(the_ssh_session, SSH_OPTIONS_HOST, hostname);
   ssh_options_set(the_ssh_session, SSH_OPTIONS_LOG_VERBOSITY, &verbosity);
+  // negotiated at connect time, both directions. worth it on slow links,
+  // costs cpu for nothing on fast ones.
+  if (compression > 0) {
+    ssh_options_set(the_ssh_session, SSH_OPTIONS_COMPRESSION, "yes");
+    ssh_options_set(the_ssh_session, SSH_OPTIONS_COMPRESSION_LEVEL, &compression);
+  }
   // Connect to server
   rc = ssh_connect(the_ssh_session);
   if (rc != SSH_OK)
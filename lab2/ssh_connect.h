@@ -3,8 +3,9 @@
 
 #include <libssh/libssh.h>
 
-// used to create ssh connection.
-ssh_session create_ssh_connection(char *, char *);
+// used to create ssh connection. compression is the zlib level of the
+// transport, 1 (fastest) to 9, 0 to send everything as is.
+ssh_session create_ssh_connection(char *, char *, int compression);
 
 // end the ssh connection
 int disconnect_ssh(ssh_session);
@@ -8,9 +8,43 @@
 
 struct netfs_state {
   FILE *logfile;
-  char *rootdir;
+  char *rootdir;        // remote directory to mount (local one for backend=local)
+  char *backend_name;   // sftp (default) or local
+  char *username;
+  char *hostname;
+  int mountpoint_seen;
+  double latency_ms;    // local backend: cost of each call
+  double bandwidth_kbs; // local backend: link speed, 0 = unlimited
+  double stream_kbs;    // local backend: speed of one transfer, 0 = unlimited
+  double cache_ttl;     // seconds to trust cached attributes and listings
+  double negative_ttl;  // seconds to remember that a path doesn't exist
+  int connections;      // size of the sftp connection pool
+  int async_flush;      // close() returns before the upload is done
+  int flush_queue;      // files waiting for the uploader before flush blocks
+  int big_writes;       // ask the kernel for writes larger than a page
+  int compression;      // zlib level for data on the wire, 0 = off
+  int pack_small_kb;    // files up to this size go to the pack segment, 0 = off
+  int pack_size_mb;     // room for packed files
+  int prefetch;         // fetch small files of a directory when it is listed
+  int prefetch_max;     // files queued per listing
+  double prefetch_kbs;  // prefetch bandwidth cap, 0 = unlimited
+  int dedup;            // cache larger files as blocks keyed by content hash
+  int dedup_block_kb;   // block size of the dedup store
+  int dedup_size_mb;    // room for deduped blocks
+  int keep_cache;       // let the kernel keep pages of unchanged files
+  double kernel_ttl;    // seconds the kernel may trust names and attributes
+  int streams;          // parallel transfers for one large download
+  int stream_piece_kb;  // smallest range one of them fetches
+  int lowlevel;         // serve the low-level fuse API, by inode number
+  int resume;           // journal downloads, reuse cache files across runs
+  int resume_block_kb;  // unit of the journal
+  int sparse;           // holes and zero blocks stay off the link and disk
+  char *lease_server;   // host:port of the lease server, NULL for none
+  char *cache_dir;      // where cache files go, /tmp
 };
 
-#define NETFS_DATA ((struct netfs_state *) fuse_get_context()->private_data)
+// set once in main. the low-level API has no fuse_get_context
+extern struct netfs_state *netfs_data;
+#define NETFS_DATA netfs_data
 
 #endif
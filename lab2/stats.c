@@ -0,0 +1,129 @@
+/*
+ * Per operation counters and latency histograms.
+ *
+ * Updated from every fuse thread on every call, so no locks: each
+ * field is bumped with a relaxed atomic add. A reader may see a count
+ * and a total from slightly different moments, good enough for
+ * finding where the time goes.
+ *
+ * */
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct op_stats {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t hist[STATS_BUCKETS];
+};
+
+static struct op_stats stats[STATS_COUNT];
+
+static const char *stats_names[STATS_COUNT] = {
+  "getattr", "readdir", "open", "read", "read_buf",
+  "write", "write_buf", "flush", "fsync", "release",
+  "create", "mkdir", "unlink", "rmdir", "rename",
+  "truncate", "ftruncate", "chmod", "utimens",
+  "be_stat", "be_list", "be_read", "be_write", "be_truncate",
+  "be_create", "be_mkdir", "be_unlink", "be_rmdir",
+  "be_rename", "be_chmod", "be_utimens", "be_hashes",
+};
+
+static uint64_t counters[STATS_COUNTERS];
+
+static const char *counter_names[STATS_COUNTERS] = {
+  "pack_hits", "pack_misses",
+  "prefetch_queued", "prefetch_dropped", "prefetch_files",
+  "prefetch_bytes", "prefetch_used", "prefetch_wasted",
+  "dedup_hits", "dedup_saved", "dedup_shared", "dedup_stored",
+  "resume_kept", "resume_bad",
+  "sparse_skipped", "sparse_punched",
+  "lease_hits", "lease_misses", "lease_recalls",
+};
+
+void stats_count(enum stats_counter c, unsigned long n)
+{
+  __atomic_fetch_add(&counters[c], n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_start()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_end(enum stats_id id, uint64_t start, long ret)
+{
+  struct op_stats *s = &stats[id];
+  uint64_t ns = stats_start() - start;
+  uint64_t us = ns / 1000, max;
+  int b = 0;
+
+  __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+  if (ret < 0)
+    __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&s->bytes, ret, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+  while (ns > max &&
+      !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  while (us > 1 && b < STATS_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  __atomic_fetch_add(&s->hist[b], 1, __ATOMIC_RELAXED);
+}
+
+size_t stats_format(char *buf, size_t size)
+{
+  size_t len = 0;
+  uint64_t count, hits;
+  int id, b;
+
+#define OUT(...) do { \
+    int n_ = snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__); \
+    if (n_ > 0) len += n_; \
+  } while (0)
+
+  OUT("%-12s %10s %8s %12s %10s %10s\n", "op", "count", "errors", "bytes", "mean us", "max us");
+  for (id = 0; id < STATS_COUNT; id++) {
+    count = __atomic_load_n(&stats[id].count, __ATOMIC_RELAXED);
+    if (count == 0)
+      continue;
+    OUT("%-12s %10lu %8lu %12lu %10.1f %10.1f\n", stats_names[id],
+        (unsigned long)count,
+        (unsigned long)__atomic_load_n(&stats[id].errors, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&stats[id].bytes, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats[id].total_ns, __ATOMIC_RELAXED) / 1000.0 / count,
+        __atomic_load_n(&stats[id].max_ns, __ATOMIC_RELAXED) / 1000.0);
+
+    // bucket b counts calls that took less than 2^(b+1) us
+    OUT("%12s", "");
+    for (b = 0; b < STATS_BUCKETS; b++) {
+      hits = __atomic_load_n(&stats[id].hist[b], __ATOMIC_RELAXED);
+      if (hits)
+        OUT(" <%luus:%lu", 2UL << b, (unsigned long)hits);
+    }
+    OUT("\n");
+  }
+
+  for (id = 0; id < STATS_COUNTERS; id++) {
+    count = __atomic_load_n(&counters[id], __ATOMIC_RELAXED);
+    if (count)
+      OUT("%-16s %10lu\n", counter_names[id], (unsigned long)count);
+  }
+#undef OUT
+
+  if (len >= size && size > 0)
+    len = size - 1; // snprintf truncated the tail
+  return len;
+}
@@ -0,0 +1,53 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// fuse callbacks first, then calls into the backend
+enum stats_id {
+  STATS_GETATTR, STATS_READDIR, STATS_OPEN, STATS_READ, STATS_READ_BUF,
+  STATS_WRITE, STATS_WRITE_BUF, STATS_FLUSH, STATS_FSYNC, STATS_RELEASE,
+  STATS_CREATE, STATS_MKDIR, STATS_UNLINK, STATS_RMDIR, STATS_RENAME,
+  STATS_TRUNCATE, STATS_FTRUNCATE, STATS_CHMOD, STATS_UTIMENS,
+  STATS_BE_STAT, STATS_BE_LIST, STATS_BE_READ, STATS_BE_WRITE, STATS_BE_TRUNCATE,
+  STATS_BE_CREATE, STATS_BE_MKDIR, STATS_BE_UNLINK, STATS_BE_RMDIR,
+  STATS_BE_RENAME, STATS_BE_CHMOD, STATS_BE_UTIMENS, STATS_BE_HASHES,
+  STATS_COUNT
+};
+
+#define STATS_BUCKETS 32  // log2 of microseconds
+
+// plain event counters
+enum stats_counter {
+  STATS_PACK_HITS, STATS_PACK_MISSES,
+  STATS_PREFETCH_QUEUED, STATS_PREFETCH_DROPPED, STATS_PREFETCH_FILES,
+  STATS_PREFETCH_BYTES, STATS_PREFETCH_USED, STATS_PREFETCH_WASTED,
+  STATS_DEDUP_HITS, STATS_DEDUP_SAVED, STATS_DEDUP_SHARED, STATS_DEDUP_STORED,
+  STATS_RESUME_KEPT, STATS_RESUME_BAD,
+  STATS_SPARSE_SKIPPED, STATS_SPARSE_PUNCHED,
+  STATS_LEASE_HITS, STATS_LEASE_MISSES, STATS_LEASE_RECALLS,
+  STATS_COUNTERS
+};
+
+// current time in nanoseconds, pass it to stats_end
+uint64_t stats_start();
+
+// account one operation. ret < 0 is an error, ret > 0 a byte count
+void stats_end(enum stats_id id, uint64_t start, long ret);
+
+// add n to counter c
+void stats_count(enum stats_counter c, unsigned long n);
+
+// time call and account it under id, evaluates to the result of call
+#define STATS_TIME(id, call) ({ \
+    uint64_t t0_ = stats_start(); \
+    long r_ = (call); \
+    stats_end(id, t0_, r_); \
+    r_; \
+})
+
+// human readable dump of all counters, returns the length written
+size_t stats_format(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Poor man's ls -lR. Walks the tree and lstat()s every entry, a few
+ * times in a row so the first (cold) pass can be compared with the
+ * passes served from the attribute cache.
+ *
+ * Usage: ./tls <dir> [passes]
+ *
+ * */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#define BILLION 1000000000
+#define TIME_TYPE CLOCK_REALTIME
+
+static int nentries;
+
+void walk(const char *dirname) {
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st;
+  char path[PATH_MAX];
+
+  if ((dir = opendir(dirname)) == NULL) {
+    perror(dirname);
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    snprintf(path, PATH_MAX, "%s/%s", dirname, entry->d_name);
+    if (lstat(path, &st) == -1) {
+      perror(path);
+      continue;
+    }
+    nentries++;
+    if (S_ISDIR(st.st_mode))
+      walk(path);
+  }
+  closedir(dir);
+}
+
+int
+main(int argc, char *argv[]) {
+  struct timespec start, stop;
+  double elapsed;
+  int i, passes = 3;
+
+  if (argc < 2) {
+    printf("Usage: %s <dir> [passes]\n", argv[0]);
+    exit(1);
+  }
+  if (argc > 2)
+    passes = atoi(argv[2]);
+
+  for (i = 0; i < passes; i++) {
+    nentries = 0;
+    clock_gettime(TIME_TYPE, &start);
+    walk(argv[1]);
+    clock_gettime(TIME_TYPE, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + ((stop.tv_nsec - start.tv_nsec)/(double) BILLION);
+    printf("pass %d: %d entries in %0.3f seconds (%0.3f ms per entry)\n", i, nentries,
+        elapsed, nentries ? elapsed * 1000 / nentries : 0);
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Concurrent readers. Reader i reads file i from start to end, all of
+ * them at the same time. Run with 1..N readers to see whether reads of
+ * different files proceed in parallel over the sftp connection pool.
+ *
+ * Usage: ./trd <file1> [file2 ...]
+ *
+ * */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BILLION 1000000000
+#define TIME_TYPE CLOCK_REALTIME
+#define BUF_SIZE (128 * 1024)
+
+struct reader {
+  pthread_t thread;
+  char *filename;
+  long nbytes;
+};
+
+void *read_file(void *arg) {
+  struct reader *r = arg;
+  char *buf = malloc(BUF_SIZE);
+  ssize_t nb;
+  int fd;
+
+  r->nbytes = 0;
+  if ((fd = open(r->filename, O_RDONLY)) == -1) {
+    perror(r->filename);
+    free(buf);
+    return NULL;
+  }
+  while ((nb = read(fd, buf, BUF_SIZE)) > 0)
+    r->nbytes += nb;
+  close(fd);
+  free(buf);
+  return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+  struct timespec start, stop;
+  struct reader *readers;
+  double elapsed;
+  long total;
+  int i, n, nfiles = argc - 1;
+
+  if (nfiles < 1) {
+    printf("Usage: %s <file1> [file2 ...]\n", argv[0]);
+    exit(1);
+  }
+  readers = calloc(nfiles, sizeof(struct reader));
+
+  printf("readers, seconds, MB/s\n");
+  for (n = 1; n <= nfiles; n++) {
+    clock_gettime(TIME_TYPE, &start);
+    for (i = 0; i < n; i++) {
+      readers[i].filename = argv[i + 1];
+      pthread_create(&readers[i].thread, NULL, read_file, &readers[i]);
+    }
+    total = 0;
+    for (i = 0; i < n; i++) {
+      pthread_join(readers[i].thread, NULL);
+      total += readers[i].nbytes;
+    }
+    clock_gettime(TIME_TYPE, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + ((stop.tv_nsec - start.tv_nsec)/(double) BILLION);
+    printf("%d, %0.3f, %0.2f\n", n, elapsed, total / elapsed / (1024 * 1024));
+  }
+  free(readers);
+  return 0;
+}
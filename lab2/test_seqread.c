@@ -0,0 +1,62 @@
+/*
+ * Large sequential reads from an already open file. The open (which
+ * downloads the file into the cache) is timed apart from the reads,
+ * so the passes measure the cached read path only.
+ *
+ * Usage: ./tsr <file> [block size in KB] [passes]
+ *
+ * */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BILLION 1000000000
+#define TIME_TYPE CLOCK_REALTIME
+
+int
+main(int argc, char *argv[]) {
+  struct timespec start, stop;
+  double elapsed;
+  size_t block = 128 * 1024;
+  int i, fd, passes = 3;
+  long total;
+  ssize_t nb;
+  char *buf;
+
+  if (argc < 2) {
+    printf("Usage: %s <file> [block size in KB] [passes]\n", argv[0]);
+    exit(1);
+  }
+  if (argc > 2)
+    block = atoi(argv[2]) * 1024;
+  if (argc > 3)
+    passes = atoi(argv[3]);
+  buf = malloc(block);
+
+  clock_gettime(TIME_TYPE, &start);
+  if ((fd = open(argv[1], O_RDONLY)) == -1) {
+    perror(argv[1]);
+    exit(1);
+  }
+  clock_gettime(TIME_TYPE, &stop);
+  elapsed = (stop.tv_sec - start.tv_sec) + ((stop.tv_nsec - start.tv_nsec)/(double) BILLION);
+  printf("open: %0.3f seconds\n", elapsed);
+
+  for (i = 0; i < passes; i++) {
+    total = 0;
+    clock_gettime(TIME_TYPE, &start);
+    while ((nb = pread(fd, buf, block, total)) > 0)
+      total += nb;
+    clock_gettime(TIME_TYPE, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + ((stop.tv_nsec - start.tv_nsec)/(double) BILLION);
+    printf("pass %d: %ld bytes in %0.3f seconds, %0.2f MB/s\n", i, total, elapsed,
+        total / elapsed / (1024 * 1024));
+  }
+  close(fd);
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Faults taken, pages mapped and wall time of the demand loader against
+# the fault-around window, for the sequential (test1) and random (test2)
+# programs, with both pagers. The programs are linked -z norelro here:
+# static glibc mprotects its RELRO pages at startup, which fails on the
+# pages the signal path has not mapped yet.
+#
+# Usage: ./bench_fault_around.sh
+#
+# Tunables (environment):
+#   WINDOWS="1 2 4 8 16 32 64" RUNS=5 PAGERS="signal uffd"
+#
+set -e
+
+WINDOWS=${WINDOWS:-"1 2 4 8 16 32 64"}
+RUNS=${RUNS:-5}
+PAGERS=${PAGERS:-"signal uffd"}
+
+make demand_loader.out > /dev/null
+for t in test1 test2; do
+  gcc $t.c -o $t.norelro.out -Wl,-Ttext-segment=0x2000000 -Wl,-z,norelro \
+    -static -O0 -g 2> /dev/null
+done
+
+for t in test1 test2; do
+  for p in $PAGERS; do
+    echo "=== $t, $p ==="
+    printf "%8s %8s %8s %10s\n" window faults pages "wall ms"
+    for w in $WINDOWS; do
+      # the report is the last line on stderr, keep the fastest run
+      for r in $(seq $RUNS); do
+        LOADER_REPORT=1 LOADER_PAGER=$p LOADER_FAULT_AROUND=$w \
+          ./demand_loader.out ./$t.norelro.out 2>&1 > /dev/null | tail -1
+      done | sort -n -k6 | head -1 |
+        awk -v w=$w '{ printf "%8d %8d %8d %10.2f\n", w, $2, $4, $6 }'
+    done
+  done
+done
+
+rm -f test1.norelro.out test2.norelro.out
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Every predictor of the hybrid loader on the sequential (test1) and
+# random (test2) programs: faults left, pages mapped on a prediction and
+# what became of them. Accuracy counts used pages among the settled
+# ones, coverage the share of used pages that did not fault themselves.
+# Pending pages were mapped too close to the exit to be settled.
+#
+# Usage: ./bench_predictors.sh
+#
+# Tunables (environment):
+#   PREDICTORS="none clairvoyant next stride region markov"
+#   DEPTHS="2 8 32" PAGER=signal
+#
+set -e
+
+PREDICTORS=${PREDICTORS:-"none clairvoyant next stride region markov"}
+DEPTHS=${DEPTHS:-"2 8 32"}
+PAGER=${PAGER:-signal}
+
+make hybrid_loader.out test1.out test2.out > /dev/null 2>&1
+
+for t in test1 test2; do
+  echo "=== $t, $PAGER ==="
+  printf "%-12s %5s %7s %9s %6s %7s %8s %9s %9s %10s\n" predictor depth faults \
+    predicted used pending "acc %" "cover %" "over KB" "wall ms"
+  for p in $PREDICTORS; do
+    for d in $DEPTHS; do
+      LOADER_REPORT=1 LOADER_PAGER=$PAGER LOADER_PREDICTOR=$p LOADER_PREDICT_DEPTH=$d \
+        ./hybrid_loader.out ./$t.out 2>&1 > /dev/null | grep -v Mapping |
+        awk -v p=$p -v d=$d '
+          /^faults/ { faults = $2; wall = $6 }
+          /^predicted/ { pred = $2; used = $4; pend = $8; acc = $10; cov = $12; over = $14 }
+          END {
+            sub("%", "", acc); sub("%", "", cov)
+            printf "%-12s %5d %7d %9d %6d %7d %8.1f %9.1f %9d %10.2f\n",
+              p, d, faults, pred, used, pend, acc, cov, over, wall
+          }'
+      # depth means nothing to these two
+      [ $p = none -o $p = clairvoyant ] && break
+    done
+  done
+done
@@ -53,12 +53,17 @@ position            content                     size (bytes) + comment
 #include <sys/mman.h>
 #include <assert.h>
 #include <signal.h>
+#include "uffd_pager.h"
+#include "fault_trace.h"
 
 unsigned long base_virtual_address;
 Elf64_Ehdr *elfHeader;
 Elf64_Phdr *phHeader;
 int fd;
 unsigned long totalMemoryMapped = 0;
+int use_uffd = 0; // LOADER_PAGER=uffd
+unsigned long fault_around = 1; // LOADER_FAULT_AROUND, pages mapped per fault
+struct loader_report *report;
 
 // basic validation checks
 void validate_elf(unsigned char *e_ident) {
@@ -70,7 +75,7 @@ void validate_elf(unsigned char *e_ident) {
   assert(e_ident[EI_DATA] == ELFDATA2LSB); // least significant byte -> lowest address(intel)
 }
 
-inline int getProt(Elf64_Word p_flags) {
+static inline int getProt(Elf64_Word p_flags) {
   int prot = PROT_NONE;
 
   if (p_flags & PF_W)
@@ -84,90 +89,234 @@ inline int getProt(Elf64_Word p_flags) {
 }
 
 
-void *map_single_page(unsigned long v_addr, int first_address) {
-  long pg_size;
+/*
+ * Pages of the PT_LOAD range that are mapped already. A window must not
+ * map over them, the program may have written there.
+ * */
+unsigned char *mapped;
+unsigned long first_page;
 
-  ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
-  int i, prot;
-  unsigned long offsetInPg; // we need to add this number to tatal size
-  unsigned long alignedPgAddr; // pg_size - 1 == 000000 => will give rounded up bits
-  unsigned long mapSize; // total map size. includes bits wasted due to allignment
-  unsigned long offsetInFile; // offset in file
-  Elf64_Addr p_vaddr;
-  int flags = MAP_PRIVATE | MAP_DENYWRITE;
-  unsigned long k_bss;
-  int base_address_set = 0;
-  int someAddressAssigned = 0;
+static int page_mapped(unsigned long page, long pg_size) {
+  unsigned long n = (page - first_page) / pg_size;
+  return mapped[n / 8] & (1 << (n % 8));
+}
+
+static void mark_mapped(unsigned long page, long pg_size) {
+  unsigned long n = (page - first_page) / pg_size;
+  mapped[n / 8] |= 1 << (n % 8);
+}
+
+// PT_LOAD holding v_addr, -1 if there is none
+int find_segment(unsigned long v_addr) {
+  int i;
 
   for (i = 0; i < elfHeader->e_phnum; ++i) {
     if (phHeader[i].p_type != PT_LOAD)
       continue;
+    if (phHeader[i].p_vaddr <= v_addr &&
+        v_addr < phHeader[i].p_vaddr + phHeader[i].p_memsz)
+      return i;
+  }
+  return -1;
+}
 
-    p_vaddr = phHeader[i].p_vaddr;
-
-    // check that if it's the first mapping.
-    if (first_address)
-      goto assign_mem;
-    else if  ((unsigned long)(p_vaddr <= v_addr) &&               // check that it's lies between the start
-        v_addr <= (unsigned long)(p_vaddr + phHeader[i].p_memsz)) // and end of virtual memory add. from file.
-      goto assign_mem;
-    else
-      continue; // continue and check the next index
-
-  // page mapping code
-assign_mem:
-    someAddressAssigned = 1;
-    offsetInPg    = p_vaddr & (pg_size - 1);
-
-
-    // page size will always work since anything less than page size
-    // will be rounded off to page size.
-    //mapSize       = phHeader[i].p_filesz + offsetInPg;
-    mapSize = pg_size;
-
-    if (first_address) {
-      alignedPgAddr = p_vaddr & ~(pg_size - 1);
-      offsetInFile  = phHeader[i].p_offset - offsetInPg;
-    } else {
-      alignedPgAddr = v_addr & ~(pg_size - 1);
-      // explanation at http://i.imgur.com/Fh2eF08.jpg?1
-      // 1. Calculate the offset of page boundary of start address
-      // 2. Calulate the number of pages in between the seeked virtual
-      // address and the start address of this program header's virtual
-      // address range
-      offsetInFile = (unsigned long)phHeader[i].p_offset - (unsigned long)(p_vaddr &
-          (pg_size - 1)) + (v_addr & ~(pg_size - 1)) - (p_vaddr & ~(pg_size - 1));
-    }
+/*
+ * The fault_around aligned pages holding v_addr, cut to the pages of the
+ * segment. The window does not cross the last page with file bytes
+ * either, so it is all file mapping or all anonymous.
+ *
+ * */
+void fault_window(Elf64_Phdr *ph, unsigned long v_addr, long pg_size,
+    unsigned long *start, unsigned long *end) {
+  unsigned long seg_start = ph->p_vaddr & ~(pg_size - 1);
+  unsigned long seg_end = (ph->p_vaddr + ph->p_memsz + pg_size - 1) & ~(pg_size - 1);
+  unsigned long file_end = (ph->p_vaddr + ph->p_filesz + pg_size - 1) & ~(pg_size - 1);
+  unsigned long page = v_addr & ~(pg_size - 1);
+
+  *start = page - ((page / pg_size) % fault_around) * pg_size;
+  *end = *start + fault_around * pg_size;
+
+  if (*start < seg_start)
+    *start = seg_start;
+  if (*end > seg_end)
+    *end = seg_end;
+  if (page < file_end && *end > file_end)
+    *end = file_end;
+  if (page >= file_end && *start < file_end)
+    *start = file_end;
+}
 
-    prot          = getProt(phHeader[i].p_flags);
+// map [start, end) of the segment with one mmap
+void map_run(Elf64_Phdr *ph, unsigned long start, unsigned long end, long pg_size) {
+  unsigned long file_end = (ph->p_vaddr + ph->p_filesz + pg_size - 1) & ~(pg_size - 1);
+  unsigned long offsetInFile = 0; // offset in file
+  unsigned long page;
+  int flags = MAP_PRIVATE | MAP_DENYWRITE;
+  int prot = getProt(ph->p_flags);
+  int map_fd = fd;
+  char *m_map;
+
+  if (elfHeader->e_type == ET_EXEC)
+    flags |= MAP_FIXED;
+
+  // for bss segment, we still need to map anonymous region
+  if (start >= file_end) {
+    flags |= MAP_ANONYMOUS;
+    map_fd = -1;
+    fprintf(stderr, "[BSS]");
+  } else {
+    // explanation at http://i.imgur.com/Fh2eF08.jpg?1
+    // 1. Calculate the offset of page boundary of start address
+    // 2. Calulate the number of pages in between the seeked virtual
+    // address and the start address of this program header's virtual
+    // address range
+    offsetInFile = ph->p_offset - (ph->p_vaddr & (pg_size - 1)) +
+      start - (ph->p_vaddr & ~(pg_size - 1));
+  }
 
-    if (elfHeader->e_type == ET_EXEC)
-      flags |= MAP_FIXED;
+  m_map = mmap((caddr_t)start, end - start, prot, flags, map_fd, offsetInFile);
+  if (m_map == MAP_FAILED) {
+    perror("mmap");
+    exit(-1);
+  }
+  CMP_AND_FAIL(m_map, (char *)start, "Couldn't assign asked virtual address");
+
+  // the last file page holds the start of bss, which must read as zero
+  if (end == file_end && ph->p_memsz > ph->p_filesz && (prot & PROT_WRITE))
+    memset((char *)(ph->p_vaddr + ph->p_filesz), 0,
+        file_end - (ph->p_vaddr + ph->p_filesz));
+
+  for (page = start; page < end; page += pg_size)
+    mark_mapped(page, pg_size);
+  totalMemoryMapped += end - start;
+  report->pages += (end - start) / pg_size;
+  fprintf(stderr, "Mapping aligned  virtual address at %li and TMP: %li\n", start, totalMemoryMapped);
+}
 
-    // for bss segment, we still need to map anonymous region
-    if (v_addr > (unsigned long)(p_vaddr + phHeader[i].p_filesz)) {
-      flags |= MAP_ANONYMOUS;
-      fprintf(stderr, "[BSS]");
-    }
+/*
+ * Map the page holding v_addr and the rest of its fault_around window.
+ * Pages of the window that are mapped already are skipped, the others
+ * go in runs of one mmap each. The first mapping is the first page of
+ * the first segment, alone.
+ *
+ * */
+void *map_single_page(unsigned long v_addr, int first_address) {
+  long pg_size;
+  unsigned long start, end, run;
+  Elf64_Phdr *ph;
+  int i;
 
-    char *m_map;
-    ASSERT_I( (m_map = mmap((caddr_t)alignedPgAddr, mapSize, prot,
-            flags, fd, offsetInFile)), "mmap");
-    totalMemoryMapped += mapSize;
-    fprintf(stderr, "Mapping aligned  virtual address at %li and TMP: %li\n", alignedPgAddr, totalMemoryMapped);
-    CMP_AND_FAIL(m_map, (char *)alignedPgAddr, "Couldn't assign asked virtual address");
+  ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
+
+  if (first_address) {
+    for (i = 0; i < elfHeader->e_phnum && phHeader[i].p_type != PT_LOAD; ++i);
+    if (i == elfHeader->e_phnum)
+      return NULL;
+    start = phHeader[i].p_vaddr & ~(pg_size - 1);
     // we shift the base address using static link.
-    if (first_address == 1 && base_address_set == 0) {
-      base_virtual_address = (unsigned long)m_map;
-      base_address_set = 1;
-    }
-    break;
+    base_virtual_address = start;
+    map_run(&phHeader[i], start, start + pg_size, pg_size);
+    return NULL;
   }
 
-  if (someAddressAssigned == 0) {
+  if ((i = find_segment(v_addr)) < 0) {
     // raise the segmenation fault again.
     // not sure why this is not getting caught.
     raise(SIGSEGV);
+    return NULL;
+  }
+  ph = &phHeader[i];
+  fault_window(ph, v_addr, pg_size, &start, &end);
+
+  while (start < end) {
+    for (; start < end && page_mapped(start, pg_size); start += pg_size);
+    for (run = start; run < end && !page_mapped(run, pg_size); run += pg_size);
+    if (run > start)
+      map_run(ph, start, run, pg_size);
+    start = run;
+  }
+  return NULL;
+}
+
+/*
+ * userfaultfd backend. Every PT_LOAD is reserved whole and left empty,
+ * the pager fills each page on its first touch.
+ *
+ * */
+void reserve_segments() {
+  long pg_size;
+  int i;
+  unsigned long start, end;
+
+  ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
+  if (uffd_pager_init(fd, phHeader, elfHeader->e_phnum) < 0) {
+    perror("userfaultfd");
+    exit(-1);
+  }
+
+  for (i = 0; i < elfHeader->e_phnum; ++i) {
+    if (phHeader[i].p_type != PT_LOAD)
+      continue;
+
+    start = phHeader[i].p_vaddr & ~(pg_size - 1);
+    end   = (phHeader[i].p_vaddr + phHeader[i].p_memsz + pg_size - 1) & ~(pg_size - 1);
+    if (uffd_pager_register(start, end - start, getProt(phHeader[i].p_flags)) < 0) {
+      perror("userfaultfd register");
+      exit(-1);
+    }
+    totalMemoryMapped += end - start;
+    if (base_virtual_address == 0)
+      base_virtual_address = start;
+  }
+}
+
+/*
+ * One bit per page from the lowest to the highest PT_LOAD page, clear
+ * until it is mapped. Allocated here: the program owns the heap once it
+ * runs.
+ *
+ * */
+void map_init() {
+  long pg_size;
+  unsigned long last_page = 0, end;
+  int i;
+
+  ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
+  first_page = ~0UL;
+  for (i = 0; i < elfHeader->e_phnum; ++i) {
+    if (phHeader[i].p_type != PT_LOAD)
+      continue;
+    end = (phHeader[i].p_vaddr + phHeader[i].p_memsz + pg_size - 1) & ~(pg_size - 1);
+    if ((phHeader[i].p_vaddr & ~(pg_size - 1)) < first_page)
+      first_page = phHeader[i].p_vaddr & ~(pg_size - 1);
+    if (end > last_page)
+      last_page = end;
+  }
+  ASSERT_P( (mapped = calloc((last_page - first_page) / pg_size / 8 + 1, 1)), "calloc" );
+}
+
+/*
+ * userfaultfd counterpart of the window: the faulting page is in, fill
+ * the rest of its window.
+ *
+ * */
+static void fault_around_hook(unsigned long addr) {
+  long pg_size = sysconf(_SC_PAGE_SIZE);
+  unsigned long start, end, page;
+  int i;
+
+  report->faults++;
+  report->pages++;
+  trace_fault(addr);
+  if (fault_around == 1 || (i = find_segment(addr)) < 0)
+    return;
+
+  fault_window(&phHeader[i], addr, pg_size, &start, &end);
+  for (page = start; page < end; page += pg_size) {
+    if (page == (addr & ~(pg_size - 1)))
+      continue;
+    if (uffd_pager_fill(page) == 0)
+      report->pages++;
   }
 }
 
@@ -196,6 +345,13 @@ void *load_elf_binary(char* buf, int fdt)
   validate_elf(e_ident);
   fd = fdt;
 
+  if (use_uffd) {
+    reserve_segments();
+    return (void *)elfHeader->e_entry;
+  }
+
+  map_init();
+
   // void *map_single_page(char *buf, int fd, unsigned long v_addr, int first_address) {
   map_single_page(0, 1);
   return (void *)elfHeader->e_entry;
@@ -224,12 +380,12 @@ void modify_auxv(char *envp[], char *buf, void *argv) {
         }
       case AT_PHENT:
         {
-          auxv->a_un.a_val = (uint64_t)(buf + elfHeader->e_phentsize);
+          auxv->a_un.a_val = elfHeader->e_phentsize;
           break;
         }
       case AT_PHNUM:
         {
-          auxv->a_un.a_val =(uint64_t)(buf + elfHeader->e_phnum);
+          auxv->a_un.a_val = elfHeader->e_phnum;
           break;
         }
 
@@ -272,11 +428,39 @@ void modify_auxv(char *envp[], char *buf, void *argv) {
 }
 
 
+/*
+ * LOADER_TRACE=path: record every fault to path. The ranges of the trace
+ * are the segments, all of them are paged on demand.
+ *
+ * */
+void open_trace(const char *path) {
+  struct trace_range ranges[TRACE_MAX_RANGES];
+  long pg_size;
+  int i, n = 0;
+
+  ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
+  for (i = 0; i < elfHeader->e_phnum && n < TRACE_MAX_RANGES; ++i) {
+    if (phHeader[i].p_type != PT_LOAD)
+      continue;
+    ranges[n].start = phHeader[i].p_vaddr & ~(pg_size - 1);
+    ranges[n].end = (phHeader[i].p_vaddr + phHeader[i].p_memsz + pg_size - 1) & ~(pg_size - 1);
+    if (ranges[n].end > ranges[n].start)
+      n++;
+  }
+
+  if (trace_open(path, pg_size, ranges, n) < 0) {
+    perror(path);
+    exit(-1);
+  }
+}
+
 /*
  * Segfault handler. On each page fault we allocate a memory page
  * */
 static void segfault_handler(int sig, siginfo_t *info, void *uap) {
   ASSERT_P(info, "Trying to derefence a null pointer");
+  report->faults++;
+  trace_fault((unsigned long)info->si_addr);
   map_single_page((unsigned long)info->si_addr, 0);
 }
 
@@ -320,6 +504,11 @@ main(int argc, char* argv[], char* envp[])
     exit(1);
   }
 
+  use_uffd = getenv("LOADER_PAGER") && strcmp(getenv("LOADER_PAGER"), "uffd") == 0;
+  if (getenv("LOADER_FAULT_AROUND") && atol(getenv("LOADER_FAULT_AROUND")) > 1)
+    fault_around = atol(getenv("LOADER_FAULT_AROUND"));
+  report = start_report();
+
   unsigned long *loader_stack = (unsigned long*)(&argv[0]);
   size_t stack_size =  loaderStackSize(envp, loader_stack);
 
@@ -359,8 +548,16 @@ main(int argc, char* argv[], char* envp[])
   e_entry = load_elf_binary(buf, fd);
   DEBUG("Loaded the first page of elf binary.\n");
 
-  // installing the segfault handler.
-  install_segfault_handler();
+  if (getenv("LOADER_TRACE"))
+    open_trace(getenv("LOADER_TRACE"));
+
+  // installing the segfault handler, or the thread that does its job.
+  if (!use_uffd)
+    install_segfault_handler();
+  else if (uffd_pager_start(fault_around_hook) < 0) {
+    perror("fault thread");
+    exit(-1);
+  }
 
   // zero out all the registers and make them invalid by putting them in clobbered list.
   asm("xor %%rax, %%rax;"
@@ -0,0 +1,156 @@
+/*
+ *
+ * Per fault latency of the two demand paging paths.
+ *
+ * A region of pages is touched once per page, each touch taking one
+ * fault, either
+ *  - signal: SIGSEGV handler mmaps the page, as demand_loader.c does
+ *    (without its fprintf), or
+ *  - uffd: the fault thread of uffd_pager.c fills it.
+ * Both are run for file backed pages (text/data) and zero pages (bss).
+ *
+ * usage: fault_bench.out [pages] [rounds]
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "loader.h"
+#include "uffd_pager.h"
+
+static unsigned long region, region_len;
+static long pg_size;
+static int bench_fd;
+static int zero_pages;
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void segfault_handler(int sig, siginfo_t *info, void *uap) {
+  unsigned long addr = (unsigned long)info->si_addr & ~(pg_size - 1);
+  int flags = MAP_PRIVATE | MAP_FIXED;
+
+  if (addr < region || addr >= region + region_len)
+    abort();
+  if (zero_pages)
+    flags |= MAP_ANONYMOUS;
+  if (mmap((void *)addr, pg_size, PROT_READ | PROT_WRITE, flags,
+        zero_pages ? -1 : bench_fd, addr - region) == MAP_FAILED)
+    abort();
+}
+
+// touch every page of the region once, ns per page
+static double touch_all(unsigned long pages) {
+  volatile char *p = (volatile char *)region;
+  unsigned long i;
+  double start = now_ns();
+
+  for (i = 0; i < pages; i++) {
+    if (zero_pages)
+      p[i * pg_size] = 1;
+    else if (p[i * pg_size] != (char)i)
+      abort();
+  }
+  return (now_ns() - start) / pages;
+}
+
+static double run_signal(unsigned long pages) {
+  double ns;
+
+  // the faults must land on nothing
+  ASSERT_I(munmap((void *)region, region_len), "munmap");
+  ns = touch_all(pages);
+  ASSERT_I(munmap((void *)region, region_len), "munmap");
+  return ns;
+}
+
+static double run_uffd(unsigned long pages) {
+  double ns;
+
+  if (uffd_pager_register(region, region_len, PROT_READ | PROT_WRITE) < 0) {
+    perror("userfaultfd register");
+    exit(-1);
+  }
+  ns = touch_all(pages);
+  ASSERT_I(munmap((void *)region, region_len), "munmap");
+  return ns;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long pages = argc > 1 ? atol(argv[1]) : 4096;
+  int rounds = argc > 2 ? atoi(argv[2]) : 5;
+  char path[] = "/tmp/fault_benchXXXXXX";
+  static Elf64_Phdr ph;
+  struct sigaction act;
+  double best[4], total[4], ns;
+  const char *names[4] = { "signal file", "signal zero", "uffd file", "uffd zero" };
+  char *page;
+  unsigned long i;
+  int r, m;
+
+  ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
+  region_len = pages * pg_size;
+
+  // page i of the file is filled with the byte i
+  // not ASSERT_I, it would evaluate mkstemp twice
+  if ((bench_fd = mkstemp(path)) < 0) {
+    perror("mkstemp");
+    exit(-1);
+  }
+  unlink(path);
+  ASSERT_P( (page = malloc(pg_size)), "malloc" );
+  for (i = 0; i < pages; i++) {
+    memset(page, (char)i, pg_size);
+    CMP_AND_FAIL(write(bench_fd, page, pg_size), pg_size, "write");
+  }
+
+  // an address range nobody else will take
+  region = (unsigned long)mmap(NULL, region_len, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if ((void *)region == MAP_FAILED) {
+    perror("mmap");
+    exit(-1);
+  }
+
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_SIGINFO | SA_NODEFER;
+  act.sa_sigaction = segfault_handler;
+  ASSERT_I(sigaction(SIGSEGV, &act, NULL), "sigaction");
+
+  // one PT_LOAD over the region, filesz picks copy or zero pages
+  ph.p_type = PT_LOAD;
+  ph.p_vaddr = region;
+  ph.p_offset = 0;
+  ph.p_memsz = region_len;
+  if (uffd_pager_init(bench_fd, &ph, 1) < 0 || uffd_pager_start(NULL) < 0) {
+    perror("userfaultfd");
+    exit(-1);
+  }
+
+  for (m = 0; m < 4; m++) {
+    best[m] = 1e18;
+    total[m] = 0;
+  }
+
+  for (r = 0; r < rounds; r++) {
+    for (m = 0; m < 4; m++) {
+      zero_pages = m & 1;
+      ph.p_filesz = zero_pages ? 0 : region_len;
+      ns = m < 2 ? run_signal(pages) : run_uffd(pages);
+      total[m] += ns;
+      if (ns < best[m])
+        best[m] = ns;
+    }
+  }
+
+  printf("%lu pages, %d rounds\n", pages, rounds);
+  printf("%-12s %10s %10s\n", "path", "best ns", "mean ns");
+  for (m = 0; m < 4; m++)
+    printf("%-12s %10.0f %10.0f\n", names[m], best[m], total[m] / rounds);
+  return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ *
+ * Replays fault traces of the loaders (LOADER_TRACE) through the page
+ * predictors, without running the programs again.
+ *
+ * Each fault of a trace is a first touch of a page. The replay maps the
+ * page, asks the predictor and maps the predicted pages that lie in a
+ * demand paged range of the trace, as hybrid_loader.c does. A later
+ * touch of a predicted page is a hit: a fault saved. Predicted pages
+ * never touched are the overcommit. Offline every prediction is
+ * settled, unlike the loader's own report.
+ *
+ * Record traces with LOADER_PREDICTOR=none (and no fault-around), or the
+ * pages the loader predicted are missing from them.
+ *
+ * usage: fault_sim.out [-p predictor,...] [-d depth,...] [-v] trace...
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fault_trace.h"
+#include "predictor.h"
+
+#define MAX_CONFIGS 64
+
+struct trace {
+  const char *path;
+  struct trace_header *header;
+  struct trace_range *ranges;
+  struct trace_record *records;
+  unsigned long nr_records;
+};
+
+struct result {
+  unsigned long traces;
+  unsigned long faults;    // faults left with the predictor
+  unsigned long hits;      // predicted pages touched later
+  unsigned long predicted; // pages mapped on a prediction
+};
+
+// page states in the replay
+#define PAGE_FAULTED 1
+#define PAGE_PREDICTED 2
+#define PAGE_USED 3
+
+struct page_slot {
+  unsigned long page; // page number + 1, 0 is a free slot
+  int state;
+};
+
+static struct page_slot *slots;
+static unsigned long nr_slots;
+
+// FNV-1a, same as the markov predictor
+static struct page_slot *page_slot(unsigned long page) {
+  unsigned long hash = 2166136261UL;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    hash ^= (page >> (i * 8)) & 0xff;
+    hash *= 16777619UL;
+  }
+  for (hash &= nr_slots - 1; slots[hash].page && slots[hash].page != page + 1;
+      hash = (hash + 1) & (nr_slots - 1));
+  return &slots[hash];
+}
+
+static int in_ranges(struct trace *t, unsigned long addr) {
+  int i;
+
+  for (i = 0; i < t->header->nr_ranges; i++)
+    if (addr >= t->ranges[i].start && addr < t->ranges[i].end)
+      return 1;
+  return 0;
+}
+
+static int load_trace(const char *path, struct trace *t) {
+  struct stat st;
+  FILE *fh;
+  char *buf;
+  size_t head;
+
+  if ((fh = fopen(path, "rb")) == NULL || fstat(fileno(fh), &st) < 0) {
+    perror(path);
+    return -1;
+  }
+  if ((buf = malloc(st.st_size)) == NULL ||
+      fread(buf, 1, st.st_size, fh) != st.st_size) {
+    perror(path);
+    fclose(fh);
+    return -1;
+  }
+  fclose(fh);
+
+  t->path = path;
+  t->header = (struct trace_header *)buf;
+  if (st.st_size < sizeof(*t->header) || t->header->magic != TRACE_MAGIC ||
+      t->header->page_size == 0 || t->header->nr_ranges > TRACE_MAX_RANGES) {
+    fprintf(stderr, "%s: not a fault trace\n", path);
+    free(buf);
+    return -1;
+  }
+
+  head = sizeof(*t->header) + t->header->nr_ranges * sizeof(struct trace_range);
+  if (st.st_size < head) {
+    fprintf(stderr, "%s: truncated\n", path);
+    free(buf);
+    return -1;
+  }
+  t->ranges = (struct trace_range *)(buf + sizeof(*t->header));
+  t->records = (struct trace_record *)(buf + head);
+  t->nr_records = (st.st_size - head) / sizeof(struct trace_record);
+  return 0;
+}
+
+static void replay(struct trace *t, const struct predictor *p, struct result *r) {
+  unsigned long pages[PREDICT_MAX];
+  unsigned long pg_size = t->header->page_size;
+  unsigned long i, page, need;
+  struct page_slot *s;
+  int k, n;
+
+  // every record and prediction may take a slot, keep it half empty
+  need = 2 * t->nr_records * (predict_depth + 1);
+  if (need > nr_slots) {
+    for (nr_slots = 1024; nr_slots < need; nr_slots *= 2);
+    free(slots);
+    if ((slots = malloc(nr_slots * sizeof(*slots))) == NULL) {
+      perror("malloc");
+      exit(-1);
+    }
+  }
+  memset(slots, 0, nr_slots * sizeof(*slots));
+  p->reset();
+
+  r->traces++;
+  for (i = 0; i < t->nr_records; i++) {
+    page = t->records[i].addr / pg_size;
+    s = page_slot(page);
+    if (s->page) {
+      if (s->state == PAGE_PREDICTED) {
+        s->state = PAGE_USED;
+        r->hits++;
+      }
+      continue;
+    }
+
+    s->page = page + 1;
+    s->state = PAGE_FAULTED;
+    r->faults++;
+
+    n = p->predict(page, pages);
+    for (k = 0; k < n; k++) {
+      if (!in_ranges(t, pages[k] * pg_size))
+        continue;
+      s = page_slot(pages[k]);
+      if (s->page)
+        continue;
+      s->page = pages[k] + 1;
+      s->state = PAGE_PREDICTED;
+      r->predicted++;
+    }
+  }
+}
+
+static void print_result(const char *name, int depth, struct result *r, unsigned long pg_size) {
+  unsigned long touched = r->faults + r->hits;
+
+  printf("%-12s %5d %7lu %9lu %9lu %7.1f %9lu %6.1f %10lu %6.1f\n",
+      name, depth, r->traces, r->faults, r->hits,
+      touched ? 100.0 * r->hits / touched : 0,
+      r->predicted, r->predicted ? 100.0 * r->hits / r->predicted : 0,
+      (r->predicted - r->hits) * pg_size / 1024,
+      touched ? 100.0 * (r->predicted - r->hits) / touched : 0);
+}
+
+// split a comma separated list in place, at most max items
+static int split(char *list, char **items, int max) {
+  int n = 0;
+  char *tok;
+
+  for (tok = strtok(list, ","); tok && n < max; tok = strtok(NULL, ","))
+    items[n++] = tok;
+  return n;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-p predictor,...] [-d depth,...] [-v] trace...\n"
+      "  predictors: %s\n", prog, predictor_names());
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char all[256], depth_list[64] = "2,8,32";
+  char *names[MAX_CONFIGS], *depth_items[MAX_CONFIGS];
+  const struct predictor *p;
+  struct result *results;
+  struct trace *traces;
+  int nr_names, nr_depths, depths[MAX_CONFIGS];
+  int verbose = 0, nr_traces = 0, opt, i, j, k;
+  unsigned long pg_size = 0;
+
+  snprintf(all, sizeof(all), "%s", predictor_names());
+  for (i = 0; all[i]; i++)
+    if (all[i] == ' ')
+      all[i] = ',';
+
+  while ((opt = getopt(argc, argv, "p:d:v")) != -1) {
+    switch (opt) {
+      case 'p':
+        snprintf(all, sizeof(all), "%s", optarg);
+        break;
+      case 'd':
+        snprintf(depth_list, sizeof(depth_list), "%s", optarg);
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind == argc)
+    usage(argv[0]);
+
+  nr_names = split(all, names, MAX_CONFIGS);
+  nr_depths = split(depth_list, depth_items, MAX_CONFIGS);
+  for (j = 0; j < nr_depths; j++) {
+    depths[j] = atoi(depth_items[j]);
+    if (depths[j] < 1 || depths[j] > PREDICT_MAX) {
+      fprintf(stderr, "depth is 1..%d\n", PREDICT_MAX);
+      exit(1);
+    }
+  }
+  for (i = 0; i < nr_names; i++) {
+    if (predictor_find(names[i]) == NULL) {
+      fprintf(stderr, "no predictor %s\n", names[i]);
+      usage(argv[0]);
+    }
+  }
+
+  if ((traces = calloc(argc - optind, sizeof(*traces))) == NULL ||
+      (results = calloc(nr_names * nr_depths, sizeof(*results))) == NULL) {
+    perror("calloc");
+    exit(-1);
+  }
+  for (k = optind; k < argc; k++) {
+    if (load_trace(argv[k], &traces[nr_traces]) == 0)
+      nr_traces++;
+  }
+  if (nr_traces == 0)
+    exit(1);
+
+  printf("%-12s %5s %7s %9s %9s %7s %9s %6s %10s %6s\n", "predictor", "depth",
+      "traces", "faults", "saved", "saved%", "predicted", "hit%", "over KB", "over%");
+
+  for (i = 0; i < nr_names; i++) {
+    p = predictor_find(names[i]);
+    for (j = 0; j < nr_depths; j++) {
+      struct result *r = &results[i * nr_depths + j];
+
+      predict_depth = depths[j];
+      for (k = 0; k < nr_traces; k++) {
+        struct result one;
+
+        memset(&one, 0, sizeof(one));
+        replay(&traces[k], p, &one);
+        r->traces += one.traces;
+        r->faults += one.faults;
+        r->hits += one.hits;
+        r->predicted += one.predicted;
+        pg_size = traces[k].header->page_size;
+        if (verbose) {
+          printf("%s: ", traces[k].path);
+          print_result(names[i], depths[j], &one, pg_size);
+        }
+      }
+      print_result(names[i], depths[j], r, pg_size);
+
+      // depth means nothing to these two
+      if (strcmp(names[i], "none") == 0 || strcmp(names[i], "clairvoyant") == 0)
+        break;
+    }
+  }
+  return 0;
+}
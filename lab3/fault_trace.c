@@ -0,0 +1,76 @@
+/*
+ * Fault trace recorder.
+ *
+ * One write() per fault: the loader never gets control back to flush a
+ * buffer when the program exits, and a record left in a buffer is lost.
+ * write() and clock_gettime() are both fine in a signal handler.
+ *
+ * */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fault_trace.h"
+
+static int trace_fd = -1;
+static struct timespec trace_begin;
+static struct trace_range trace_ranges[TRACE_MAX_RANGES];
+static int trace_nr_ranges;
+
+int trace_open(const char *path, unsigned long page_size,
+    struct trace_range *ranges, int nr_ranges)
+{
+  struct trace_header header;
+  size_t len = nr_ranges * sizeof(*ranges);
+
+  if (nr_ranges > TRACE_MAX_RANGES) {
+    errno = E2BIG;
+    return -1;
+  }
+  if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    return -1;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = TRACE_MAGIC;
+  header.page_size = page_size;
+  header.nr_ranges = nr_ranges;
+  if (write(trace_fd, &header, sizeof(header)) != sizeof(header) ||
+      write(trace_fd, ranges, len) != (ssize_t)len) {
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+
+  memcpy(trace_ranges, ranges, len);
+  trace_nr_ranges = nr_ranges;
+  clock_gettime(CLOCK_MONOTONIC, &trace_begin);
+  return 0;
+}
+
+void trace_fault(unsigned long addr)
+{
+  struct trace_record rec;
+  struct timespec now;
+  int i;
+
+  if (trace_fd < 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  memset(&rec, 0, sizeof(rec));
+  rec.addr = addr;
+  rec.usec = (now.tv_sec - trace_begin.tv_sec) * 1000000 +
+    (now.tv_nsec - trace_begin.tv_nsec) / 1000;
+  rec.range = TRACE_NO_RANGE;
+  for (i = 0; i < trace_nr_ranges; i++) {
+    if (addr >= trace_ranges[i].start && addr < trace_ranges[i].end) {
+      rec.range = i;
+      break;
+    }
+  }
+
+  // a failed write loses this record only, nothing to do about it here
+  write(trace_fd, &rec, sizeof(rec));
+}
@@ -0,0 +1,48 @@
+#ifndef _FAULT_TRACE_H_
+#define _FAULT_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Fault trace file:
+ *
+ *   struct trace_header
+ *   struct trace_range   nr_ranges of them, the demand paged ranges
+ *   struct trace_record  one per fault, to the end of the file
+ *
+ * Little endian, as written by the loader.
+ *
+ * */
+#define TRACE_MAGIC 0x31525446 // "FTR1"
+
+struct trace_header {
+  uint32_t magic;
+  uint32_t page_size;
+  uint32_t nr_ranges;
+  uint32_t reserved;
+};
+
+// [start, end) is paged on demand, page aligned
+struct trace_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+struct trace_record {
+  uint64_t addr;   // faulting address
+  uint32_t usec;   // since the trace was opened
+  uint16_t range;  // index of the range holding addr, TRACE_NO_RANGE if none
+  uint16_t reserved;
+};
+
+#define TRACE_NO_RANGE 0xffff
+#define TRACE_MAX_RANGES 16
+
+// create path and write the header. -1 with errno set on failure
+int trace_open(const char *path, unsigned long page_size,
+    struct trace_range *ranges, int nr_ranges);
+
+// append a fault at addr, if a trace is open. Safe in a signal handler
+void trace_fault(unsigned long addr);
+
+#endif /* End of _FAULT_TRACE_H_ */
@@ -53,14 +53,20 @@ position            content                     size (bytes) + comment
 #include <sys/mman.h>
 #include <assert.h>
 #include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include "uffd_pager.h"
+#include "fault_trace.h"
+#include "predictor.h"
 
 unsigned long base_virtual_address;
 Elf64_Ehdr *elfHeader;
 Elf64_Phdr *phHeader;
-int correct_future_told = 0;
-unsigned long predicted_address;
 unsigned long totalMemMapped = 0;
 int fd;
+int use_uffd = 0; // LOADER_PAGER=uffd
+const struct predictor *predictor; // LOADER_PREDICTOR, clairvoyant by default
+struct loader_report *report;
 
 typedef int bool;
 #define true 1
@@ -76,7 +82,7 @@ void validate_elf(unsigned char *e_ident) {
   assert(e_ident[EI_DATA] == ELFDATA2LSB); // least significant byte -> lowest address(intel)
 }
 
-inline int getProt(Elf64_Word p_flags) {
+static inline int getProt(Elf64_Word p_flags) {
   int prot = PROT_NONE;
 
   if (p_flags & PF_W)
@@ -97,6 +103,22 @@ void *map_bss_page(unsigned long v_addr, bool predicted) {
   int i;
   unsigned long memSize, offset;
   int someAddressAssigned = 0;
+  unsigned char vec;
+
+  // only predictions come here, the fault thread already has the page.
+  // a page that is there is left alone
+  if (use_uffd) {
+    if (uffd_pager_fill(v_addr) != 0)
+      return NULL;
+    totalMemMapped += pg_size;
+    return (void *)(v_addr & ~(pg_size - 1));
+  }
+
+  // mapping over a predicted page would lose what was written there.
+  // mincore fails on addresses with nothing mapped
+  if (predicted && mincore((void *)(v_addr & ~(pg_size - 1)), pg_size, &vec) == 0)
+    return NULL;
+
   //fprintf(stderr, "", v_addr);
   for (i = 0; i < elfHeader->e_phnum; ++i) {
     if (phHeader[i].p_type != PT_LOAD ) continue;
@@ -122,10 +144,10 @@ void *map_bss_page(unsigned long v_addr, bool predicted) {
     // raise the segmenation fault again.
     // not sure why this is not getting caught.
     raise(SIGSEGV);
-  } else {
-    return NULL;
+  } else if (someAddressAssigned) {
+    return (void *)(v_addr & ~(pg_size - 1));
   }
-
+  return NULL;
 }
 
 
@@ -163,6 +185,12 @@ void *load_elf_binary(char* buf, int fd)
   int flags = MAP_PRIVATE | MAP_DENYWRITE;
   unsigned long k_bss;
   int base_address_set = 0;
+  unsigned long bssEnd;
+
+  if (use_uffd && uffd_pager_init(fd, phHeader, elfHeader->e_phnum) < 0) {
+    perror("userfaultfd");
+    exit(-1);
+  }
 
   for (i = 0; i < elfHeader->e_phnum; ++i) {
     // skip if it's not a load
@@ -193,7 +221,15 @@ void *load_elf_binary(char* buf, int fd)
       base_address_set = 1;
     }
 
-    // not adjusting the bss here
+    // not adjusting the bss here, the pager takes the pages past the
+    // file mapping
+    bssEnd = (p_vaddr + phHeader[i].p_memsz + pg_size - 1) & ~(pg_size - 1);
+    if (use_uffd && bssEnd > alignedPgAddr + mapSize &&
+        uffd_pager_register(alignedPgAddr + mapSize,
+          bssEnd - (alignedPgAddr + mapSize), prot) < 0) {
+      perror("userfaultfd register");
+      exit(-1);
+    }
   }
 
   return (void *)elfHeader->e_entry;
@@ -223,12 +259,12 @@ void modify_auxv(char *envp[], char *buf, void *argv) {
         }
       case AT_PHENT:
         {
-          auxv->a_un.a_val = (uint64_t)(buf + elfHeader->e_phentsize);
+          auxv->a_un.a_val = elfHeader->e_phentsize;
           break;
         }
       case AT_PHNUM:
         {
-          auxv->a_un.a_val =(uint64_t)(buf + elfHeader->e_phnum);
+          auxv->a_un.a_val = elfHeader->e_phnum;
           break;
         }
 
@@ -272,26 +308,107 @@ void modify_auxv(char *envp[], char *buf, void *argv) {
 
 
 
-void clairvoyant_method(unsigned long addr, unsigned long pg_size) {
+/*
+ * Predicted pages not known to be used yet, with the fault count when
+ * they were mapped. Tracked with LOADER_REPORT only.
+ *
+ * A page counts as used once it is written: /proc/self/pagemap then
+ * shows it exclusively mapped, where an untouched page is either not
+ * there or the shared zero page. A page still unused PREDICT_AGE faults
+ * later counts as over-mapped. The ones still waiting when the program
+ * exits are reported as pending.
+ *
+ * */
+#define PREDICT_AGE 32
+#define PENDING_MAX (PREDICT_MAX * (PREDICT_AGE + 1))
+#define PM_EXCLUSIVE (1ULL << 56)
+
+struct {
+  unsigned long addr;
+  unsigned long fault;
+} pending[PENDING_MAX];
+int nr_pending = 0;
+int pagemap_fd = -1;
+
+void check_predictions(unsigned long pg_size) {
+  uint64_t entry;
+  int i = 0;
+
+  while (i < nr_pending) {
+    if (pread(pagemap_fd, &entry, sizeof(entry),
+          pending[i].addr / pg_size * sizeof(entry)) == sizeof(entry) &&
+        (entry & PM_EXCLUSIVE))
+      report->pred_used++;
+    else if (report->faults - pending[i].fault > PREDICT_AGE)
+      report->pred_wasted++;
+    else {
+      i++;
+      continue;
+    }
+    pending[i] = pending[--nr_pending];
+  }
+}
 
-  if (predicted_address == (addr & ~(pg_size - 1))){
-    correct_future_told++;
-    //fprintf(stderr, "Predicted Correctly\n");
-  } else {
-    if (correct_future_told > 0)
-      correct_future_told--;
-    //fprintf(stderr, "Ooh Slow Down! wrong prediction\n");
+/*
+ * The page at addr faulted and is mapped. Tell the predictor and map
+ * what it expects next.
+ *
+ * */
+void predict_fault(unsigned long addr, unsigned long pg_size) {
+  unsigned long pages[PREDICT_MAX];
+  void *mapped;
+  int i, n;
+
+  report->faults++;
+  trace_fault(addr);
+  if (pagemap_fd >= 0)
+    check_predictions(pg_size);
+
+  n = predictor->predict(addr / pg_size, pages);
+  for (i = 0; i < n; i++) {
+    if ((mapped = map_bss_page(pages[i] * pg_size, true)) == NULL)
+      continue;
+    report->pages++;
+    report->predicted++;
+    if (pagemap_fd >= 0 && nr_pending < PENDING_MAX) {
+      pending[nr_pending].addr = (unsigned long)mapped;
+      pending[nr_pending].fault = report->faults;
+      nr_pending++;
+    }
   }
+}
+
+// runs on the fault thread once the faulting page is in
+static void predict_hook(unsigned long addr) {
+  report->pages++;
+  predict_fault(addr, sysconf(_SC_PAGE_SIZE));
+}
 
-  if (correct_future_told == 1) {
-    map_bss_page((unsigned long)(addr + pg_size), true);
-    predicted_address = (addr & ~(pg_size - 1)) + pg_size;
-  } else if (correct_future_told >= 2) {
-    map_bss_page((unsigned long)(addr + pg_size), true);
-    map_bss_page((unsigned long)(addr + (2 * pg_size)), true);
-    predicted_address = (addr & ~(pg_size - 1)) + (pg_size * 2);
-  } else {
-    predicted_address = (addr & ~(pg_size - 1)) + pg_size;
+/*
+ * LOADER_TRACE=path: record every fault to path. The ranges of the trace
+ * are the bss pages past each file mapping, the rest is mapped up front.
+ * Faults on predicted pages never happen, record with
+ * LOADER_PREDICTOR=none for the whole demand stream.
+ *
+ * */
+void open_trace(const char *path) {
+  struct trace_range ranges[TRACE_MAX_RANGES];
+  long pg_size;
+  int i, n = 0;
+
+  ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
+  for (i = 0; i < elfHeader->e_phnum && n < TRACE_MAX_RANGES; ++i) {
+    if (phHeader[i].p_type != PT_LOAD)
+      continue;
+    ranges[n].start = (phHeader[i].p_vaddr + phHeader[i].p_filesz + pg_size - 1) & ~(pg_size - 1);
+    ranges[n].end = (phHeader[i].p_vaddr + phHeader[i].p_memsz + pg_size - 1) & ~(pg_size - 1);
+    if (ranges[n].end > ranges[n].start)
+      n++;
+  }
+
+  if (trace_open(path, pg_size, ranges, n) < 0) {
+    perror(path);
+    exit(-1);
   }
 }
 
@@ -303,8 +420,9 @@ static void segfault_handler(int sig, siginfo_t *info, void *uap) {
   ASSERT_I( (pg_size = sysconf(_SC_PAGE_SIZE)), "page size" );
   ASSERT_P(info, "Trying to derefence a null pointer");
   //fprintf(stderr, "mapping...\n");
-  map_bss_page((unsigned long)(info->si_addr), false);
-  clairvoyant_method((unsigned long)info->si_addr, pg_size);
+  if (map_bss_page((unsigned long)(info->si_addr), false))
+    report->pages++;
+  predict_fault((unsigned long)info->si_addr, pg_size);
 }
 
 /*
@@ -345,6 +463,25 @@ main(int argc, char* argv[], char* envp[])
     exit(1);
   }
 
+  use_uffd = getenv("LOADER_PAGER") && strcmp(getenv("LOADER_PAGER"), "uffd") == 0;
+  if (getenv("LOADER_PREDICT_DEPTH"))
+    predict_depth = atoi(getenv("LOADER_PREDICT_DEPTH"));
+  if (predict_depth < 1 || predict_depth > PREDICT_MAX) {
+    fprintf(stderr, "LOADER_PREDICT_DEPTH is 1..%d\n", PREDICT_MAX);
+    exit(1);
+  }
+  predictor = predictor_find(getenv("LOADER_PREDICTOR") ? getenv("LOADER_PREDICTOR") : "clairvoyant");
+  if (predictor == NULL) {
+    fprintf(stderr, "LOADER_PREDICTOR is one of: %s\n", predictor_names());
+    exit(1);
+  }
+  report = start_report();
+  if (getenv("LOADER_REPORT") &&
+      (pagemap_fd = open("/proc/self/pagemap", O_RDONLY)) < 0) {
+    perror("pagemap");
+    exit(-1);
+  }
+
   unsigned long *loader_stack = (unsigned long*)(&argv[0]);
   size_t stack_size =  loaderStackSize(envp, loader_stack);
 
@@ -385,8 +522,16 @@ main(int argc, char* argv[], char* envp[])
   e_entry = load_elf_binary(buf, fd);
   DEBUG("Loaded the first page of elf binary.\n");
 
-  // installing the segfault handler.
-  install_segfault_handler();
+  if (getenv("LOADER_TRACE"))
+    open_trace(getenv("LOADER_TRACE"));
+
+  // installing the segfault handler, or the thread that does its job.
+  if (!use_uffd)
+    install_segfault_handler();
+  else if (uffd_pager_start(predict_hook) < 0) {
+    perror("fault thread");
+    exit(-1);
+  }
 //  fprintf(stderr, "Entry Address: %li, Stack Address: %li\n", e_entry, stack_ptr);
 
   // zero out all the registers and make them invalid by putting them in clobbered list.
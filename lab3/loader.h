@@ -11,6 +11,8 @@
 #include <sys/mman.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #define STACK_SIZE 819200
 
@@ -48,7 +50,11 @@ unsigned long *create_new_stack(unsigned long *loader_stack, size_t stack_size)
   unsigned long *stack;
   int stack_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
   int flags = (MAP_GROWSDOWN | MAP_ANONYMOUS | MAP_PRIVATE);
-  ASSERT_I((stack = mmap((caddr_t)0x8000000, STACK_SIZE, stack_prot, flags, -1, 0)), "mmap");
+  // once: ASSERT_I evaluates its argument twice, and the second mapping
+  // would no longer get the hint, landing next to whatever mmap gives out
+  // later (the pager's fault thread stack), with no room to grow down
+  stack = mmap((caddr_t)0x8000000, STACK_SIZE, stack_prot, flags, -1, 0);
+  ASSERT_I((long)stack, "mmap");
   CMP_AND_FAIL(memcpy(stack, loader_stack, stack_size), stack, "memcpy");
   return stack;
 }
@@ -66,5 +72,63 @@ size_t loaderStackSize(char** envp, void *top_stack) {
   return ((unsigned long)(bottom_stack) - (unsigned long)(top_stack)) ;
 }
 
+/*
+ * Counters of a run. The loader never gets control back once it jumps
+ * into the program, so with LOADER_REPORT set it forks first: the child
+ * runs the program and keeps the counters in a shared page, the parent
+ * waits for it and prints them along with the wall time.
+ *
+ * */
+struct loader_report {
+  unsigned long faults;      // faults taken
+  unsigned long pages;       // pages mapped, faulted or around a fault
+  unsigned long predicted;   // pages mapped on a prediction
+  unsigned long pred_used;   // predicted pages the program used
+  unsigned long pred_wasted; // predicted pages it did not, so far
+};
+
+struct loader_report *start_report() {
+  static struct loader_report local;
+  struct loader_report *report;
+  struct timespec begin, end;
+  int status;
+  pid_t pid;
+
+  if (getenv("LOADER_REPORT") == NULL)
+    return &local;
+
+  report = mmap(NULL, sizeof(*report), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ASSERT_I((long)report, "mmap");
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  pid = fork();
+  ASSERT_I(pid, "fork");
+  if (pid == 0)
+    return report;
+
+  if (waitpid(pid, &status, 0) < 0) {
+    perror("waitpid");
+    exit(-1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fprintf(stderr, "faults %lu pages %lu wall_ms %.3f\n",
+      report->faults, report->pages,
+      (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6);
+
+  // accuracy: used of the predictions that were settled. coverage: the
+  // share of pages used that had no fault of their own
+  if (report->predicted)
+    fprintf(stderr, "predicted %lu used %lu wasted %lu pending %lu "
+        "accuracy %.1f%% coverage %.1f%% overmapped_kb %lu\n",
+        report->predicted, report->pred_used, report->pred_wasted,
+        report->predicted - report->pred_used - report->pred_wasted,
+        report->pred_used + report->pred_wasted ?
+        100.0 * report->pred_used / (report->pred_used + report->pred_wasted) : 0,
+        100.0 * report->pred_used / (report->pred_used + report->faults),
+        report->pred_wasted * sysconf(_SC_PAGE_SIZE) / 1024);
+  exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
 
 #endif /* End of _LOADER_H_ */
@@ -0,0 +1,215 @@
+/*
+ * Page predictors for the hybrid loader.
+ *
+ * Predictions are mapped before they are touched, so a good predictor
+ * sees no fault on the pages it got right: the next fault it sees is
+ * past them. The stride predictors expect that fault and keep their
+ * stride when it comes, instead of learning the stride of the jump.
+ *
+ * */
+#include <stdio.h>
+#include <string.h>
+
+#include "predictor.h"
+
+int predict_depth = 2;
+
+static int none_predict(unsigned long page, unsigned long *out) {
+  return 0;
+}
+
+static void none_reset() {
+}
+
+/*
+ * The old clairvoyant method: a confidence counter bumped when the
+ * fault is on the page it guessed, mapping one page ahead after one
+ * good guess and two after more. Always at most two pages.
+ *
+ * */
+static int correct_future_told;
+static unsigned long predicted_page;
+
+static void clairvoyant_reset() {
+  correct_future_told = 0;
+  predicted_page = 0;
+}
+
+static int clairvoyant_predict(unsigned long page, unsigned long *out) {
+  if (predicted_page == page) {
+    correct_future_told++;
+  } else {
+    if (correct_future_told > 0)
+      correct_future_told--;
+  }
+
+  if (correct_future_told == 1) {
+    out[0] = page + 1;
+    predicted_page = page + 1;
+    return 1;
+  } else if (correct_future_told >= 2) {
+    out[0] = page + 1;
+    out[1] = page + 2;
+    predicted_page = page + 2;
+    return 2;
+  }
+  predicted_page = page + 1;
+  return 0;
+}
+
+// next-N: the predict_depth pages after the fault, always
+static int next_predict(unsigned long page, unsigned long *out) {
+  int k;
+
+  for (k = 0; k < predict_depth; k++)
+    out[k] = page + k + 1;
+  return predict_depth;
+}
+
+/*
+ * Stride detection, on the whole fault stream (stride) or on each
+ * region of REGION_PAGES pages by itself (region), so streams that run
+ * through different arrays at once do not hide each other's stride.
+ * Two faults the same stride apart make it trusted.
+ *
+ * */
+struct stride_state {
+  unsigned long tag;      // region number, region predictor only
+  unsigned long last;     // page of the last fault
+  unsigned long expected; // first page past the last prediction
+  long stride;
+  int confidence;
+};
+
+static int stride_step(struct stride_state *s, unsigned long page, unsigned long *out) {
+  long stride = page - s->last;
+  int k;
+
+  if (s->confidence > 0 && page == s->expected) {
+    s->confidence++;
+  } else if (stride != 0 && stride == s->stride) {
+    s->confidence++;
+  } else {
+    s->stride = stride;
+    s->confidence = 0;
+  }
+  s->last = page;
+  if (s->confidence == 0 || s->stride == 0)
+    return 0;
+
+  for (k = 0; k < predict_depth; k++)
+    out[k] = page + (k + 1) * s->stride;
+  s->expected = page + (predict_depth + 1) * s->stride;
+  return predict_depth;
+}
+
+static struct stride_state global_stride;
+
+static void stride_reset() {
+  memset(&global_stride, 0, sizeof(global_stride));
+}
+
+static int stride_predict(unsigned long page, unsigned long *out) {
+  return stride_step(&global_stride, page, out);
+}
+
+#define REGION_PAGES 256
+#define REGION_SLOTS 64
+
+static struct stride_state regions[REGION_SLOTS];
+
+static void region_reset() {
+  memset(regions, 0, sizeof(regions));
+}
+
+static int region_predict(unsigned long page, unsigned long *out) {
+  unsigned long tag = page / REGION_PAGES;
+  struct stride_state *s = &regions[tag % REGION_SLOTS];
+
+  // a new region, or an old one pushed out of its slot
+  if (s->tag != tag || s->last == 0) {
+    memset(s, 0, sizeof(*s));
+    s->tag = tag;
+    s->last = page;
+    return 0;
+  }
+  return stride_step(s, page, out);
+}
+
+/*
+ * Markov: remembers, for each page, the page that faulted after it the
+ * last time, and predicts by following that chain from the fault.
+ * Learns nothing from a single pass over fresh pages, pays off on
+ * patterns that repeat.
+ *
+ * */
+#define MARKOV_SLOTS 4096
+
+static struct {
+  unsigned long page;
+  unsigned long next;
+} markov[MARKOV_SLOTS];
+static unsigned long markov_last;
+
+// FNV-1a over the page number
+static unsigned long markov_slot(unsigned long page) {
+  unsigned long hash = 2166136261UL;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    hash ^= (page >> (i * 8)) & 0xff;
+    hash *= 16777619UL;
+  }
+  return hash % MARKOV_SLOTS;
+}
+
+static void markov_reset() {
+  memset(markov, 0, sizeof(markov));
+  markov_last = 0;
+}
+
+static int markov_predict(unsigned long page, unsigned long *out) {
+  unsigned long slot, p = page;
+  int n = 0;
+
+  if (markov_last) {
+    slot = markov_slot(markov_last);
+    markov[slot].page = markov_last;
+    markov[slot].next = page;
+  }
+  markov_last = page;
+
+  while (n < predict_depth) {
+    slot = markov_slot(p);
+    if (markov[slot].page != p || markov[slot].next == page)
+      break;
+    p = markov[slot].next;
+    out[n++] = p;
+  }
+  return n;
+}
+
+static const struct predictor predictors[] = {
+  { "none", none_reset, none_predict },
+  { "clairvoyant", clairvoyant_reset, clairvoyant_predict },
+  { "next", none_reset, next_predict },
+  { "stride", stride_reset, stride_predict },
+  { "region", region_reset, region_predict },
+  { "markov", markov_reset, markov_predict },
+};
+
+const struct predictor *predictor_find(const char *name) {
+  int i;
+
+  for (i = 0; i < sizeof(predictors) / sizeof(predictors[0]); i++) {
+    if (strcmp(predictors[i].name, name) == 0) {
+      predictors[i].reset();
+      return &predictors[i];
+    }
+  }
+  return NULL;
+}
+
+const char *predictor_names() {
+  return "none clairvoyant next stride region markov";
+}
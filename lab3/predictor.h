@@ -0,0 +1,31 @@
+#ifndef _PREDICTOR_H_
+#define _PREDICTOR_H_
+
+// most pages one prediction may ask for
+#define PREDICT_MAX 64
+
+/*
+ * A page predictor. It sees the page numbers (address / page size) of
+ * the faults in order and answers each one with the pages it expects
+ * next, which the caller maps ahead of time. State is static and sized
+ * up front: in the loader the predictor runs after the program owns the
+ * heap.
+ *
+ * */
+struct predictor {
+  const char *name;
+  void (*reset)();
+  // page faulted, write up to predict_depth page numbers to out
+  int (*predict)(unsigned long page, unsigned long *out);
+};
+
+// how far ahead predictors look, 1..PREDICT_MAX
+extern int predict_depth;
+
+// NULL if there is no predictor of that name
+const struct predictor *predictor_find(const char *name);
+
+// names of all predictors, separated by spaces
+const char *predictor_names();
+
+#endif /* End of _PREDICTOR_H_ */
@@ -0,0 +1,220 @@
+/*
+ * Demand paging through userfaultfd.
+ *
+ * The segments are reserved up front as anonymous memory registered
+ * with a userfaultfd. The first touch of a page parks the faulting
+ * thread in the kernel and queues a message; the fault thread fills the
+ * page with UFFDIO_COPY (bytes from the file) or UFFDIO_ZEROPAGE (pure
+ * bss) and the kernel wakes the thread up. No signal is involved, so
+ * nothing runs in a signal handler, and the loaded program can install
+ * its own SIGSEGV handler. Faults taken inside system calls (a read()
+ * into bss) are served too, where the signal path gets EFAULT.
+ *
+ * The fault thread outlives the jump into the program and shares its
+ * address space, so it never allocates: the program owns the brk by
+ * then. A fork() in the program is not followed, the child sees zero
+ * pages where nothing was filled yet.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "uffd_pager.h"
+
+static int uffd = -1;
+static int elf_fd;
+static Elf64_Phdr *phHeader;
+static int phCount;
+static unsigned long pg_size;
+static char *page_buf;
+static uffd_fault_hook fault_hook;
+
+int uffd_pager_init(int fd, Elf64_Phdr *ph, int phnum)
+{
+  struct uffdio_api api;
+
+  elf_fd = fd;
+  phHeader = ph;
+  phCount = phnum;
+  pg_size = sysconf(_SC_PAGE_SIZE);
+
+  // UFFDIO_COPY wants a source that is not registered itself
+  page_buf = mmap(NULL, pg_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page_buf == MAP_FAILED)
+    return -1;
+
+  // not UFFD_USER_MODE_ONLY: faults from copy_to_user must come here too
+  if ((uffd = syscall(SYS_userfaultfd, O_CLOEXEC)) < 0)
+    return -1;
+
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  if (ioctl(uffd, UFFDIO_API, &api) < 0)
+    return -1;
+  return 0;
+}
+
+int uffd_pager_register(unsigned long start, unsigned long len, int prot)
+{
+  struct uffdio_register reg;
+  void *m_map;
+
+  m_map = mmap((void *)start, len, prot,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  if (m_map == MAP_FAILED)
+    return -1;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.range.start = start;
+  reg.range.len = len;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(uffd, UFFDIO_REGISTER, &reg) < 0)
+    return -1;
+
+  if ((reg.ioctls & ((1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE))) !=
+      ((1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE))) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * A page may hold the tail of one segment and the head of the next, so
+ * every PT_LOAD overlapping it is copied in. Whatever is past filesz
+ * stays zero.
+ *
+ * A pure bss page is mapped to the zero page, unless it is being
+ * written: that would take a second fault right away to copy it.
+ *
+ * */
+static int fill_page(unsigned long addr, int write)
+{
+  unsigned long page = addr & ~(pg_size - 1);
+  unsigned long lo, hi;
+  int i, known = 0, from_file = 0, ret;
+
+  for (i = 0; i < phCount; ++i) {
+    if (phHeader[i].p_type != PT_LOAD)
+      continue;
+    if (page >= phHeader[i].p_vaddr + phHeader[i].p_memsz ||
+        page + pg_size <= phHeader[i].p_vaddr)
+      continue;
+    known = 1;
+
+    lo = page > phHeader[i].p_vaddr ? page : phHeader[i].p_vaddr;
+    hi = phHeader[i].p_vaddr + phHeader[i].p_filesz;
+    if (hi > page + pg_size)
+      hi = page + pg_size;
+    if (lo >= hi)
+      continue;
+
+    if (!from_file)
+      memset(page_buf, 0, pg_size);
+    from_file = 1;
+    if (pread(elf_fd, page_buf + (lo - page), hi - lo,
+          phHeader[i].p_offset + (lo - phHeader[i].p_vaddr)) != (ssize_t)(hi - lo))
+      return -1;
+  }
+
+  if (!known) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  if (!from_file && write) {
+    memset(page_buf, 0, pg_size);
+    from_file = 1;
+  }
+
+  if (from_file) {
+    struct uffdio_copy copy;
+    copy.dst = page;
+    copy.src = (unsigned long)page_buf;
+    copy.len = pg_size;
+    copy.mode = 0;
+    ret = ioctl(uffd, UFFDIO_COPY, &copy);
+  } else {
+    struct uffdio_zeropage zero;
+    zero.range.start = page;
+    zero.range.len = pg_size;
+    zero.mode = 0;
+    ret = ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+  }
+
+  // a prediction got there first. whoever faulted on it still sleeps
+  if (ret < 0 && errno == EEXIST) {
+    struct uffdio_range range;
+    range.start = page;
+    range.len = pg_size;
+    if (ioctl(uffd, UFFDIO_WAKE, &range) < 0)
+      return -1;
+    return 1;
+  }
+  return ret;
+}
+
+int uffd_pager_fill(unsigned long addr)
+{
+  return fill_page(addr, 0);
+}
+
+static void *fault_loop(void *arg)
+{
+  struct uffd_msg msg;
+  ssize_t n;
+
+  for (;;) {
+    n = read(uffd, &msg, sizeof(msg));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n != sizeof(msg)) {
+      perror("userfaultfd read");
+      _exit(-1);
+    }
+    if (msg.event != UFFD_EVENT_PAGEFAULT)
+      continue;
+
+    // the program is stuck on this page, nothing else to do but die
+    if (fill_page(msg.arg.pagefault.address,
+          msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) < 0) {
+      perror("userfaultfd fill");
+      _exit(-1);
+    }
+    if (fault_hook)
+      fault_hook(msg.arg.pagefault.address);
+  }
+  return NULL;
+}
+
+int uffd_pager_start(uffd_fault_hook hook)
+{
+  pthread_t tid;
+  sigset_t all, old;
+  int err;
+
+  fault_hook = hook;
+
+  // the program's signals go to the program
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&tid, NULL, fault_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
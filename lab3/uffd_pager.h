@@ -0,0 +1,24 @@
+#ifndef _UFFD_PAGER_H_
+#define _UFFD_PAGER_H_
+
+#include <elf.h>
+
+// run on the fault thread after each fault is served, addr is the
+// faulting address
+typedef void (*uffd_fault_hook)(unsigned long addr);
+
+// open the userfaultfd. Pages are filled from the PT_LOAD entries of ph,
+// read from fd. -1 with errno set on failure
+int uffd_pager_init(int fd, Elf64_Phdr *ph, int phnum);
+
+// reserve [start, start + len) and hand its faults to the pager. start
+// and len are page aligned
+int uffd_pager_register(unsigned long start, unsigned long len, int prot);
+
+// fill the page holding addr. 1 if it was there already
+int uffd_pager_fill(unsigned long addr);
+
+// start the fault thread
+int uffd_pager_start(uffd_fault_hook hook);
+
+#endif /* End of _UFFD_PAGER_H_ */